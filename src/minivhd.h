@@ -24,7 +24,8 @@ typedef enum MVHDError {
     MVHD_ERR_INVALID_SIZE,
     MVHD_ERR_INVALID_BLOCK_SIZE,
     MVHD_ERR_INVALID_PARAMS,    
-    MVHD_ERR_CONV_SIZE
+    MVHD_ERR_CONV_SIZE,
+    MVHD_ERR_QUEUE_FULL
 } MVHDError;
 
 typedef enum MVHDType {
@@ -47,6 +48,52 @@ typedef struct MVHDGeom {
 
 typedef void (*mvhd_progress_callback)(uint32_t current_sector, uint32_t total_sectors);
 
+/**
+ * A buffer in a scatter/gather list, as used by mvhd_readv() and mvhd_writev()
+ */
+typedef struct MVHDIOVec {
+    void* base; /** Start of the buffer */
+    size_t len; /** Length of the buffer in bytes */
+} MVHDIOVec;
+
+/**
+ * Storage backend for a VHD image.
+ * 
+ * By default, MiniVHD stores images in files. A custom backend can be supplied to 
+ * mvhd_open_storage() or mvhd_create_ex() to keep an image somewhere else, such as 
+ * in memory. Every callback receives the ctx pointer that was supplied alongside the 
+ * ops table. Offsets and sizes are in bytes.
+ */
+typedef struct MVHDStorageOps {
+    /** Read len bytes at offset into buf. Return the number of bytes read, which is 
+        only less than len at the end of the storage or on error */
+    size_t (*read_at)(void* ctx, void* buf, size_t len, int64_t offset);
+    /** Write len bytes from buf at offset, growing the storage if required. Return the 
+        number of bytes written, which is only less than len on error */
+    size_t (*write_at)(void* ctx, const void* buf, size_t len, int64_t offset);
+    /** Return the current size of the storage, or -1 on error */
+    int64_t (*size)(void* ctx);
+    /** Extend (or shrink) the storage to new_size. Added bytes must read back as zero. 
+        Return 0 on success */
+    int (*set_size)(void* ctx, int64_t new_size);
+    /** Make previous writes durable. Return 0 on success */
+    int (*flush)(void* ctx);
+    /** Optional, may be NULL. Release the space used by a range, which must then read 
+        back as zero. Return 0 on success */
+    int (*punch_hole)(void* ctx, int64_t offset, int64_t len);
+    /** Optional, may be NULL. Called when the image is closed */
+    void (*close)(void* ctx);
+    /** Optional, may be NULL. Allocate space for a range in one go, extending the storage 
+        if the range ends past it. Added bytes must read back as zero. Return 0 on success */
+    int (*reserve)(void* ctx, int64_t offset, int64_t len);
+    /** Optional, may be NULL. Like read_at, but reads into each buffer of iov in turn. 
+        Return the total number of bytes read */
+    size_t (*readv_at)(void* ctx, const MVHDIOVec* iov, int iovcnt, int64_t offset);
+    /** Optional, may be NULL. Like write_at, but writes from each buffer of iov in turn. 
+        Return the total number of bytes written */
+    size_t (*writev_at)(void* ctx, const MVHDIOVec* iov, int iovcnt, int64_t offset);
+} MVHDStorageOps;
+
 typedef struct MVHDCreationOptions {
     int type; /** MVHD_TYPE_FIXED, MVHD_TYPE_DYNAMIC, or MVHD_TYPE_DIFF */
     char* path; /** Absolute path of the new VHD file */
@@ -55,10 +102,59 @@ typedef struct MVHDCreationOptions {
     MVHDGeom geometry; /** The geometry of the VHD. If set to 0, the geometry is auto-calculated from the size_in_bytes field. */
     uint32_t block_size_in_sectors; /** MVHD_BLOCK_LARGE or MVHD_BLOCK_SMALL, or 0 for the default value. The number of sectors per block. */
     mvhd_progress_callback progress_callback; /** Optional; if not NULL, gets called to indicate progress on the creation operation. Only applies to MVHD_TYPE_FIXED. */
+    const MVHDStorageOps* storage_ops; /** Optional; if not NULL, the image is created on this storage backend instead of in a file at path. path is still required, and is used to locate the parent of a differencing image */
+    void* storage_ctx; /** Passed to every storage_ops callback. Ignored if storage_ops is NULL */
 } MVHDCreationOptions;
 
 typedef struct MVHDMeta MVHDMeta;
 
+typedef enum MVHDAsyncOp {
+    MVHD_ASYNC_READ = 0,  /**< Read sectors, like mvhd_read_sectors() */
+    MVHD_ASYNC_WRITE = 1, /**< Write sectors, like mvhd_write_sectors() */
+    MVHD_ASYNC_FLUSH = 2, /**< Flush the image, like mvhd_flush() */
+    MVHD_ASYNC_DISCARD = 3 /**< Discard sectors, like mvhd_discard_sectors() */
+} MVHDAsyncOp;
+
+/**
+ * An asynchronous I/O request, submitted with mvhd_async_submit(). The request is owned by 
+ * the caller, and must stay valid, together with its buffer, until it has been returned by 
+ * mvhd_async_poll() or mvhd_async_wait()
+ */
+typedef struct MVHDAsyncRequest {
+    MVHDAsyncOp op; /** What to do */
+    uint32_t offset; /** The first sector to read, write or discard. Ignored for flushes */
+    int num_sectors; /** The number of sectors to read, write or discard. Ignored for flushes */
+    void* buff; /** The buffer to read into or write from. Ignored for flushes and discards */
+    void* user_data; /** Not used by MiniVHD */
+    int result; /** Set on completion. For reads, writes and discards, the number of sectors that were not transferred, or zero. For flushes, the return value of mvhd_flush() */
+} MVHDAsyncRequest;
+
+typedef struct MVHDAsyncQueue MVHDAsyncQueue;
+
+typedef enum MVHDAdvice {
+    MVHD_ADVICE_NORMAL = 0,     /**< No particular access pattern. Clears an earlier sequential or random hint */
+    MVHD_ADVICE_SEQUENTIAL = 1, /**< The range will be read in order. Readahead runs at full size from the first read */
+    MVHD_ADVICE_RANDOM = 2,     /**< The range will be read in no particular order. Reads in it never start readahead */
+    MVHD_ADVICE_WILLNEED = 3,   /**< The range will be read soon, so it is prefetched straight away */
+    MVHD_ADVICE_DONTNEED = 4    /**< The range will not be read soon. Data prefetched for it is dropped */
+} MVHDAdvice;
+
+typedef enum MVHDExtentType {
+    MVHD_EXTENT_ZERO = 0, /**< Unallocated in every layer, reads as zero */
+    MVHD_EXTENT_DATA = 1  /**< Allocated data, stored in the layer given by MVHDExtent.layer */
+} MVHDExtentType;
+
+/**
+ * A run of sectors sharing the same allocation state, as returned by mvhd_get_extents()
+ */
+typedef struct MVHDExtent {
+    uint32_t offset; /** The first sector of the run */
+    uint32_t num_sectors; /** The number of sectors in the run */
+    MVHDExtentType type; /** Whether the run holds data or reads as zero */
+    int layer; /** For data runs, 0 if the data is in the image itself, 1 if in its parent, 2 for the grandparent etc. -1 for zero runs */
+    int64_t file_offset; /** For data runs, the byte offset of the first sector in that layer's file. -1 for zero runs */
+} MVHDExtent;
+
 /**
  * \brief Output a string from a MiniVHD error number
  * 
@@ -84,6 +180,11 @@ bool mvhd_file_is_vhd(FILE* f);
  * The returned pointer contains all required values and structures (and files) to 
  * read and write to a VHD file.
  * 
+ * The parents of a differencing image are opened read-only, and shared within the process: 
+ * differencing images referring to the same parent file and UUID use a single handle for 
+ * it, together with its BAT and sector bitmap cache. A shared parent is kept in thread-safe 
+ * mode, and is closed when the last image using it is closed.
+ * 
  * Remember to call mvhd_close() when you are finished.
  * 
  * \param [in] Absolute path to VHD file. Relative path will cause issues when opening
@@ -98,6 +199,46 @@ bool mvhd_file_is_vhd(FILE* f);
  */
 MVHDMeta* mvhd_open(const char* path, bool readonly, int* err);
 
+/**
+ * \brief Open a VHD image, memory mapping it if it is a fixed image
+ * 
+ * Works like mvhd_open(). In addition, the data area of a fixed image is mapped into 
+ * memory, so that reads and writes are plain memory copies, and mvhd_map_sectors() 
+ * can be used to access sectors without any copy at all. Writes reach the file when 
+ * mvhd_flush() or mvhd_close() is called, or whenever the OS decides to write them.
+ * 
+ * Sparse and differencing images, or fixed images that cannot be mapped, are opened 
+ * exactly as mvhd_open() would.
+ * 
+ * \param [in] path Absolute path to VHD file
+ * \param [in] readonly set this to true to open the VHD in a read only manner
+ * \param [out] err will be set if the VHD fails to open. See mvhd_open()
+ * 
+ * \return MVHDMeta pointer. If NULL, check err.
+ */
+MVHDMeta* mvhd_open_mapped(const char* path, bool readonly, int* err);
+
+/**
+ * \brief Open a VHD image stored on a custom storage backend
+ * 
+ * Works like mvhd_open(), but reads and writes the image through ops instead of a 
+ * file. If the image is a differencing image, its parents are located using path 
+ * and opened as files.
+ * 
+ * On success the handle takes ownership of ctx, and ops->close (if set) is called 
+ * by mvhd_close(). On failure, ctx is left untouched for the caller to release.
+ * 
+ * \param [in] path Absolute path of the image. Only used to locate parent images, may 
+ * be NULL for fixed and dynamic images
+ * \param [in] ops the storage backend callbacks
+ * \param [in] ctx passed to every callback in ops
+ * \param [in] readonly set this to true to open the VHD in a read only manner
+ * \param [out] err will be set if the VHD fails to open. See mvhd_open()
+ * 
+ * \return MVHDMeta pointer. If NULL, check err.
+ */
+MVHDMeta* mvhd_open_storage(const char* path, const MVHDStorageOps* ops, void* ctx, bool readonly, int* err);
+
 /**
  * \brief Create a fixed VHD image
  * 
@@ -218,6 +359,22 @@ FILE* mvhd_convert_to_raw(const char* utf8_vhd_path, const char* utf8_raw_path,
  */
 int mvhd_read_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff);
 
+/**
+ * \brief Read sectors from VHD file into a scatter/gather list
+ * 
+ * Like mvhd_read_sectors(), but the sectors are spread over the buffers of iov, in turn. 
+ * A sector may be split between buffers. Where the storage backend supports it, runs of 
+ * sectors are read straight into several buffers at once.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start reading from
+ * \param [in] iov the buffers to read into. Their total length must be a multiple of 512
+ * \param [in] iovcnt the number of elements in iov
+ * 
+ * \return the number of sectors that were not read, or zero, or MVHD_ERR_INVALID_PARAMS
+ */
+int mvhd_readv(MVHDMeta* vhdm, uint32_t offset, const MVHDIOVec* iov, int iovcnt);
+
 /**
  * \brief Write sectors to VHD file
  * 
@@ -232,6 +389,22 @@ int mvhd_read_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* ou
  */
 int mvhd_write_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
 
+/**
+ * \brief Write sectors to VHD file from a scatter/gather list
+ * 
+ * Like mvhd_write_sectors(), but the sectors are gathered from the buffers of iov, in turn. 
+ * A sector may be split between buffers. Where the storage backend supports it, runs of 
+ * sectors are written straight from several buffers at once.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start writing to
+ * \param [in] iov the buffers to write from. Their total length must be a multiple of 512
+ * \param [in] iovcnt the number of elements in iov
+ * 
+ * \return the number of sectors that were not written, or zero, or MVHD_ERR_INVALID_PARAMS
+ */
+int mvhd_writev(MVHDMeta* vhdm, uint32_t offset, const MVHDIOVec* iov, int iovcnt);
+
 /**
  * \brief Write zeroed sectors to VHD file
  * 
@@ -246,4 +419,351 @@ int mvhd_write_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* i
  * \return the number of sectors that were not written, or zero
  */
 int mvhd_format_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
-#endif
\ No newline at end of file
+
+/**
+ * \brief Discard sectors of VHD file
+ * 
+ * The sectors read back as zero afterwards. Unlike mvhd_format_sectors(), no space is 
+ * allocated for them:
+ * 
+ * - In fixed images, the sectors become a hole in the file, where the host supports that.
+ * - In sparse images, the sectors are marked unallocated. Blocks left without allocated 
+ *   sectors become sparse again, and their file space is released to the host.
+ * - In differencing images, sectors are marked unallocated where the parent reads as zero, 
+ *   and overwritten with zeros elsewhere.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the sector offset from which to start discarding
+ * \param [in] num_sectors the number of sectors to discard
+ * 
+ * \return the number of sectors that were not discarded, or zero
+ */
+int mvhd_discard_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Set the number of block sector bitmaps cached in memory
+ * 
+ * Sparse and differencing images store a sector bitmap in front of every data block. 
+ * MiniVHD keeps the bitmaps of the most recently used blocks in memory, so that I/O 
+ * which alternates between blocks does not have to re-read them from file. The 
+ * default is 16 blocks. The setting is applied to the image and all of its parents. As 
+ * parents are shared (see mvhd_open()), this also affects other images with the same parents.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] num_blocks the number of block bitmaps to cache, between 1 and 4096
+ * 
+ * \retval 0 if the cache was resized
+ * \retval MVHD_ERR_INVALID_PARAMS if num_blocks is out of range
+ * \retval MVHD_ERR_MEM if the new cache could not be allocated. The old cache is kept
+ */
+int mvhd_set_bitmap_cache_size(MVHDMeta* vhdm, int num_blocks);
+
+/**
+ * \brief Get the sector bitmap cache statistics of an image
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [out] hits the number of bitmap lookups served from memory
+ * \param [out] misses the number of bitmap lookups that required reading the file
+ */
+void mvhd_get_bitmap_cache_stats(MVHDMeta* vhdm, uint64_t* hits, uint64_t* misses);
+
+/**
+ * \brief Enable or disable write-back of sparse image metadata
+ * 
+ * By default, every write to a sparse or differencing image immediately updates the 
+ * affected sector bitmaps and Block Allocation Table entries in the file. In write-back 
+ * mode these updates are kept in memory, and written in batches, in file offset order, 
+ * when mvhd_flush() or mvhd_close() is called, or once dirty_threshold bytes of metadata 
+ * are pending.
+ * 
+ * Note, if the process exits without calling mvhd_flush() or mvhd_close(), sectors 
+ * written since the last flush may read back as zero (or parent data).
+ * 
+ * Disabling write-back mode flushes pending metadata first. This function has no effect 
+ * on fixed or read-only images.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] enable true to enable write-back mode, false to disable it
+ * \param [in] dirty_threshold the number of bytes of dirty metadata to hold before writing 
+ * it to file. If 0, a default of 1 MB is used
+ * 
+ * \retval 0 on success
+ * \retval MVHD_ERR_MEM if memory for tracking dirty metadata could not be allocated
+ */
+int mvhd_set_write_back(MVHDMeta* vhdm, bool enable, size_t dirty_threshold);
+
+/**
+ * \brief Reserve space for new blocks ahead of time
+ * 
+ * A sparse or differencing image normally grows one block at a time, as blocks are first 
+ * written to. With a reservation, whenever the image runs out of space it allocates room 
+ * for num_blocks blocks past the end of the data in one go, and hands out new blocks from 
+ * that space. This keeps the file in fewer pieces on the host file system. Space still 
+ * unused is given back when the image is closed. Where the storage can not reserve space, 
+ * such as files on platforms without fallocate() or posix_fallocate(), blocks are allocated 
+ * one at a time as usual.
+ * 
+ * This function has no effect on fixed or read-only images.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] num_blocks the number of blocks to reserve at a time. 0 disables the reservation
+ * 
+ * \retval 0 on success
+ * \retval MVHD_ERR_INVALID_PARAMS if num_blocks is negative
+ */
+int mvhd_set_block_reservation(MVHDMeta* vhdm, int num_blocks);
+
+/**
+ * \brief Enable or disable zero write elision for an image
+ * 
+ * With zero write elision, sectors which are written with all-zero data are stored by 
+ * discarding them (see mvhd_discard_sectors()) rather than writing them. Zeroing a disk, 
+ * with mvhd_format_sectors() or by writing zeros, then no longer allocates blocks for it, 
+ * and may even free blocks again. Writes are checked for zeros one block at a time.
+ * 
+ * This function has no effect on fixed or read-only images.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] enable true to enable zero write elision, false to disable it
+ * 
+ * \retval 0 on success
+ */
+int mvhd_set_zero_write_elision(MVHDMeta* vhdm, bool enable);
+
+/**
+ * \brief Enable or disable readahead for an image
+ * 
+ * With readahead, reads which follow on from each other are detected, and the data 
+ * following them is prefetched into a buffer by a background thread, ahead of the next 
+ * read. A few such streams are tracked at once. The distance read ahead of a stream 
+ * grows as it keeps going, up to the size of the buffer. Differencing images are 
+ * prefetched through their whole chain. Writes and discards drop any prefetched data 
+ * they overlap.
+ * 
+ * This enables thread-safe mode for the image (see mvhd_set_thread_safe()), as the 
+ * prefetching runs in parallel with other I/O. Disabling thread-safe mode disables 
+ * readahead again. This function has no effect on memory mapped images.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] max_sectors the size of the readahead buffer in sectors, up to 131072. 0 
+ * disables readahead
+ * 
+ * \retval 0 on success
+ * \retval MVHD_ERR_INVALID_PARAMS if max_sectors is out of range
+ * \retval MVHD_ERR_MEM if the buffer or the background thread could not be created
+ */
+int mvhd_set_readahead(MVHDMeta* vhdm, int max_sectors);
+
+/**
+ * \brief Set the amount of memory used to cache sector data
+ * 
+ * The data cache keeps recently read parts of the virtual disk in memory, in chunks of 
+ * 64 KB, so that frequently read sectors, such as file system metadata, are not read 
+ * from the image again every time. This saves the most on differencing images, where a 
+ * read may otherwise go through several files. A chunk is cached once it has been read, 
+ * and kept in preference to others once it has been read again, so a single pass over 
+ * the disk does not flush out frequently used data.
+ * 
+ * Writes update the chunks they overlap. In thread-safe mode, they drop them instead. 
+ * Discards drop the chunks they overlap.
+ * 
+ * Changing the size empties the cache and resets its statistics. This function has no 
+ * effect on memory mapped images.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] max_bytes the memory to use for cached data, rounded down to a multiple of 
+ * 64 KB, up to 64 GB. 0 disables the cache
+ * 
+ * \retval 0 on success
+ * \retval MVHD_ERR_INVALID_PARAMS if max_bytes is out of range
+ * \retval MVHD_ERR_MEM if the cache could not be allocated. The cache is disabled in this case
+ */
+int mvhd_set_data_cache(MVHDMeta* vhdm, size_t max_bytes);
+
+/**
+ * \brief Get the sector data cache statistics of an image
+ * 
+ * Both counts are zero while the data cache is disabled.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [out] hits the number of 64 KB chunks read from the cache
+ * \param [out] misses the number of 64 KB chunks that had to be read from the image
+ */
+void mvhd_get_data_cache_stats(MVHDMeta* vhdm, uint64_t* hits, uint64_t* misses);
+
+/**
+ * \brief Tell MiniVHD how a range of sectors is going to be read
+ * 
+ * MVHD_ADVICE_SEQUENTIAL, MVHD_ADVICE_RANDOM and MVHD_ADVICE_NORMAL replace any earlier 
+ * hint of these kinds, and affect how reads are matched to streams. MVHD_ADVICE_WILLNEED 
+ * and MVHD_ADVICE_DONTNEED act on the readahead buffer straight away. WILLNEED prefetches 
+ * no more than fits in the buffer.
+ * 
+ * If readahead is disabled, MVHD_ADVICE_SEQUENTIAL and MVHD_ADVICE_WILLNEED enable it with 
+ * a 2 MB buffer, as mvhd_set_readahead() would. The other hints are ignored in that case. 
+ * Once readahead is enabled, this function may be called while other threads use the handle.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the first sector of the range
+ * \param [in] num_sectors the number of sectors in the range. 0 means up to the end of the disk
+ * \param [in] advice the expected access pattern
+ * 
+ * \retval 0 on success
+ * \retval MVHD_ERR_INVALID_PARAMS if num_sectors is negative, or advice is unknown
+ * \retval MVHD_ERR_MEM if readahead had to be enabled, and that failed
+ */
+int mvhd_advise(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDAdvice advice);
+
+/**
+ * \brief Enable or disable thread-safe mode for an image
+ * 
+ * By default, an image handle must only be used by one thread at a time. In thread-safe 
+ * mode, a handle may be shared between threads as follows:
+ * 
+ * - mvhd_read_sectors(), mvhd_get_extents(), mvhd_get_bitmap_cache_stats(), 
+ *   mvhd_get_data_cache_stats() and mvhd_advise() may be called from any number of threads 
+ *   at once, and run in parallel with each other.
+ * - mvhd_write_sectors(), mvhd_format_sectors() and mvhd_discard_sectors() may be called 
+ *   from any number of threads at once, and run in parallel with reads and with each other. 
+ *   On sparse and differencing images, writes to the same block take turns, and allocating 
+ *   new blocks is serialised.
+ * - mvhd_flush() may be called from any thread, and runs while no read or write is in progress.
+ * - Reads and writes of overlapping sectors running at the same time may see each other's 
+ *   data partially, just like concurrent I/O to a real disk.
+ * - mvhd_close(), mvhd_set_thread_safe() and the other mvhd_set_*() functions must only be 
+ *   called while no other thread is using the handle.
+ * - mvhd_errno is shared by all threads, and may be overwritten by another thread before 
+ *   it is read.
+ * 
+ * The setting applies to the whole differencing chain of the image, except that parents, 
+ * which are shared between images (see mvhd_open()), are always in thread-safe mode.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] enable true to enable thread-safe mode, false to disable it
+ * 
+ * \retval 0 on success
+ * \retval MVHD_ERR_MEM if the locks could not be created
+ */
+int mvhd_set_thread_safe(MVHDMeta* vhdm, bool enable);
+
+/**
+ * \brief Write all pending metadata and buffered data to the VHD file
+ * 
+ * Pending metadata includes the footer at the end of a dynamic or differencing image, 
+ * which is only moved to the new end of the file here or in mvhd_close() after new 
+ * blocks have been allocated.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \retval 0 on success
+ * \retval MVHD_ERR_MEM if a temporary buffer could not be allocated
+ * \retval MVHD_ERR_FILE if the file could not be flushed. mvhd_errno will be set to the 
+ * appropriate system errno value
+ */
+int mvhd_flush(MVHDMeta* vhdm);
+
+/**
+ * \brief Get a pointer to sectors of a memory mapped fixed image
+ * 
+ * The returned pointer is borrowed from the image, and stays valid until mvhd_close() 
+ * is called. For images opened read/write, the sectors may be modified through it, 
+ * although the pointer is declared const to discourage that for read only images.
+ * 
+ * \param [in] vhdm MiniVHD data structure, opened with mvhd_open_mapped()
+ * \param [in] offset the sector offset to map
+ * \param [in] num_sectors the number of sectors wanted
+ * \param [out] len the number of bytes available at the returned pointer. This may be 
+ * less than num_sectors worth if the range extends past the end of the disk
+ * 
+ * \return a pointer to the sector at offset, or NULL if the image is not mapped or 
+ * offset is out of range
+ */
+const void* mvhd_map_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, size_t* len);
+
+/**
+ * \brief Get the allocation state of a range of sectors without reading them
+ * 
+ * The range is described as a list of runs, each either reading as zero, or holding 
+ * data in a particular layer of the image (the image itself, or one of its parents). 
+ * Adjacent runs are merged where they share a type, layer and contiguous file offsets.
+ * 
+ * If the extents array fills up before the whole range is described, call again 
+ * starting from the end of the last extent returned.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset the first sector of the range
+ * \param [in] num_sectors the number of sectors in the range. The range is truncated at the end of the disk
+ * \param [out] extents array to store the runs in
+ * \param [in] max_extents the number of elements in extents
+ * 
+ * \return the number of extents stored, or MVHD_ERR_INVALID_PARAMS
+ */
+int mvhd_get_extents(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDExtent* extents, int max_extents);
+
+/**
+ * \brief Create a queue for asynchronous I/O requests to an image
+ * 
+ * Requests submitted to the queue run in the background, and may complete in any order. 
+ * On Linux, reads of file backed images, and writes to fixed images, are passed to the 
+ * kernel with io_uring where it is available. Everything else, including all requests 
+ * on other platforms, is carried out by a small pool of worker threads.
+ * 
+ * This enables thread-safe mode for the image (see mvhd_set_thread_safe()), as requests 
+ * run in parallel. Thread-safe mode stays enabled after the queue is destroyed.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] queue_depth the maximum number of requests in flight at once
+ * \param [out] err MVHD_ERR_INVALID_PARAMS if queue_depth is not positive, or MVHD_ERR_MEM
+ * 
+ * \return the new queue, or NULL on error
+ */
+MVHDAsyncQueue* mvhd_async_create(MVHDMeta* vhdm, int queue_depth, int* err);
+
+/**
+ * \brief Submit a request to an asynchronous queue
+ * 
+ * A flush only covers the writes that completed before it was submitted. To flush a 
+ * write, wait for the write to complete first.
+ * 
+ * \param [in] q the queue
+ * \param [in] req the request. It must not be touched until it has been completed
+ * 
+ * \retval 0 on success
+ * \retval MVHD_ERR_QUEUE_FULL if queue_depth requests have already been submitted and not 
+ * yet returned by mvhd_async_poll() or mvhd_async_wait()
+ * \retval MVHD_ERR_INVALID_PARAMS if the request is invalid
+ */
+int mvhd_async_submit(MVHDAsyncQueue* q, MVHDAsyncRequest* req);
+
+/**
+ * \brief Collect completed requests without waiting
+ * 
+ * \param [in] q the queue
+ * \param [out] done array to store the completed requests in
+ * \param [in] max the number of elements in done
+ * 
+ * \return the number of requests stored in done
+ */
+int mvhd_async_poll(MVHDAsyncQueue* q, MVHDAsyncRequest** done, int max);
+
+/**
+ * \brief Collect completed requests, waiting until at least one has completed
+ * 
+ * \param [in] q the queue
+ * \param [out] done array to store the completed requests in
+ * \param [in] max the number of elements in done
+ * 
+ * \return the number of requests stored in done. This is only zero if no requests are in flight
+ */
+int mvhd_async_wait(MVHDAsyncQueue* q, MVHDAsyncRequest** done, int max);
+
+/**
+ * \brief Destroy an asynchronous queue
+ * 
+ * Waits for all requests in flight to complete. Completed requests which have not been 
+ * collected are dropped. Must be called before the image is closed.
+ * 
+ * \param [in] q the queue
+ */
+void mvhd_async_destroy(MVHDAsyncQueue* q);
+#endif
@@ -0,0 +1,747 @@
+/**
+ * \file
+ * \brief Asynchronous I/O requests
+ *
+ * Requests are carried out by a small pool of worker threads, which simply call the
+ * blocking read, write, flush and discard functions with the image in thread-safe mode.
+ *
+ * On Linux, reads of images whose whole chain is stored in files, and writes to fixed
+ * images, are passed to the kernel with io_uring instead. Such a request is mapped to
+ * file offsets with mvhd_get_extents(), sectors which read as zero are cleared straight
+ * away, and every run of data becomes one read or write of the file holding it. A reaper
+ * thread collects the results from the completion queue. Requests which are mapped to too
+ * many runs, or which can not be done this way at all, go to the thread pool.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MVHD_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
+#include "minivhd_internal.h"
+#include "minivhd_cache.h"
+#include "minivhd_readahead.h"
+#include "minivhd_util.h"
+#include "minivhd.h"
+
+/* Number of worker threads, unless the queue is shallower than that */
+#define MVHD_ASYNC_POOL_THREADS 4
+
+/* Maximum number of runs a request may be split into to be done with io_uring */
+#define MVHD_ASYNC_MAX_PARTS 16
+
+#ifdef MVHD_IO_URING
+/* Most entries an io_uring can be created with */
+#define MVHD_URING_MAX_ENTRIES 32768
+
+/* user_data of the no-op which tells the reaper thread to stop */
+#define MVHD_URING_STOP UINT64_MAX
+
+/* A run of sectors read or written with a single io_uring operation */
+typedef struct MVHDAsyncPart {
+    int fd;
+    uint8_t* buff;
+    uint32_t len;
+    int64_t file_offset;
+} MVHDAsyncPart;
+
+/* A request passed to io_uring */
+typedef struct MVHDAsyncSlot {
+    MVHDAsyncRequest* req;
+    MVHDAsyncPart parts[MVHD_ASYNC_MAX_PARTS];
+    int num_parts;
+    int remaining;
+    int truncated;
+    bool failed;
+    int next_free;
+} MVHDAsyncSlot;
+
+typedef struct MVHDUring {
+    bool active;
+    int fd;
+    void* sq_ring;
+    size_t sq_ring_len;
+    void* cq_ring;
+    size_t cq_ring_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned cq_entries;
+    unsigned parts_in_flight;
+    int* layer_fds; /* File descriptor of every layer of the chain, or NULL if any layer is not a file */
+    MVHDAsyncSlot* slots;
+    int free_slot;
+    int busy_slots;
+    MVHDThread reaper;
+} MVHDUring;
+#endif
+
+struct MVHDAsyncQueue {
+    MVHDMeta* vhdm;
+    int depth;
+    int in_flight; /* Submitted and not yet collected */
+    bool stopping;
+    MVHDMutex lock;
+    MVHDCond work_cond; /* Signalled when a request is queued for the pool, or when stopping */
+    MVHDCond done_cond; /* Signalled when a request completes */
+    MVHDAsyncRequest** pending; /* Ring of requests waiting for a worker thread */
+    int pending_head;
+    int pending_count;
+    MVHDAsyncRequest** done; /* Ring of completed requests waiting to be collected */
+    int done_head;
+    int done_count;
+    MVHDThread* threads;
+    int num_threads;
+#ifdef MVHD_IO_URING
+    MVHDUring ring;
+#endif
+};
+
+static void mvhd_async_push_done(MVHDAsyncQueue* q, MVHDAsyncRequest* req);
+static void mvhd_async_worker(void* arg);
+static int mvhd_async_start_pool(MVHDAsyncQueue* q);
+static void mvhd_async_stop_pool(MVHDAsyncQueue* q);
+#ifdef MVHD_IO_URING
+static void mvhd_uring_init(MVHDAsyncQueue* q);
+static void mvhd_uring_destroy(MVHDAsyncQueue* q);
+static int mvhd_uring_enter_queued(MVHDUring* ring);
+static int mvhd_uring_map(MVHDAsyncQueue* q, MVHDAsyncRequest* req, MVHDExtent* extents, int* transfer);
+static bool mvhd_uring_submit(MVHDAsyncQueue* q, MVHDAsyncRequest* req, const MVHDExtent* extents, int count, int transfer);
+static bool mvhd_uring_transfer_rest(const MVHDAsyncPart* part, bool write, int res);
+static void mvhd_uring_finish_part(MVHDAsyncQueue* q, MVHDAsyncSlot* slot);
+static void mvhd_uring_reaper(void* arg);
+#endif
+
+/**
+ * \brief Queue a completed request for collection. Must be called with q->lock held
+ */
+static void mvhd_async_push_done(MVHDAsyncQueue* q, MVHDAsyncRequest* req) {
+    q->done[(q->done_head + q->done_count) % q->depth] = req;
+    q->done_count++;
+    mvhd_cond_broadcast(&q->done_cond);
+}
+
+/**
+ * \brief Carry out requests queued for the thread pool, until the queue is destroyed
+ *
+ * \param [in] arg the queue
+ */
+static void mvhd_async_worker(void* arg) {
+    MVHDAsyncQueue* q = (MVHDAsyncQueue*)arg;
+    mvhd_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->pending_count == 0 && !q->stopping) {
+            mvhd_cond_wait(&q->work_cond, &q->lock);
+        }
+        if (q->pending_count == 0) {
+            break;
+        }
+        MVHDAsyncRequest* req = q->pending[q->pending_head];
+        q->pending_head = (q->pending_head + 1) % q->depth;
+        q->pending_count--;
+        mvhd_mutex_unlock(&q->lock);
+        switch (req->op) {
+        case MVHD_ASYNC_READ:
+            req->result = mvhd_read_sectors(q->vhdm, req->offset, req->num_sectors, req->buff);
+            break;
+        case MVHD_ASYNC_WRITE:
+            req->result = mvhd_write_sectors(q->vhdm, req->offset, req->num_sectors, req->buff);
+            break;
+        case MVHD_ASYNC_FLUSH:
+            req->result = mvhd_flush(q->vhdm);
+            break;
+        case MVHD_ASYNC_DISCARD:
+            req->result = mvhd_discard_sectors(q->vhdm, req->offset, req->num_sectors);
+            break;
+        }
+        mvhd_mutex_lock(&q->lock);
+        mvhd_async_push_done(q, req);
+    }
+    mvhd_mutex_unlock(&q->lock);
+}
+
+/**
+ * \brief Start the worker threads of a queue
+ *
+ * \param [in] q the queue
+ *
+ * \retval 0 on success
+ * \retval -1 if no thread could be started
+ */
+static int mvhd_async_start_pool(MVHDAsyncQueue* q) {
+    int num_threads = q->depth < MVHD_ASYNC_POOL_THREADS ? q->depth : MVHD_ASYNC_POOL_THREADS;
+    q->threads = calloc(num_threads, sizeof *q->threads);
+    if (q->threads == NULL) {
+        return -1;
+    }
+    for (q->num_threads = 0; q->num_threads < num_threads; q->num_threads++) {
+        if (mvhd_thread_create(&q->threads[q->num_threads], mvhd_async_worker, q) != 0) {
+            break;
+        }
+    }
+    /* Fewer threads than asked for will do */
+    return q->num_threads > 0 ? 0 : -1;
+}
+
+/**
+ * \brief Let the worker threads finish the queued requests, and wait for them to exit
+ *
+ * \param [in] q the queue
+ */
+static void mvhd_async_stop_pool(MVHDAsyncQueue* q) {
+    mvhd_mutex_lock(&q->lock);
+    q->stopping = true;
+    mvhd_cond_broadcast(&q->work_cond);
+    mvhd_mutex_unlock(&q->lock);
+    for (int i = 0; i < q->num_threads; i++) {
+        mvhd_thread_join(q->threads[i]);
+    }
+    free(q->threads);
+    q->threads = NULL;
+    q->num_threads = 0;
+}
+
+#ifdef MVHD_IO_URING
+/**
+ * \brief Set up an io_uring for a queue, and start its reaper thread
+ *
+ * Leaves q->ring.active false if io_uring can not be used, in which case every request
+ * goes to the thread pool.
+ *
+ * \param [in] q the queue
+ */
+static void mvhd_uring_init(MVHDAsyncQueue* q) {
+    MVHDUring* ring = &q->ring;
+    ring->fd = -1;
+    int num_layers = 0;
+    for (MVHDMeta* curr = q->vhdm; curr != NULL; curr = curr->parent) {
+        if (curr->storage != &mvhd_file_storage_ops) {
+            return;
+        }
+        num_layers++;
+    }
+    ring->layer_fds = calloc(num_layers, sizeof *ring->layer_fds);
+    ring->slots = calloc(q->depth, sizeof *ring->slots);
+    if (ring->layer_fds == NULL || ring->slots == NULL) {
+        goto fail;
+    }
+    int layer = 0;
+    for (MVHDMeta* curr = q->vhdm; curr != NULL; curr = curr->parent) {
+        ring->layer_fds[layer++] = fileno((FILE*)curr->storage_ctx);
+    }
+    for (int i = 0; i < q->depth; i++) {
+        ring->slots[i].next_free = i + 1 < q->depth ? i + 1 : -1;
+    }
+    ring->free_slot = 0;
+
+    /* One entry for every part of every request, plus one to stop the reaper */
+    unsigned entries = MVHD_URING_MAX_ENTRIES;
+    if ((int64_t)q->depth * MVHD_ASYNC_MAX_PARTS + 1 < entries) {
+        entries = (unsigned)q->depth * MVHD_ASYNC_MAX_PARTS + 1;
+    }
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        goto fail;
+    }
+    ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_len > ring->sq_ring_len) {
+            ring->sq_ring_len = ring->cq_ring_len;
+        }
+        ring->cq_ring_len = ring->sq_ring_len;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+    uint8_t* sq = ring->sq_ring;
+    uint8_t* cq = ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->cq_entries = params.cq_entries;
+    if (mvhd_thread_create(&ring->reaper, mvhd_uring_reaper, q) != 0) {
+        goto fail;
+    }
+    ring->active = true;
+    return;
+fail:
+    mvhd_uring_destroy(q);
+}
+
+/**
+ * \brief Stop the reaper thread of a queue once all io_uring requests have completed, and
+ * tear down the io_uring
+ *
+ * \param [in] q the queue
+ */
+static void mvhd_uring_destroy(MVHDAsyncQueue* q) {
+    MVHDUring* ring = &q->ring;
+    if (ring->active) {
+        mvhd_mutex_lock(&q->lock);
+        mvhd_uring_enter_queued(ring);
+        while (ring->busy_slots > 0) {
+            mvhd_cond_wait(&q->done_cond, &q->lock);
+        }
+        unsigned tail = *ring->sq_tail;
+        unsigned idx = tail & *ring->sq_mask;
+        struct io_uring_sqe* sqe = &ring->sqes[idx];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = MVHD_URING_STOP;
+        ring->sq_array[idx] = idx;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        mvhd_uring_enter_queued(ring);
+        mvhd_mutex_unlock(&q->lock);
+        mvhd_thread_join(ring->reaper);
+        ring->active = false;
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->slots);
+    free(ring->layer_fds);
+    memset(ring, 0, sizeof *ring);
+    ring->fd = -1;
+}
+
+/**
+ * \brief Pass every queued submission queue entry to the kernel. Must be called with q->lock held
+ *
+ * \param [in] ring the io_uring
+ *
+ * \retval 0 if all entries were consumed
+ * \retval -1 if the kernel refused some. They stay queued, and are passed again on the next call
+ */
+static int mvhd_uring_enter_queued(MVHDUring* ring) {
+    unsigned queued;
+    while ((queued = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) > 0) {
+        if (syscall(__NR_io_uring_enter, ring->fd, queued, 0, 0, NULL, 0) < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Map a request to the runs of file data it covers, for passing it to io_uring
+ *
+ * Called without q->lock held, as working out the runs may read sector bitmaps. Sectors 
+ * of a read which read as zero are cleared in the request's buffer.
+ *
+ * \param [in] q the queue
+ * \param [in] req the request
+ * \param [out] extents room for MVHD_ASYNC_MAX_PARTS runs
+ * \param [out] transfer the number of sectors of the request which lie within the image
+ *
+ * \return the number of runs, or 0 if the request must go to the thread pool instead
+ */
+static int mvhd_uring_map(MVHDAsyncQueue* q, MVHDAsyncRequest* req, MVHDExtent* extents, int* transfer) {
+    MVHDMeta* vhdm = q->vhdm;
+    if (!q->ring.active || req->num_sectors <= 0) {
+        return 0;
+    }
+    if (req->op == MVHD_ASYNC_WRITE && (vhdm->footer.disk_type != MVHD_TYPE_FIXED || vhdm->readonly)) {
+        return 0;
+    }
+    if (req->op != MVHD_ASYNC_READ && req->op != MVHD_ASYNC_WRITE) {
+        return 0;
+    }
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    if (req->offset >= total_sectors) {
+        return 0;
+    }
+    *transfer = req->num_sectors;
+    if ((uint32_t)*transfer > total_sectors - req->offset) {
+        *transfer = (int)(total_sectors - req->offset);
+    }
+    int count = mvhd_get_extents(vhdm, req->offset, *transfer, extents, MVHD_ASYNC_MAX_PARTS);
+    if (count <= 0) {
+        return 0;
+    }
+    MVHDExtent* last = &extents[count - 1];
+    if (last->offset + last->num_sectors != req->offset + (uint32_t)*transfer) {
+        /* Too fragmented */
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (extents[i].type == MVHD_EXTENT_ZERO) {
+            memset((uint8_t*)req->buff + (size_t)(extents[i].offset - req->offset) * MVHD_SECTOR_SIZE, 0, 
+                   (size_t)extents[i].num_sectors * MVHD_SECTOR_SIZE);
+        }
+    }
+    return count;
+}
+
+/**
+ * \brief Pass a request to io_uring. Must be called with q->lock held
+ *
+ * \param [in] q the queue
+ * \param [in] req the request
+ * \param [in] extents the runs the request was mapped to by mvhd_uring_map()
+ * \param [in] count the number of runs
+ * \param [in] transfer the number of sectors of the request which lie within the image
+ *
+ * \retval true if the request was submitted, or completed straight away
+ * \retval false if the request must go to the thread pool instead
+ */
+static bool mvhd_uring_submit(MVHDAsyncQueue* q, MVHDAsyncRequest* req, const MVHDExtent* extents, int count, int transfer) {
+    MVHDUring* ring = &q->ring;
+    int num_parts = 0;
+    for (int i = 0; i < count; i++) {
+        num_parts += extents[i].type == MVHD_EXTENT_DATA;
+    }
+    unsigned sq_used = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->parts_in_flight + num_parts > ring->cq_entries || sq_used + num_parts > ring->sq_entries) {
+        return false;
+    }
+
+    MVHDAsyncSlot* slot = &ring->slots[ring->free_slot];
+    int slot_idx = ring->free_slot;
+    ring->free_slot = slot->next_free;
+    ring->busy_slots++;
+    slot->req = req;
+    slot->num_parts = 0;
+    slot->truncated = req->num_sectors - transfer;
+    slot->failed = false;
+    uint8_t* buff = (uint8_t*)req->buff;
+    for (int i = 0; i < count; i++) {
+        uint8_t* pos = buff + (size_t)(extents[i].offset - req->offset) * MVHD_SECTOR_SIZE;
+        uint32_t len = extents[i].num_sectors * MVHD_SECTOR_SIZE;
+        if (extents[i].type == MVHD_EXTENT_ZERO) {
+            continue;
+        }
+        MVHDAsyncPart* part = &slot->parts[slot->num_parts++];
+        part->fd = ring->layer_fds[extents[i].layer];
+        part->buff = pos;
+        part->len = len;
+        part->file_offset = extents[i].file_offset;
+    }
+    slot->remaining = slot->num_parts;
+    if (slot->num_parts == 0) {
+        req->result = slot->truncated;
+        slot->next_free = ring->free_slot;
+        ring->free_slot = slot_idx;
+        ring->busy_slots--;
+        mvhd_async_push_done(q, req);
+        return true;
+    }
+
+    unsigned tail = *ring->sq_tail;
+    for (int i = 0; i < slot->num_parts; i++) {
+        unsigned idx = (tail + i) & *ring->sq_mask;
+        struct io_uring_sqe* sqe = &ring->sqes[idx];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = req->op == MVHD_ASYNC_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->fd = slot->parts[i].fd;
+        sqe->addr = (uint64_t)(uintptr_t)slot->parts[i].buff;
+        sqe->len = slot->parts[i].len;
+        sqe->off = (uint64_t)slot->parts[i].file_offset;
+        sqe->user_data = (uint64_t)slot_idx * MVHD_ASYNC_MAX_PARTS + i;
+        ring->sq_array[idx] = idx;
+    }
+    __atomic_store_n(ring->sq_tail, tail + slot->num_parts, __ATOMIC_RELEASE);
+    ring->parts_in_flight += slot->num_parts;
+    if (mvhd_uring_enter_queued(ring) != 0 && __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == tail) {
+        /* None of the entries were consumed by the kernel, so take them back */
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        ring->parts_in_flight -= slot->num_parts;
+        slot->next_free = ring->free_slot;
+        ring->free_slot = slot_idx;
+        ring->busy_slots--;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * \brief Transfer whatever a short io_uring operation left over with plain positional I/O
+ *
+ * Called without q->lock held.
+ *
+ * \param [in] part a copy of the part
+ * \param [in] write true if the part is written, false if it is read
+ * \param [in] res the result of the io_uring operation
+ *
+ * \retval true if the whole part has now been transferred
+ * \retval false if an error occurred
+ */
+static bool mvhd_uring_transfer_rest(const MVHDAsyncPart* part, bool write, int res) {
+    uint32_t done = res > 0 ? (uint32_t)res : 0;
+    while (done < part->len) {
+        ssize_t n;
+        if (write) {
+            n = pwrite(part->fd, part->buff + done, part->len - done, (off_t)(part->file_offset + done));
+        } else {
+            n = pread(part->fd, part->buff + done, part->len - done, (off_t)(part->file_offset + done));
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            mvhd_errno = n < 0 ? errno : EIO;
+            return false;
+        }
+        done += (uint32_t)n;
+    }
+    return true;
+}
+
+/**
+ * \brief Account for a completed part of a request, and complete the request once it 
+ * was the last. Must be called with q->lock held
+ *
+ * \param [in] q the queue
+ * \param [in] slot the request the part belongs to
+ */
+static void mvhd_uring_finish_part(MVHDAsyncQueue* q, MVHDAsyncSlot* slot) {
+    MVHDUring* ring = &q->ring;
+    ring->parts_in_flight--;
+    if (--slot->remaining > 0) {
+        return;
+    }
+    MVHDAsyncRequest* req = slot->req;
+    req->result = slot->failed ? req->num_sectors : slot->truncated;
+    if (req->op == MVHD_ASYNC_WRITE) {
+        /* These writes bypass mvhd_write_sectors() */
+        mvhd_readahead_invalidate(q->vhdm, req->offset, req->num_sectors);
+        mvhd_cache_invalidate(q->vhdm, req->offset, req->num_sectors);
+    }
+    int slot_idx = (int)(slot - ring->slots);
+    slot->req = NULL;
+    slot->next_free = ring->free_slot;
+    ring->free_slot = slot_idx;
+    ring->busy_slots--;
+    mvhd_async_push_done(q, req);
+}
+
+/**
+ * \brief Collect io_uring completions, until told to stop
+ *
+ * \param [in] arg the queue
+ */
+static void mvhd_uring_reaper(void* arg) {
+    MVHDAsyncQueue* q = (MVHDAsyncQueue*)arg;
+    MVHDUring* ring = &q->ring;
+    bool stop = false;
+    while (!stop) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+        mvhd_mutex_lock(&q->lock);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data == MVHD_URING_STOP) {
+                stop = true;
+                continue;
+            }
+            MVHDAsyncSlot* slot = &ring->slots[cqe->user_data / MVHD_ASYNC_MAX_PARTS];
+            MVHDAsyncPart* part = &slot->parts[cqe->user_data % MVHD_ASYNC_MAX_PARTS];
+            if (cqe->res < 0 || (uint32_t)cqe->res < part->len) {
+                /* The slot stays busy until its last part is finished, so only this 
+                 * thread touches it while the rest is transferred unlocked */
+                MVHDAsyncPart rest = *part;
+                bool write = slot->req->op == MVHD_ASYNC_WRITE;
+                int res = cqe->res;
+                mvhd_mutex_unlock(&q->lock);
+                bool ok = mvhd_uring_transfer_rest(&rest, write, res);
+                mvhd_mutex_lock(&q->lock);
+                if (!ok) {
+                    slot->failed = true;
+                }
+            }
+            mvhd_uring_finish_part(q, slot);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        mvhd_mutex_unlock(&q->lock);
+    }
+}
+#endif
+
+MVHDAsyncQueue* mvhd_async_create(MVHDMeta* vhdm, int queue_depth, int* err) {
+    if (vhdm == NULL || queue_depth <= 0) {
+        *err = MVHD_ERR_INVALID_PARAMS;
+        return NULL;
+    }
+    *err = MVHD_ERR_MEM;
+    MVHDAsyncQueue* q = calloc(1, sizeof *q);
+    if (q == NULL) {
+        goto end;
+    }
+    q->vhdm = vhdm;
+    q->depth = queue_depth;
+    q->pending = calloc(queue_depth, sizeof *q->pending);
+    q->done = calloc(queue_depth, sizeof *q->done);
+    if (q->pending == NULL || q->done == NULL) {
+        goto cleanup_queue;
+    }
+    if (mvhd_set_thread_safe(vhdm, true) != 0) {
+        goto cleanup_queue;
+    }
+    if (mvhd_mutex_init(&q->lock) != 0) {
+        goto cleanup_queue;
+    }
+    if (mvhd_cond_init(&q->work_cond) != 0) {
+        goto cleanup_lock;
+    }
+    if (mvhd_cond_init(&q->done_cond) != 0) {
+        goto cleanup_work_cond;
+    }
+    if (mvhd_async_start_pool(q) != 0) {
+        goto cleanup_pool;
+    }
+#ifdef MVHD_IO_URING
+    mvhd_uring_init(q);
+#endif
+    *err = 0;
+    goto end;
+cleanup_pool:
+    mvhd_async_stop_pool(q);
+    mvhd_cond_destroy(&q->done_cond);
+cleanup_work_cond:
+    mvhd_cond_destroy(&q->work_cond);
+cleanup_lock:
+    mvhd_mutex_destroy(&q->lock);
+cleanup_queue:
+    free(q->done);
+    free(q->pending);
+    free(q);
+    q = NULL;
+end:
+    return q;
+}
+
+int mvhd_async_submit(MVHDAsyncQueue* q, MVHDAsyncRequest* req) {
+    if (req == NULL) {
+        return MVHD_ERR_INVALID_PARAMS;
+    }
+    if (req->op == MVHD_ASYNC_READ || req->op == MVHD_ASYNC_WRITE) {
+        if (req->num_sectors < 0 || (req->num_sectors > 0 && req->buff == NULL)) {
+            return MVHD_ERR_INVALID_PARAMS;
+        }
+    } else if (req->op == MVHD_ASYNC_DISCARD) {
+        if (req->num_sectors < 0) {
+            return MVHD_ERR_INVALID_PARAMS;
+        }
+    } else if (req->op != MVHD_ASYNC_FLUSH) {
+        return MVHD_ERR_INVALID_PARAMS;
+    }
+    mvhd_mutex_lock(&q->lock);
+    if (q->in_flight == q->depth) {
+        mvhd_mutex_unlock(&q->lock);
+        return MVHD_ERR_QUEUE_FULL;
+    }
+    q->in_flight++;
+#ifdef MVHD_IO_URING
+    /* Mapping the request may read sector bitmaps, so it is done without holding up 
+     * other submitters and the reaper */
+    mvhd_mutex_unlock(&q->lock);
+    MVHDExtent extents[MVHD_ASYNC_MAX_PARTS];
+    int transfer = 0;
+    int count = mvhd_uring_map(q, req, extents, &transfer);
+    mvhd_mutex_lock(&q->lock);
+    if (count > 0 && mvhd_uring_submit(q, req, extents, count, transfer)) {
+        mvhd_mutex_unlock(&q->lock);
+        return 0;
+    }
+#endif
+    q->pending[(q->pending_head + q->pending_count) % q->depth] = req;
+    q->pending_count++;
+    mvhd_cond_signal(&q->work_cond);
+    mvhd_mutex_unlock(&q->lock);
+    return 0;
+}
+
+int mvhd_async_poll(MVHDAsyncQueue* q, MVHDAsyncRequest** done, int max) {
+    int count = 0;
+    mvhd_mutex_lock(&q->lock);
+    for (; count < max && q->done_count > 0; count++) {
+        done[count] = q->done[q->done_head];
+        q->done_head = (q->done_head + 1) % q->depth;
+        q->done_count--;
+    }
+    q->in_flight -= count;
+    mvhd_mutex_unlock(&q->lock);
+    return count;
+}
+
+int mvhd_async_wait(MVHDAsyncQueue* q, MVHDAsyncRequest** done, int max) {
+    mvhd_mutex_lock(&q->lock);
+    while (q->done_count == 0 && q->in_flight > 0 && max > 0) {
+        mvhd_cond_wait(&q->done_cond, &q->lock);
+    }
+    mvhd_mutex_unlock(&q->lock);
+    return mvhd_async_poll(q, done, max);
+}
+
+void mvhd_async_destroy(MVHDAsyncQueue* q) {
+    if (q == NULL) {
+        return;
+    }
+    mvhd_async_stop_pool(q);
+#ifdef MVHD_IO_URING
+    mvhd_uring_destroy(q);
+#endif
+    mvhd_cond_destroy(&q->done_cond);
+    mvhd_cond_destroy(&q->work_cond);
+    mvhd_mutex_destroy(&q->lock);
+    free(q->done);
+    free(q->pending);
+    free(q);
+}
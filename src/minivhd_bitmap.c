@@ -0,0 +1,255 @@
+/**
+ * \file
+ * \brief Sector bitmap scanning and manipulation
+ *
+ * The bitmaps are scanned 64 bits at a time. Words are loaded in big endian order, so
+ * the first sector of a word is its most significant bit, and the first set bit can be
+ * found by counting leading zeros. Long stretches of all-zero or all-one bytes are
+ * skipped 32 bytes at a time with AVX2, where available.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MVHD_X86_SIMD
+#include <immintrin.h>
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include "minivhd_bitmap.h"
+
+/* The following bit array macros adapted from
+   http://www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html */
+
+#define VHD_SETBIT(A,k)     ( A[(k/8)] |= (0x80 >> (k%8)) )
+#define VHD_CLEARBIT(A,k)   ( A[(k/8)] &= ~(0x80 >> (k%8)) )
+#define VHD_TESTBIT(A,k)    ( A[(k/8)] & (0x80 >> (k%8)) )
+
+#define MVHD_ALL_BITS (~(uint64_t)0)
+
+static inline uint64_t mvhd_bitmap_load(const uint8_t* bytes, int num_bytes);
+static inline int mvhd_clz64(uint64_t val);
+static inline int mvhd_popcount64(uint64_t val);
+static int mvhd_bitmap_skip_fill(const uint8_t* bitmap, int byte_start, int byte_end, uint8_t fill);
+static int mvhd_bitmap_find(const uint8_t* bitmap, int start, int end, bool want_set);
+static bool mvhd_bitmap_fill_range(uint8_t* bitmap, int start, int end, bool set);
+
+/**
+ * \brief Load 64 bits of a bitmap as a big endian word
+ *
+ * \param [in] bytes The first byte of the word
+ * \param [in] num_bytes The number of bytes that may be accessed. Missing bytes read as zero
+ *
+ * \return The word, with the first sector in the most significant bit
+ */
+static inline uint64_t mvhd_bitmap_load(const uint8_t* bytes, int num_bytes) {
+    if (num_bytes >= 8) {
+        /* Compilers turn this into a single load and byte swap */
+        return ((uint64_t)bytes[0] << 56) | ((uint64_t)bytes[1] << 48) |
+               ((uint64_t)bytes[2] << 40) | ((uint64_t)bytes[3] << 32) |
+               ((uint64_t)bytes[4] << 24) | ((uint64_t)bytes[5] << 16) |
+               ((uint64_t)bytes[6] << 8)  | ((uint64_t)bytes[7] << 0);
+    }
+    uint64_t word = 0;
+    for (int i = 0; i < 8; i++) {
+        word = (word << 8) | (i < num_bytes ? bytes[i] : 0);
+    }
+    return word;
+}
+
+/**
+ * \brief Count the leading zero bits of a non-zero word
+ */
+static inline int mvhd_clz64(uint64_t val) {
+#if defined(__GNUC__)
+    return __builtin_clzll(val);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long idx;
+    _BitScanReverse64(&idx, val);
+    return 63 - (int)idx;
+#else
+    int n = 0;
+    while (!(val & 0x8000000000000000ULL)) {
+        val <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/**
+ * \brief Count the set bits of a word
+ */
+static inline int mvhd_popcount64(uint64_t val) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(val);
+#else
+    val = val - ((val >> 1) & 0x5555555555555555ULL);
+    val = (val & 0x3333333333333333ULL) + ((val >> 2) & 0x3333333333333333ULL);
+    val = (val + (val >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((val * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+#ifdef MVHD_X86_SIMD
+__attribute__((target("avx2")))
+static int mvhd_bitmap_skip_fill_avx2(const uint8_t* bitmap, int byte_start, int byte_end, uint8_t fill) {
+    const __m256i ones = _mm256_set1_epi8((char)0xff);
+    int i = byte_start;
+    for (; i + 32 <= byte_end; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(bitmap + i));
+        if (fill == 0x00 ? !_mm256_testz_si256(v, v) : !_mm256_testc_si256(v, ones)) {
+            break;
+        }
+    }
+    return i;
+}
+#endif
+
+/**
+ * \brief Skip over bytes of a bitmap which all equal fill
+ *
+ * This only skips 32 byte chunks, and only where AVX2 is available. The caller
+ * is expected to scan whatever remains word by word.
+ *
+ * \param [in] bitmap The sector bitmap to scan
+ * \param [in] byte_start The first byte to look at
+ * \param [in] byte_end One past the last byte that may be accessed
+ * \param [in] fill The byte value to skip, 0x00 or 0xff
+ *
+ * \return The first byte, counting from byte_start in steps of 32, which was not skipped
+ */
+static int mvhd_bitmap_skip_fill(const uint8_t* bitmap, int byte_start, int byte_end, uint8_t fill) {
+#ifdef MVHD_X86_SIMD
+    if (byte_end - byte_start >= 32 && __builtin_cpu_supports("avx2")) {
+        return mvhd_bitmap_skip_fill_avx2(bitmap, byte_start, byte_end, fill);
+    }
+#endif
+    (void)bitmap;
+    (void)byte_end;
+    (void)fill;
+    return byte_start;
+}
+
+/**
+ * \brief Find the first bit in a range with the wanted state
+ *
+ * \param [in] bitmap The sector bitmap to scan
+ * \param [in] start The first sector to look at
+ * \param [in] end One past the last sector to look at
+ * \param [in] want_set true to look for a set bit, false to look for a clear bit
+ *
+ * \return The first matching bit, or end if there is none
+ */
+static int mvhd_bitmap_find(const uint8_t* bitmap, int start, int end, bool want_set) {
+    if (start >= end) {
+        return end;
+    }
+    int byte_end = (end + 7) / 8;
+    /* Flip the bits when looking for a clear bit, so that we always look for a set one */
+    uint64_t flip = want_set ? 0 : MVHD_ALL_BITS;
+    int w = start / 64;
+    uint64_t word = (mvhd_bitmap_load(bitmap + w * 8, byte_end - w * 8) ^ flip) & (MVHD_ALL_BITS >> (start % 64));
+    while (word == 0) {
+        w++;
+        if (w * 64 >= end) {
+            return end;
+        }
+        w = mvhd_bitmap_skip_fill(bitmap, w * 8, byte_end, want_set ? 0x00 : 0xff) / 8;
+        if (w * 64 >= end) {
+            return end;
+        }
+        word = mvhd_bitmap_load(bitmap + w * 8, byte_end - w * 8) ^ flip;
+    }
+    /* Bits past the end of the range may match too */
+    int pos = w * 64 + mvhd_clz64(word);
+    return pos < end ? pos : end;
+}
+
+int mvhd_bitmap_find_next_set(const uint8_t* bitmap, int start, int end) {
+    return mvhd_bitmap_find(bitmap, start, end, true);
+}
+
+int mvhd_bitmap_find_next_clear(const uint8_t* bitmap, int start, int end) {
+    return mvhd_bitmap_find(bitmap, start, end, false);
+}
+
+int mvhd_bitmap_run_len(const uint8_t* bitmap, int start, int end, bool* is_set) {
+    *is_set = VHD_TESTBIT(bitmap, start) != 0;
+    return mvhd_bitmap_find(bitmap, start + 1, end, !*is_set) - start;
+}
+
+int mvhd_bitmap_count(const uint8_t* bitmap, int start, int end) {
+    if (start >= end) {
+        return 0;
+    }
+    int byte_end = (end + 7) / 8;
+    int count = 0;
+    for (int w = start / 64; w * 64 < end; w++) {
+        uint64_t word = mvhd_bitmap_load(bitmap + w * 8, byte_end - w * 8);
+        if (w == start / 64) {
+            word &= MVHD_ALL_BITS >> (start % 64);
+        }
+        if ((w + 1) * 64 > end) {
+            word &= ~(MVHD_ALL_BITS >> (end - w * 64));
+        }
+        count += mvhd_popcount64(word);
+    }
+    return count;
+}
+
+/**
+ * \brief Set or clear a range of bits
+ *
+ * \param [in] bitmap The sector bitmap to update
+ * \param [in] start The first sector to update
+ * \param [in] end One past the last sector to update
+ * \param [in] set true to set the bits, false to clear them
+ *
+ * \return Whether any bit in the range changed
+ */
+static bool mvhd_bitmap_fill_range(uint8_t* bitmap, int start, int end, bool set) {
+    bool changed = false;
+    int k = start;
+    /* Leading bits, up to a byte boundary */
+    for (; k < end && k % 8 != 0; k++) {
+        if ((VHD_TESTBIT(bitmap, k) != 0) != set) {
+            if (set) {
+                VHD_SETBIT(bitmap, k);
+            } else {
+                VHD_CLEARBIT(bitmap, k);
+            }
+            changed = true;
+        }
+    }
+    /* Whole bytes */
+    int whole_end = end - (end % 8);
+    if (k < whole_end) {
+        if (mvhd_bitmap_find(bitmap, k, whole_end, !set) < whole_end) {
+            memset(bitmap + k / 8, set ? 0xff : 0x00, (size_t)(whole_end - k) / 8);
+            changed = true;
+        }
+        k = whole_end;
+    }
+    /* And the trailing bits */
+    for (; k < end; k++) {
+        if ((VHD_TESTBIT(bitmap, k) != 0) != set) {
+            if (set) {
+                VHD_SETBIT(bitmap, k);
+            } else {
+                VHD_CLEARBIT(bitmap, k);
+            }
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool mvhd_bitmap_set_range(uint8_t* bitmap, int start, int end) {
+    return mvhd_bitmap_fill_range(bitmap, start, end, true);
+}
+
+bool mvhd_bitmap_clear_range(uint8_t* bitmap, int start, int end) {
+    return mvhd_bitmap_fill_range(bitmap, start, end, false);
+}
@@ -0,0 +1,84 @@
+#ifndef MINIVHD_BITMAP_H
+#define MINIVHD_BITMAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Functions to work with VHD sector bitmaps.
+ *
+ * A sector bitmap holds one bit per sector of a block, most significant bit first, so
+ * sector k is bit (0x80 >> (k % 8)) of byte k / 8. Ranges are given as [start, end), in
+ * sectors (bits). No byte past the one holding the last bit of a range is accessed.
+ */
+
+/**
+ * \brief Find the first allocated sector in a range
+ *
+ * \param [in] bitmap The sector bitmap to scan
+ * \param [in] start The first sector to look at
+ * \param [in] end One past the last sector to look at
+ *
+ * \return The first set bit in the range, or end if there is none
+ */
+int mvhd_bitmap_find_next_set(const uint8_t* bitmap, int start, int end);
+
+/**
+ * \brief Find the first unallocated sector in a range
+ *
+ * \param [in] bitmap The sector bitmap to scan
+ * \param [in] start The first sector to look at
+ * \param [in] end One past the last sector to look at
+ *
+ * \return The first clear bit in the range, or end if there is none
+ */
+int mvhd_bitmap_find_next_clear(const uint8_t* bitmap, int start, int end);
+
+/**
+ * \brief Find the length of a run of sectors sharing the same bitmap state
+ *
+ * \param [in] bitmap The sector bitmap to scan
+ * \param [in] start The first sector of the run. Must be less than end
+ * \param [in] end One past the last sector that may be part of the run
+ * \param [out] is_set Whether the sectors in the run are allocated
+ *
+ * \return The number of sectors in the run. Always at least 1
+ */
+int mvhd_bitmap_run_len(const uint8_t* bitmap, int start, int end, bool* is_set);
+
+/**
+ * \brief Count the allocated sectors in a range
+ *
+ * \param [in] bitmap The sector bitmap to scan
+ * \param [in] start The first sector to count
+ * \param [in] end One past the last sector to count
+ *
+ * \return The number of set bits in the range
+ */
+int mvhd_bitmap_count(const uint8_t* bitmap, int start, int end);
+
+/**
+ * \brief Mark a range of sectors as allocated
+ *
+ * \param [in] bitmap The sector bitmap to update
+ * \param [in] start The first sector to set
+ * \param [in] end One past the last sector to set
+ *
+ * \retval true if any bit in the range was previously clear
+ * \retval false if the whole range was already set
+ */
+bool mvhd_bitmap_set_range(uint8_t* bitmap, int start, int end);
+
+/**
+ * \brief Mark a range of sectors as unallocated
+ *
+ * \param [in] bitmap The sector bitmap to update
+ * \param [in] start The first sector to clear
+ * \param [in] end One past the last sector to clear
+ *
+ * \retval true if any bit in the range was previously set
+ * \retval false if the whole range was already clear
+ */
+bool mvhd_bitmap_clear_range(uint8_t* bitmap, int start, int end);
+
+#endif
@@ -0,0 +1,415 @@
+/**
+ * \file
+ * \brief Cache of sector data
+ *
+ * The cache holds aligned chunks of the virtual disk, looked up by chunk number in a hash
+ * table. Eviction follows a segmented LRU scheme: chunks enter a probation segment when
+ * they are read, and move to a protected segment when they are read again. Chunks are
+ * evicted from the probation segment first, so a long scan through the disk only pushes
+ * out other chunks that have been used once. A read which carries on where the previous
+ * read of a chunk ended is taken as part of the same access, so the chunks a sequential
+ * scan reads in several pieces are not promoted either. When the protected segment grows
+ * past its share of the cache, its least recently used chunks drop back into probation.
+ *
+ * Chunks missing from the cache are filled with a single read for each run of them, which
+ * goes through readahead when that is enabled. A counter of changes to the cached data
+ * keeps a fill which raced with a write from adding stale data.
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* for pthread_rwlock_t */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "minivhd_internal.h"
+#include "minivhd_cache.h"
+#include "minivhd_io.h"
+#include "minivhd_readahead.h"
+#include "minivhd_util.h"
+#include "minivhd.h"
+
+/* Sectors per cached chunk */
+#define MVHD_CACHE_CHUNK 128
+
+/* Most chunks filled with a single read */
+#define MVHD_CACHE_FILL_MAX 16
+
+/* Largest number of chunks mvhd_set_data_cache() accepts, 64 GB worth */
+#define MVHD_CACHE_MAX_CHUNKS (1 << 20)
+
+/* Percentage of the cache the protected segment may take up */
+#define MVHD_CACHE_PROTECTED_PCT 80
+
+typedef enum MVHDCacheSegment {
+    MVHD_CACHE_FREE = -1,
+    MVHD_CACHE_PROBATION = 0,
+    MVHD_CACHE_PROTECTED = 1
+} MVHDCacheSegment;
+
+typedef struct MVHDCacheEntry {
+    uint32_t chunk; /* Sector offset / MVHD_CACHE_CHUNK */
+    int num_sectors;
+    uint32_t seq_next; /* The sector following the last read of the chunk */
+    MVHDCacheSegment segment;
+    int prev; /* Towards the most recently used end of the segment, or -1 */
+    int next; /* Towards the least recently used end of the segment, or -1. Links free entries */
+    int hash_next;
+    uint8_t* data;
+} MVHDCacheEntry;
+
+typedef struct MVHDCacheList {
+    int head; /* Most recently used */
+    int tail; /* Least recently used */
+    int count;
+} MVHDCacheList;
+
+struct MVHDDataCache {
+    uint32_t total_sectors;
+    MVHDCacheEntry* entries;
+    int num_entries;
+    uint8_t* data;
+    int* buckets;
+    uint32_t bucket_mask;
+    int free_entry;
+    MVHDCacheList segments[2];
+    int max_protected;
+    uint64_t gen; /* Bumped whenever cached data changes */
+    uint64_t hits;
+    uint64_t misses;
+    MVHDMutex lock;
+};
+
+static uint32_t mvhd_dc_bucket(MVHDDataCache* cache, uint32_t chunk);
+static int mvhd_dc_lookup(MVHDDataCache* cache, uint32_t chunk);
+static void mvhd_dc_unlink(MVHDDataCache* cache, int idx);
+static void mvhd_dc_push(MVHDDataCache* cache, int idx, MVHDCacheSegment segment);
+static void mvhd_dc_touch(MVHDDataCache* cache, int idx);
+static void mvhd_dc_remove(MVHDDataCache* cache, int idx);
+static void mvhd_dc_insert(MVHDDataCache* cache, uint32_t chunk, int num_sectors, const uint8_t* data, uint32_t seq_next);
+static int mvhd_dc_read_through(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out);
+
+static uint32_t mvhd_dc_bucket(MVHDDataCache* cache, uint32_t chunk) {
+    chunk ^= chunk >> 16;
+    chunk *= 0x45d9f3bu;
+    chunk ^= chunk >> 16;
+    return chunk & cache->bucket_mask;
+}
+
+/**
+ * \brief Find a chunk in the cache. Must be called with cache->lock held
+ *
+ * \return the index of the chunk's entry, or -1 if it is not cached
+ */
+static int mvhd_dc_lookup(MVHDDataCache* cache, uint32_t chunk) {
+    int idx = cache->buckets[mvhd_dc_bucket(cache, chunk)];
+    while (idx >= 0 && cache->entries[idx].chunk != chunk) {
+        idx = cache->entries[idx].hash_next;
+    }
+    return idx;
+}
+
+/**
+ * \brief Take an entry out of its segment's list
+ */
+static void mvhd_dc_unlink(MVHDDataCache* cache, int idx) {
+    MVHDCacheEntry* e = &cache->entries[idx];
+    MVHDCacheList* list = &cache->segments[e->segment];
+    if (e->prev >= 0) {
+        cache->entries[e->prev].next = e->next;
+    } else {
+        list->head = e->next;
+    }
+    if (e->next >= 0) {
+        cache->entries[e->next].prev = e->prev;
+    } else {
+        list->tail = e->prev;
+    }
+    list->count--;
+}
+
+/**
+ * \brief Add an entry to the most recently used end of a segment
+ */
+static void mvhd_dc_push(MVHDDataCache* cache, int idx, MVHDCacheSegment segment) {
+    MVHDCacheEntry* e = &cache->entries[idx];
+    MVHDCacheList* list = &cache->segments[segment];
+    e->segment = segment;
+    e->prev = -1;
+    e->next = list->head;
+    if (list->head >= 0) {
+        cache->entries[list->head].prev = idx;
+    } else {
+        list->tail = idx;
+    }
+    list->head = idx;
+    list->count++;
+}
+
+/**
+ * \brief Mark a cached chunk as used, promoting it to the protected segment
+ */
+static void mvhd_dc_touch(MVHDDataCache* cache, int idx) {
+    mvhd_dc_unlink(cache, idx);
+    mvhd_dc_push(cache, idx, MVHD_CACHE_PROTECTED);
+    if (cache->segments[MVHD_CACHE_PROTECTED].count > cache->max_protected) {
+        int demoted = cache->segments[MVHD_CACHE_PROTECTED].tail;
+        mvhd_dc_unlink(cache, demoted);
+        mvhd_dc_push(cache, demoted, MVHD_CACHE_PROBATION);
+    }
+}
+
+/**
+ * \brief Drop a chunk from the cache, and return its entry to the free list
+ */
+static void mvhd_dc_remove(MVHDDataCache* cache, int idx) {
+    MVHDCacheEntry* e = &cache->entries[idx];
+    int* link = &cache->buckets[mvhd_dc_bucket(cache, e->chunk)];
+    while (*link != idx) {
+        link = &cache->entries[*link].hash_next;
+    }
+    *link = e->hash_next;
+    mvhd_dc_unlink(cache, idx);
+    e->segment = MVHD_CACHE_FREE;
+    e->next = cache->free_entry;
+    cache->free_entry = idx;
+}
+
+/**
+ * \brief Add a chunk which is not cached yet, evicting another one if the cache is full
+ */
+static void mvhd_dc_insert(MVHDDataCache* cache, uint32_t chunk, int num_sectors, const uint8_t* data, uint32_t seq_next) {
+    if (cache->free_entry < 0) {
+        MVHDCacheSegment victim = cache->segments[MVHD_CACHE_PROBATION].count > 0 ? MVHD_CACHE_PROBATION : MVHD_CACHE_PROTECTED;
+        mvhd_dc_remove(cache, cache->segments[victim].tail);
+    }
+    int idx = cache->free_entry;
+    MVHDCacheEntry* e = &cache->entries[idx];
+    cache->free_entry = e->next;
+    e->chunk = chunk;
+    e->num_sectors = num_sectors;
+    e->seq_next = seq_next;
+    memcpy(e->data, data, (size_t)num_sectors * MVHD_SECTOR_SIZE);
+    uint32_t bucket = mvhd_dc_bucket(cache, chunk);
+    e->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = idx;
+    mvhd_dc_push(cache, idx, MVHD_CACHE_PROBATION);
+}
+
+/**
+ * \brief Read sectors past the cache, with readahead if that is enabled
+ */
+static int mvhd_dc_read_through(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out) {
+    if (vhdm->readahead != NULL) {
+        return mvhd_readahead_read(vhdm, offset, num_sectors, out);
+    }
+    mvhd_lock_shared(vhdm);
+    int truncated = vhdm->read_sectors(vhdm, offset, num_sectors, out);
+    mvhd_unlock_shared(vhdm);
+    return truncated;
+}
+
+int mvhd_cache_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out) {
+    MVHDDataCache* cache = vhdm->data_cache;
+    if (num_sectors <= 0 || offset >= cache->total_sectors) {
+        return mvhd_dc_read_through(vhdm, offset, num_sectors, out);
+    }
+    uint32_t end = (uint32_t)num_sectors < cache->total_sectors - offset ? offset + (uint32_t)num_sectors : cache->total_sectors;
+    uint8_t* fill = NULL;
+    uint32_t s = offset;
+    while (s < end) {
+        uint32_t chunk = s / MVHD_CACHE_CHUNK;
+        uint32_t chunk_start = chunk * MVHD_CACHE_CHUNK;
+        mvhd_mutex_lock(&cache->lock);
+        int idx = mvhd_dc_lookup(cache, chunk);
+        if (idx >= 0) {
+            MVHDCacheEntry* e = &cache->entries[idx];
+            uint32_t chunk_end = chunk_start + (uint32_t)e->num_sectors;
+            uint32_t n = (chunk_end < end ? chunk_end : end) - s;
+            mvhd_cursor_copy(out, e->data + (size_t)(s - chunk_start) * MVHD_SECTOR_SIZE, (size_t)n * MVHD_SECTOR_SIZE, true);
+            if (s != e->seq_next) {
+                mvhd_dc_touch(cache, idx);
+            }
+            e->seq_next = s + n;
+            cache->hits++;
+            mvhd_mutex_unlock(&cache->lock);
+            s += n;
+            continue;
+        }
+        /* Fill the run of missing chunks up to the end of the read in one go */
+        uint32_t last = (end - 1) / MVHD_CACHE_CHUNK;
+        uint32_t run = 1;
+        while (run < MVHD_CACHE_FILL_MAX && chunk + run <= last && mvhd_dc_lookup(cache, chunk + run) < 0) {
+            run++;
+        }
+        cache->misses += run;
+        uint64_t gen = cache->gen;
+        mvhd_mutex_unlock(&cache->lock);
+        if (fill == NULL) {
+            fill = malloc((size_t)MVHD_CACHE_FILL_MAX * MVHD_CACHE_CHUNK * MVHD_SECTOR_SIZE);
+            if (fill == NULL) {
+                /* Carry on without the cache */
+                return mvhd_dc_read_through(vhdm, s, num_sectors - (int)(s - offset), out);
+            }
+        }
+        uint32_t fill_end = (chunk + run) * MVHD_CACHE_CHUNK;
+        if (fill_end > cache->total_sectors) {
+            fill_end = cache->total_sectors;
+        }
+        MVHDIOVec iov = { fill, (size_t)(fill_end - chunk_start) * MVHD_SECTOR_SIZE };
+        MVHDIOCursor fill_cur = { &iov, 1, 0, 0 };
+        mvhd_dc_read_through(vhdm, chunk_start, (int)(fill_end - chunk_start), &fill_cur);
+        uint32_t n = (fill_end < end ? fill_end : end) - s;
+        mvhd_cursor_copy(out, fill + (size_t)(s - chunk_start) * MVHD_SECTOR_SIZE, (size_t)n * MVHD_SECTOR_SIZE, true);
+        mvhd_mutex_lock(&cache->lock);
+        if (cache->gen == gen) {
+            for (uint32_t c = chunk_start; c < fill_end; c += MVHD_CACHE_CHUNK) {
+                if (mvhd_dc_lookup(cache, c / MVHD_CACHE_CHUNK) < 0) {
+                    int len = fill_end - c < MVHD_CACHE_CHUNK ? (int)(fill_end - c) : MVHD_CACHE_CHUNK;
+                    mvhd_dc_insert(cache, c / MVHD_CACHE_CHUNK, len, fill + (size_t)(c - chunk_start) * MVHD_SECTOR_SIZE, end);
+                }
+            }
+        }
+        mvhd_mutex_unlock(&cache->lock);
+        s += n;
+    }
+    free(fill);
+    return (uint32_t)num_sectors > end - offset ? num_sectors - (int)(end - offset) : 0;
+}
+
+void mvhd_cache_update(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOCursor* in) {
+    MVHDDataCache* cache = vhdm->data_cache;
+    if (cache == NULL || vhdm->readonly || num_sectors <= 0 || offset >= cache->total_sectors) {
+        return;
+    }
+    if (vhdm->sync.enabled) {
+        mvhd_cache_invalidate(vhdm, offset, num_sectors);
+        return;
+    }
+    uint32_t end = (uint32_t)num_sectors < cache->total_sectors - offset ? offset + (uint32_t)num_sectors : cache->total_sectors;
+    MVHDIOCursor cur = *in;
+    mvhd_mutex_lock(&cache->lock);
+    cache->gen++;
+    for (uint32_t s = offset, n; s < end; s += n) {
+        uint32_t chunk_start = s - s % MVHD_CACHE_CHUNK;
+        n = (chunk_start + MVHD_CACHE_CHUNK < end ? chunk_start + MVHD_CACHE_CHUNK : end) - s;
+        int idx = mvhd_dc_lookup(cache, s / MVHD_CACHE_CHUNK);
+        if (idx >= 0) {
+            mvhd_cursor_copy(&cur, cache->entries[idx].data + (size_t)(s - chunk_start) * MVHD_SECTOR_SIZE, (size_t)n * MVHD_SECTOR_SIZE, false);
+        } else {
+            mvhd_cursor_advance(&cur, (size_t)n * MVHD_SECTOR_SIZE);
+        }
+    }
+    mvhd_mutex_unlock(&cache->lock);
+}
+
+void mvhd_cache_invalidate(MVHDMeta* vhdm, uint32_t offset, int num_sectors) {
+    MVHDDataCache* cache = vhdm->data_cache;
+    if (cache == NULL || num_sectors <= 0) {
+        return;
+    }
+    uint32_t first = offset / MVHD_CACHE_CHUNK;
+    uint32_t last = (uint32_t)(((uint64_t)offset + (uint64_t)num_sectors - 1) / MVHD_CACHE_CHUNK);
+    mvhd_mutex_lock(&cache->lock);
+    cache->gen++;
+    if (last - first >= (uint32_t)cache->num_entries) {
+        /* Quicker to go through the cache than through the range */
+        for (int i = 0; i < cache->num_entries; i++) {
+            MVHDCacheEntry* e = &cache->entries[i];
+            if (e->segment != MVHD_CACHE_FREE && e->chunk >= first && e->chunk <= last) {
+                mvhd_dc_remove(cache, i);
+            }
+        }
+    } else {
+        for (uint32_t c = first; c <= last; c++) {
+            int idx = mvhd_dc_lookup(cache, c);
+            if (idx >= 0) {
+                mvhd_dc_remove(cache, idx);
+            }
+        }
+    }
+    mvhd_mutex_unlock(&cache->lock);
+}
+
+void mvhd_cache_free(MVHDMeta* vhdm) {
+    MVHDDataCache* cache = vhdm->data_cache;
+    if (cache == NULL) {
+        return;
+    }
+    mvhd_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache->data);
+    free(cache->entries);
+    free(cache);
+    vhdm->data_cache = NULL;
+}
+
+int mvhd_set_data_cache(MVHDMeta* vhdm, size_t max_bytes) {
+    size_t num_chunks = max_bytes / ((size_t)MVHD_CACHE_CHUNK * MVHD_SECTOR_SIZE);
+    if ((max_bytes > 0 && num_chunks == 0) || num_chunks > MVHD_CACHE_MAX_CHUNKS) {
+        return MVHD_ERR_INVALID_PARAMS;
+    }
+    mvhd_cache_free(vhdm);
+    if (num_chunks == 0 || vhdm->mapping.data != NULL) {
+        /* Mapped images are read straight from memory already */
+        return 0;
+    }
+    MVHDDataCache* cache = calloc(1, sizeof *cache);
+    if (cache == NULL) {
+        goto end;
+    }
+    cache->total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    cache->num_entries = (int)num_chunks;
+    cache->max_protected = (int)(num_chunks * MVHD_CACHE_PROTECTED_PCT / 100);
+    if (cache->max_protected == 0) {
+        cache->max_protected = 1;
+    }
+    uint32_t num_buckets = 1;
+    while (num_buckets < num_chunks) {
+        num_buckets *= 2;
+    }
+    cache->bucket_mask = num_buckets - 1;
+    cache->entries = calloc(num_chunks, sizeof *cache->entries);
+    cache->data = malloc(num_chunks * MVHD_CACHE_CHUNK * MVHD_SECTOR_SIZE);
+    cache->buckets = malloc(num_buckets * sizeof *cache->buckets);
+    if (cache->entries == NULL || cache->data == NULL || cache->buckets == NULL) {
+        goto cleanup_cache;
+    }
+    if (mvhd_mutex_init(&cache->lock) != 0) {
+        goto cleanup_cache;
+    }
+    for (uint32_t i = 0; i < num_buckets; i++) {
+        cache->buckets[i] = -1;
+    }
+    for (int i = 0; i < cache->num_entries; i++) {
+        cache->entries[i].segment = MVHD_CACHE_FREE;
+        cache->entries[i].data = cache->data + (size_t)i * MVHD_CACHE_CHUNK * MVHD_SECTOR_SIZE;
+        cache->entries[i].next = i + 1 < cache->num_entries ? i + 1 : -1;
+    }
+    cache->free_entry = 0;
+    for (int i = 0; i < 2; i++) {
+        cache->segments[i].head = -1;
+        cache->segments[i].tail = -1;
+    }
+    vhdm->data_cache = cache;
+    return 0;
+cleanup_cache:
+    free(cache->buckets);
+    free(cache->data);
+    free(cache->entries);
+    free(cache);
+end:
+    return MVHD_ERR_MEM;
+}
+
+void mvhd_get_data_cache_stats(MVHDMeta* vhdm, uint64_t* hits, uint64_t* misses) {
+    MVHDDataCache* cache = vhdm->data_cache;
+    *hits = 0;
+    *misses = 0;
+    if (cache != NULL) {
+        mvhd_mutex_lock(&cache->lock);
+        *hits = cache->hits;
+        *misses = cache->misses;
+        mvhd_mutex_unlock(&cache->lock);
+    }
+}
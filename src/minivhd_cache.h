@@ -0,0 +1,57 @@
+#ifndef MINIVHD_CACHE_H
+#define MINIVHD_CACHE_H
+#include "minivhd.h"
+#include "minivhd_internal.h"
+
+/**
+ * \brief Read sectors of an image with the data cache enabled
+ *
+ * Sectors are copied from cached chunks where possible. Missing chunks are read whole,
+ * with readahead if that is enabled, and added to the cache. Must be called without the
+ * handle's lock held.
+ *
+ * \param [in] vhdm MiniVHD data structure, with the data cache enabled
+ * \param [in] offset Sector offset to read from
+ * \param [in] num_sectors The desired number of sectors to read
+ * \param [out] out The buffers to store read sectors in, advanced past them
+ *
+ * \retval 0 num_sectors were read from file
+ * \retval >0 < num_sectors were read from file
+ */
+int mvhd_cache_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out);
+
+/**
+ * \brief Bring cached chunks up to date after sectors have been written
+ *
+ * The written data is copied into the cached chunks it overlaps. In thread-safe mode,
+ * where writes to the same sectors may finish in any order, the chunks are dropped
+ * instead. Does nothing unless the data cache is enabled.
+ *
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset The first sector written
+ * \param [in] num_sectors The number of sectors written
+ * \param [in] in The data that was written. Not advanced
+ */
+void mvhd_cache_update(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const MVHDIOCursor* in);
+
+/**
+ * \brief Drop cached chunks holding sectors which have changed
+ *
+ * Does nothing unless the data cache is enabled.
+ *
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset The first sector that changed
+ * \param [in] num_sectors The number of sectors that changed
+ */
+void mvhd_cache_invalidate(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Free the data cache of an image
+ *
+ * Does nothing unless the data cache is enabled.
+ *
+ * \param [in] vhdm MiniVHD data structure
+ */
+void mvhd_cache_free(MVHDMeta* vhdm);
+
+#endif
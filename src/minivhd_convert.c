@@ -1,3 +1,8 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* for pthread_rwlock_t */
+#endif
+
+#include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -41,7 +46,7 @@ MVHDMeta* mvhd_convert_to_vhd_fixed(const char* utf8_raw_path, const char* utf8_
         return NULL;
     }    
     uint64_t size_in_bytes = mvhd_calc_size_bytes(&geom);
-    MVHDMeta *vhdm = mvhd_create_fixed_raw(utf8_vhd_path, raw_img, size_in_bytes, &geom, err, NULL);
+    MVHDMeta *vhdm = mvhd_create_fixed_raw(utf8_vhd_path, raw_img, size_in_bytes, &geom, err, NULL, NULL, NULL);
     if (vhdm == NULL) {
         return NULL;
     }
@@ -58,22 +63,53 @@ MVHDMeta* mvhd_convert_to_vhd_sparse(const char* utf8_raw_path, const char* utf8
     if (vhdm == NULL) {
         goto end;
     }
-    uint8_t buff[4096] = {0}; // 8 sectors
-    uint8_t empty_buff[4096] = {0};
+    /* Work a block at a time, so that empty blocks can be skipped in one go */
+    int blk_sect = vhdm->sect_per_block;
+    uint8_t* buff = malloc((size_t)blk_sect * MVHD_SECTOR_SIZE);
+    if (buff == NULL) {
+        *err = MVHD_ERR_MEM;
+        mvhd_close(vhdm);
+        vhdm = NULL;
+        goto end;
+    }
     int total_sectors = mvhd_calc_size_sectors(&geom);
     int copy_sect = 0;
-    for (int i = 0; i < total_sectors; i += 8) {
-        copy_sect = 8;
-        if ((i + 8) >= total_sectors) {
+    for (int i = 0; i < total_sectors; i += blk_sect) {
+        copy_sect = blk_sect;
+        if ((i + blk_sect) >= total_sectors) {
             copy_sect = total_sectors - i;
-            memset(buff, 0, sizeof buff);
+            memset(buff, 0, (size_t)blk_sect * MVHD_SECTOR_SIZE);
+        }
+        if (fread(buff, MVHD_SECTOR_SIZE, copy_sect, raw_img) != (size_t)copy_sect) {
+            mvhd_errno = ferror(raw_img) ? errno : EIO;
+            goto cleanup_vhdm;
         }
-        fread(buff, MVHD_SECTOR_SIZE, copy_sect, raw_img);
-        /* Only write data if there's data to write, to take advantage of the sparse VHD format */
-        if (memcmp(buff, empty_buff, sizeof buff) != 0) {
-            mvhd_write_sectors(vhdm, i, copy_sect, buff);
+        if (mvhd_is_zero(buff, (size_t)copy_sect * MVHD_SECTOR_SIZE)) {
+            continue;
+        }
+        /* Only write the sectors holding data, to take advantage of the sparse VHD format */
+        int s = 0;
+        while (s < copy_sect) {
+            while (s < copy_sect && mvhd_is_zero(buff + (size_t)s * MVHD_SECTOR_SIZE, MVHD_SECTOR_SIZE)) {
+                s++;
+            }
+            int run_start = s;
+            while (s < copy_sect && !mvhd_is_zero(buff + (size_t)s * MVHD_SECTOR_SIZE, MVHD_SECTOR_SIZE)) {
+                s++;
+            }
+            if (s > run_start && mvhd_write_sectors(vhdm, i + run_start, s - run_start, buff + (size_t)run_start * MVHD_SECTOR_SIZE) != 0) {
+                mvhd_errno = EIO;
+                goto cleanup_vhdm;
+            }
         }
     }
+    free(buff);
+    goto end;
+cleanup_vhdm:
+    *err = MVHD_ERR_FILE;
+    free(buff);
+    mvhd_close(vhdm);
+    vhdm = NULL;
 end:
     fclose(raw_img);
     return vhdm;
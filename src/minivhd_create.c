@@ -1,4 +1,9 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* for pthread_rwlock_t */
+#endif
+
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -21,7 +26,8 @@ static int mvhd_gen_par_loc(MVHDSparseHeader* header,
                             mvhd_utf16* w2ku_path_buff,
                             mvhd_utf16* w2ru_path_buff,
                             MVHDError* err);
-static MVHDMeta* mvhd_create_sparse_diff(const char* path, const char* par_path, uint64_t size_in_bytes, MVHDGeom* geom, uint32_t block_size_in_sectors, int* err);
+static MVHDMeta* mvhd_create_sparse_diff(const char* path, const char* par_path, uint64_t size_in_bytes, MVHDGeom* geom, uint32_t block_size_in_sectors, int* err,
+                                         const MVHDStorageOps* ops, void* ctx);
 
 /**
  * \brief Populate a VHD footer
@@ -168,7 +174,7 @@ end:
 
 MVHDMeta* mvhd_create_fixed(const char* path, MVHDGeom geom, int* err, mvhd_progress_callback progress_callback) {
     uint64_t size_in_bytes = mvhd_calc_size_bytes(&geom);
-    return mvhd_create_fixed_raw(path, NULL, size_in_bytes, &geom, err, progress_callback);
+    return mvhd_create_fixed_raw(path, NULL, size_in_bytes, &geom, err, progress_callback, NULL, NULL);
 }
 
 /**
@@ -178,10 +184,14 @@ MVHDMeta* mvhd_create_fixed(const char* path, MVHDGeom geom, int* err, mvhd_prog
  * raw disk image as the data source for the new fixed VHD.
  * 
  * \param [in] raw_image file handle to a raw disk image to populate VHD
+ * \param [in] ops storage backend to create the image on. If NULL, a file is created at path
+ * \param [in] ctx context for the storage backend callbacks
  */
-MVHDMeta* mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_in_bytes, MVHDGeom* geom, int* err, mvhd_progress_callback progress_callback) {    
-    uint8_t img_data[MVHD_SECTOR_SIZE] = {0};
+MVHDMeta* mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_in_bytes, MVHDGeom* geom, int* err, mvhd_progress_callback progress_callback,
+                                const MVHDStorageOps* ops, void* ctx) {
+    uint8_t img_data[64 * MVHD_SECTOR_SIZE] = {0};
     uint8_t footer_buff[MVHD_FOOTER_SIZE] = {0};
+    FILE* f = NULL;
     MVHDMeta* vhdm = calloc(1, sizeof *vhdm);
     if (vhdm == NULL) {
         *err = MVHD_ERR_MEM;
@@ -195,13 +205,18 @@ MVHDMeta* mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_i
         *err = MVHD_ERR_INVALID_GEOM;
         goto cleanup_vhdm;
     }
-    FILE* f = mvhd_fopen(path, "wb+", err);
-    if (f == NULL) {
-        goto cleanup_vhdm;
+    if (ops == NULL) {
+        f = mvhd_fopen(path, "wb+", err);
+        if (f == NULL) {
+            goto cleanup_vhdm;
+        }
+        ops = &mvhd_file_storage_ops;
+        ctx = f;
     }
-    mvhd_fseeko64(f, 0, SEEK_SET);
+    vhdm->storage = ops;
+    vhdm->storage_ctx = ctx;
     uint32_t size_sectors = (uint32_t)(size_in_bytes / MVHD_SECTOR_SIZE);
-    uint32_t s;
+    uint32_t s, chunk;
     if (progress_callback)
         progress_callback(0, size_sectors);
     if (raw_img != NULL) {
@@ -210,32 +225,48 @@ MVHDMeta* mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_i
         MVHDGeom raw_geom = mvhd_calculate_geometry(raw_size);
         if (mvhd_calc_size_bytes(&raw_geom) != raw_size) {
             *err = MVHD_ERR_CONV_SIZE;
-            goto cleanup_vhdm;
+            goto cleanup_file;
         }
         mvhd_gen_footer(&vhdm->footer, raw_size, geom, MVHD_TYPE_FIXED, 0);        
         mvhd_fseeko64(raw_img, 0, SEEK_SET);
-        for (s = 0; s < size_sectors; s++) {            
-            fread(img_data, sizeof img_data, 1, raw_img);
-            fwrite(img_data, sizeof img_data, 1, f);
-            if (progress_callback)
-                progress_callback(s + 1, size_sectors);
-        }
     } else {
         mvhd_gen_footer(&vhdm->footer, size_in_bytes, geom, MVHD_TYPE_FIXED, 0);        
-        for (s = 0; s < size_sectors; s++) {            
-            fwrite(img_data, sizeof img_data, 1, f);
-            if (progress_callback)
-                progress_callback(s + 1, size_sectors);
+    }
+    for (s = 0; s < size_sectors; s += chunk) {
+        chunk = size_sectors - s;
+        if (chunk > sizeof img_data / MVHD_SECTOR_SIZE) {
+            chunk = sizeof img_data / MVHD_SECTOR_SIZE;
+        }
+        if (raw_img != NULL && fread(img_data, MVHD_SECTOR_SIZE, chunk, raw_img) != chunk) {
+            mvhd_errno = ferror(raw_img) ? errno : EIO;
+            *err = MVHD_ERR_FILE;
+            goto cleanup_file;
         }
+        if (mvhd_write_at(vhdm, img_data, (size_t)chunk * MVHD_SECTOR_SIZE, (int64_t)s * MVHD_SECTOR_SIZE) != (size_t)chunk * MVHD_SECTOR_SIZE) {
+            mvhd_errno = EIO;
+            *err = MVHD_ERR_FILE;
+            goto cleanup_file;
+        }
+        if (progress_callback)
+            progress_callback(s + chunk, size_sectors);
     }
     mvhd_footer_to_buffer(&vhdm->footer, footer_buff);
-    fwrite(footer_buff, sizeof footer_buff, 1, f);
-    fclose(f);
-    f = NULL;
+    if (mvhd_write_at(vhdm, footer_buff, sizeof footer_buff, (int64_t)size_sectors * MVHD_SECTOR_SIZE) != sizeof footer_buff) {
+        mvhd_errno = EIO;
+        *err = MVHD_ERR_FILE;
+        goto cleanup_file;
+    }
     free(vhdm);
-    vhdm = mvhd_open(path, false, err);
+    vhdm = mvhd_open_storage(path, ops, ctx, false, err);
+    if (vhdm == NULL && f != NULL) {
+        fclose(f);
+    }
     goto end;
 
+cleanup_file:
+    if (f != NULL) {
+        fclose(f);
+    }
 cleanup_vhdm:
     free(vhdm);
     vhdm = NULL;
@@ -252,10 +283,13 @@ end:
  * \param [in] geom is the HDD geometry of the image to create. Determines final image size
  * \param [in] block_size_in_sectors is the block size in sectors
  * \param [out] err indicates what error occurred, if any
+ * \param [in] ops storage backend to create the image on. If NULL, a file is created at path
+ * \param [in] ctx context for the storage backend callbacks
  * 
  * \return NULL if an error occurrs. Check value of *err for actual error. Otherwise returns pointer to a MVHDMeta struct
  */
-static MVHDMeta* mvhd_create_sparse_diff(const char* path, const char* par_path, uint64_t size_in_bytes, MVHDGeom* geom, uint32_t block_size_in_sectors, int* err) {
+static MVHDMeta* mvhd_create_sparse_diff(const char* path, const char* par_path, uint64_t size_in_bytes, MVHDGeom* geom, uint32_t block_size_in_sectors, int* err,
+                                         const MVHDStorageOps* ops, void* ctx) {
     uint8_t footer_buff[MVHD_FOOTER_SIZE] = {0};
     uint8_t sparse_buff[MVHD_SPARSE_SIZE] = {0};
     uint8_t bat_sect[MVHD_SECTOR_SIZE];
@@ -265,6 +299,8 @@ static MVHDMeta* mvhd_create_sparse_diff(const char* path, const char* par_path,
     MVHDMeta* par_vhdm = NULL;
     mvhd_utf16* w2ku_path_buff = NULL;
     mvhd_utf16* w2ru_path_buff = NULL;
+    FILE* f = NULL;
+    int64_t pos = 0;
 
     if (par_path != NULL) {
         par_vhdm = mvhd_open(par_path, true, err);
@@ -292,11 +328,16 @@ static MVHDMeta* mvhd_create_sparse_diff(const char* path, const char* par_path,
         goto cleanup_vhdm;
     }    
     
-    FILE* f = mvhd_fopen(path, "wb+", err);
-    if (f == NULL) {
-        goto cleanup_vhdm;
+    if (ops == NULL) {
+        f = mvhd_fopen(path, "wb+", err);
+        if (f == NULL) {
+            goto cleanup_vhdm;
+        }
+        ops = &mvhd_file_storage_ops;
+        ctx = f;
     }
-    mvhd_fseeko64(f, 0, SEEK_SET);
+    vhdm->storage = ops;
+    vhdm->storage_ctx = ctx;
     /* Note, the sparse header follows the footer copy at the beginning of the file */
     if (par_path == NULL) {
         mvhd_gen_footer(&vhdm->footer, size_in_bytes, geom, MVHD_TYPE_DYNAMIC, MVHD_FOOTER_SIZE);
@@ -305,7 +346,7 @@ static MVHDMeta* mvhd_create_sparse_diff(const char* path, const char* par_path,
     }
     mvhd_footer_to_buffer(&vhdm->footer, footer_buff);
     /* As mentioned, start with a copy of the footer */
-    fwrite(footer_buff, sizeof footer_buff, 1, f);
+    pos += mvhd_write_at(vhdm, footer_buff, sizeof footer_buff, pos);
     /**
      * Calculate the number of (2MB or 512KB) data blocks required to store the entire
      * contents of the disk image, followed by the number of sectors the 
@@ -338,59 +379,56 @@ static MVHDMeta* mvhd_create_sparse_diff(const char* path, const char* par_path,
         w2ku_path_buff = calloc(MVHD_MAX_PATH_CHARS, sizeof * w2ku_path_buff);
         if (w2ku_path_buff == NULL) {
             *err = MVHD_ERR_MEM;            
-            goto end;
+            goto cleanup_file;
         }
         w2ru_path_buff = calloc(MVHD_MAX_PATH_CHARS, sizeof * w2ru_path_buff);
         if (w2ru_path_buff == NULL) {
             *err = MVHD_ERR_MEM;            
-            goto end;
+            goto cleanup_file;
         }
         memcpy(vhdm->sparse.par_uuid, par_vhdm->footer.uuid, sizeof vhdm->sparse.par_uuid);
         par_loc_offset = bat_offset + ((uint64_t)num_bat_sect * MVHD_SECTOR_SIZE) + (5 * MVHD_SECTOR_SIZE);
         if (mvhd_gen_par_loc(&vhdm->sparse, path, par_path, par_loc_offset, w2ku_path_buff, w2ru_path_buff, (MVHDError*)err) < 0) {
-            goto cleanup_vhdm;
+            goto cleanup_file;
         }
     }
     mvhd_gen_sparse_header(&vhdm->sparse, num_blks, bat_offset, block_size_in_sectors);
     mvhd_header_to_buffer(&vhdm->sparse, sparse_buff);
-    fwrite(sparse_buff, sizeof sparse_buff, 1, f);
+    pos += mvhd_write_at(vhdm, sparse_buff, sizeof sparse_buff, pos);
     /* The BAT sectors need to be filled with 0xffffffff */
     for (uint32_t i = 0; i < num_bat_sect; i++) {
-        fwrite(bat_sect, sizeof bat_sect, 1, f);
+        pos += mvhd_write_at(vhdm, bat_sect, sizeof bat_sect, pos);
     }
-    mvhd_write_empty_sectors(f, 5);
+    pos += mvhd_write_zeros_at(vhdm, 5 * MVHD_SECTOR_SIZE, pos);
     /**
      * If creating a differencing VHD, the paths to the parent image need to be written
      * tp the file. Both absolute and relative paths are written 
      * */
     if (par_vhdm != NULL) {
-        uint64_t curr_pos = (uint64_t)mvhd_ftello64(f);
         /* Double check my sums... */
-        assert(curr_pos == par_loc_offset);
+        assert((uint64_t)pos == par_loc_offset);
         /* Fill the space required for location data with zero */
-        uint8_t empty_sect[MVHD_SECTOR_SIZE] = {0};
         for (int i = 0; i < 2; i++) {
-            for (uint32_t j = 0; j < (vhdm->sparse.par_loc_entry[i].plat_data_space / MVHD_SECTOR_SIZE); j++) {
-                fwrite(empty_sect, sizeof empty_sect, 1, f);
-            }
+            pos += mvhd_write_zeros_at(vhdm, vhdm->sparse.par_loc_entry[i].plat_data_space, pos);
         }
         /* Now write the location entries */
-        mvhd_fseeko64(f, vhdm->sparse.par_loc_entry[0].plat_data_offset, SEEK_SET);
-        fwrite(w2ku_path_buff, vhdm->sparse.par_loc_entry[0].plat_data_len, 1, f);
-        mvhd_fseeko64(f, vhdm->sparse.par_loc_entry[1].plat_data_offset, SEEK_SET);
-        fwrite(w2ru_path_buff, vhdm->sparse.par_loc_entry[1].plat_data_len, 1, f);
-        /* and reset the file position to continue */
-        mvhd_fseeko64(f, vhdm->sparse.par_loc_entry[1].plat_data_offset + vhdm->sparse.par_loc_entry[1].plat_data_space, SEEK_SET);
-        mvhd_write_empty_sectors(f, 5);
+        mvhd_write_at(vhdm, w2ku_path_buff, vhdm->sparse.par_loc_entry[0].plat_data_len, (int64_t)vhdm->sparse.par_loc_entry[0].plat_data_offset);
+        mvhd_write_at(vhdm, w2ru_path_buff, vhdm->sparse.par_loc_entry[1].plat_data_len, (int64_t)vhdm->sparse.par_loc_entry[1].plat_data_offset);
+        pos += mvhd_write_zeros_at(vhdm, 5 * MVHD_SECTOR_SIZE, pos);
     }
     /* And finish with the footer */
-    fwrite(footer_buff, sizeof footer_buff, 1, f);
-    fclose(f);
-    f = NULL;
+    mvhd_write_at(vhdm, footer_buff, sizeof footer_buff, pos);
     free(vhdm);
-    vhdm = mvhd_open(path, false, err);
-    goto end;
+    vhdm = mvhd_open_storage(path, ops, ctx, false, err);
+    if (vhdm == NULL && f != NULL) {
+        fclose(f);
+    }
+    goto cleanup_par_vhdm;
 
+cleanup_file:
+    if (f != NULL) {
+        fclose(f);
+    }
 cleanup_vhdm:
     free(vhdm);
     vhdm = NULL;
@@ -406,11 +444,11 @@ end:
 
 MVHDMeta* mvhd_create_sparse(const char* path, MVHDGeom geom, int* err) {
     uint64_t size_in_bytes = mvhd_calc_size_bytes(&geom);
-    return mvhd_create_sparse_diff(path, NULL, size_in_bytes, &geom, MVHD_BLOCK_LARGE, err);
+    return mvhd_create_sparse_diff(path, NULL, size_in_bytes, &geom, MVHD_BLOCK_LARGE, err, NULL, NULL);
 }
 
 MVHDMeta* mvhd_create_diff(const char* path, const char* par_path, int* err) {
-    return mvhd_create_sparse_diff(path, par_path, 0, NULL, MVHD_BLOCK_LARGE, err);
+    return mvhd_create_sparse_diff(path, par_path, 0, NULL, MVHD_BLOCK_LARGE, err, NULL, NULL);
 }
 
 MVHDMeta* mvhd_create_ex(MVHDCreationOptions options, int* err) {
@@ -473,11 +511,14 @@ MVHDMeta* mvhd_create_ex(MVHDCreationOptions options, int* err) {
     switch (options.type)
     {
     case MVHD_TYPE_FIXED:
-        return mvhd_create_fixed_raw(options.path, NULL, options.size_in_bytes, &(options.geometry), err, options.progress_callback);
+        return mvhd_create_fixed_raw(options.path, NULL, options.size_in_bytes, &(options.geometry), err, options.progress_callback,
+                                     options.storage_ops, options.storage_ctx);
     case MVHD_TYPE_DYNAMIC:
-        return mvhd_create_sparse_diff(options.path, NULL, options.size_in_bytes, &(options.geometry), options.block_size_in_sectors, err);
+        return mvhd_create_sparse_diff(options.path, NULL, options.size_in_bytes, &(options.geometry), options.block_size_in_sectors, err,
+                                       options.storage_ops, options.storage_ctx);
     case MVHD_TYPE_DIFF:
-        return mvhd_create_sparse_diff(options.path, options.parent_path, 0, NULL, options.block_size_in_sectors, err);
+        return mvhd_create_sparse_diff(options.path, options.parent_path, 0, NULL, options.block_size_in_sectors, err,
+                                       options.storage_ops, options.storage_ctx);
     }
 
     return NULL; /* Make the compiler happy */
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include "minivhd.h"
 
-MVHDMeta* mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_in_bytes, MVHDGeom* geom, int* err, mvhd_progress_callback progress_callback);
+MVHDMeta* mvhd_create_fixed_raw(const char* path, FILE* raw_img, uint64_t size_in_bytes, MVHDGeom* geom, int* err, mvhd_progress_callback progress_callback,
+                                const MVHDStorageOps* ops, void* ctx);
 
 #endif
\ No newline at end of file
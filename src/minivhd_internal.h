@@ -3,6 +3,12 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "minivhd.h"
 
 #define MVHD_FOOTER_SIZE 512
 #define MVHD_SPARSE_SIZE 1024
@@ -23,10 +29,87 @@
 #define MVHD_DIF_LOC_W2RU 0x57327275
 #define MVHD_DIF_LOC_W2KU 0x57326B75
 
+/* Number of block sector bitmaps kept in memory per image, unless 
+ * changed with mvhd_set_bitmap_cache_size() */
+#define MVHD_BITMAP_CACHE_DEFAULT 16
+#define MVHD_BITMAP_CACHE_MAX 4096
+
+/* Default amount of dirty metadata held back in write-back mode before it is 
+ * written to file */
+#define MVHD_WRITE_BACK_DEFAULT_THRESHOLD (1024 * 1024)
+
+/* Most buffers of a scatter/gather list passed to the storage backend in one call */
+#define MVHD_IOV_BATCH 64
+
+/* Number of locks that writes in thread-safe mode spread blocks over */
+#define MVHD_BLOCK_LOCK_STRIPES 64
+
+/* Block owner map entries. Distances down the chain are capped at MVHD_OWNER_MAX, 
+ * past which the lookup continues from that layer */
+#define MVHD_OWNER_NONE 0xff
+#define MVHD_OWNER_MAX 0xfe
+
+#ifdef _WIN32
+typedef SRWLOCK MVHDRwLock;
+typedef SRWLOCK MVHDMutex;
+typedef CONDITION_VARIABLE MVHDCond;
+typedef HANDLE MVHDThread;
+#define MVHD_MUTEX_INITIALIZER SRWLOCK_INIT
+#else
+typedef pthread_rwlock_t MVHDRwLock;
+typedef pthread_mutex_t MVHDMutex;
+typedef pthread_cond_t MVHDCond;
+typedef pthread_t MVHDThread;
+#define MVHD_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#endif
+
+typedef void (*MVHDThreadFunc)(void* arg);
+
+/* Readahead state of an image, see minivhd_readahead.c */
+typedef struct MVHDReadahead MVHDReadahead;
+
+/* Sector data cache of an image, see minivhd_cache.c */
+typedef struct MVHDDataCache MVHDDataCache;
+
+typedef struct MVHDBitmapCacheEntry {
+    uint8_t* bitmap;
+    int block;
+    uint64_t last_used;
+    bool dirty;
+} MVHDBitmapCacheEntry;
+
+/* A pending metadata write, used when writing back dirty metadata in offset order */
+typedef struct MVHDMetaWrite {
+    int64_t offset;
+    const void* data;
+    size_t len;
+} MVHDMetaWrite;
+
+/* Position in a scatter/gather list, advanced as sectors are read into or written from it */
+typedef struct MVHDIOCursor {
+    const MVHDIOVec* iov;
+    int iovcnt;
+    int idx;
+    size_t pos; /* Offset into iov[idx] */
+} MVHDIOCursor;
+
+/* Output array for mvhd_get_extents() */
+typedef struct MVHDExtentList {
+    MVHDExtent* extents;
+    int count;
+    int max;
+} MVHDExtentList;
+
 typedef struct MVHDSectorBitmap {
     uint8_t* curr_bitmap;
     int sector_count;
     int curr_block;
+    MVHDBitmapCacheEntry* cache;
+    uint8_t* cache_data;
+    int cache_size;
+    uint64_t use_count;
+    uint64_t hits;
+    uint64_t misses;
 } MVHDSectorBitmap;
 
 typedef struct MVHDFooter {
@@ -74,23 +157,53 @@ typedef struct MVHDSparseHeader {
     uint8_t reserved_2[256];
 } MVHDSparseHeader;
 
-typedef struct MVHDMeta MVHDMeta;
 struct MVHDMeta {
-    FILE* f;
+    const MVHDStorageOps* storage;
+    void* storage_ctx;
     bool readonly;
     char filename[MVHD_MAX_PATH_BYTES];
     struct MVHDMeta* parent;
     MVHDFooter footer;
     MVHDSparseHeader sparse;
     uint32_t* block_offset;
+    uint8_t* block_owner; /* Sparse images only. Per block, how many layers down the chain hold it */
     int sect_per_block;
     MVHDSectorBitmap bitmap;
-    int (*read_sectors)(MVHDMeta*, uint32_t, int, void*);
-    int (*write_sectors)(MVHDMeta*, uint32_t, int, void*);
+    int (*read_sectors)(MVHDMeta*, uint32_t, int, MVHDIOCursor*);
+    int (*write_sectors)(MVHDMeta*, uint32_t, int, MVHDIOCursor*);
+    int (*discard_sectors)(MVHDMeta*, uint32_t, int);
     struct {
         uint8_t* zero_data;
         int sector_count;
     } format_buffer;
+    struct {
+        uint8_t* data;
+        size_t len;
+        void* handle;
+    } mapping;
+    int64_t data_end;
+    bool footer_dirty;
+    int reserve_blocks;
+    bool elide_zero_writes;
+    MVHDReadahead* readahead; /* NULL unless readahead is enabled */
+    MVHDDataCache* data_cache; /* NULL unless the data cache is enabled */
+    struct {
+        int refs; /* Differencing images using this image as their parent, 0 unless it is one */
+        struct MVHDMeta* next; /* Next parent in the registry */
+    } shared;
+    struct {
+        bool enabled;
+        uint8_t* bat_dirty;
+        size_t dirty_bytes;
+        size_t threshold;
+    } write_back;
+    struct {
+        bool enabled;
+        MVHDRwLock lock; /* Shared for reads and writes, exclusive for flushes */
+        MVHDMutex bitmap_lock; /* Guards the BAT, the sector bitmap cache and write-back state */
+        MVHDMutex alloc_lock; /* Serialises block allocation */
+        MVHDMutex block_locks[MVHD_BLOCK_LOCK_STRIPES]; /* Serialise writes to the same block */
+    } sync;
 };
 
 #endif
\ No newline at end of file
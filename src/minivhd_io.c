@@ -3,23 +3,52 @@
  * \brief Sector reading and writing implementations
  */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* for pthread_rwlock_t */
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include "minivhd_internal.h"
 #include "minivhd_util.h"
-
-/* The following bit array macros adapted from 
-   http://www.mathcs.emory.edu/~cheung/Courses/255/Syllabus/1-C-intro/bit-array.html */
-
-#define VHD_SETBIT(A,k)     ( A[(k/8)] |= (0x80 >> (k%8)) )
-#define VHD_CLEARBIT(A,k)   ( A[(k/8)] &= ~(0x80 >> (k%8)) )
-#define VHD_TESTBIT(A,k)    ( A[(k/8)] & (0x80 >> (k%8)) )
+#include "minivhd_io.h"
+#include "minivhd_bitmap.h"
+#include "minivhd_struct_rw.h"
 
 static inline void mvhd_check_sectors(uint32_t offset, int num_sectors, uint32_t total_sectors, int* transfer_sect, int* trunc_sect);
+static MVHDBitmapCacheEntry* mvhd_find_bitmap_slot(MVHDMeta* vhdm, int blk, bool* found);
+static void mvhd_use_bitmap_slot(MVHDMeta* vhdm, MVHDBitmapCacheEntry* entry, int blk);
 static void mvhd_read_sect_bitmap(MVHDMeta* vhdm, int blk);
+static void mvhd_claim_sect_bitmap(MVHDMeta* vhdm, int blk);
+static inline void mvhd_lock_bitmaps(MVHDMeta* vhdm);
+static inline void mvhd_unlock_bitmaps(MVHDMeta* vhdm);
+static const uint8_t* mvhd_acquire_sect_bitmap(MVHDMeta* vhdm, int blk, uint8_t* copy, uint32_t* blk_offset);
+static void mvhd_release_sect_bitmap(MVHDMeta* vhdm, const uint8_t* bitmap, const uint8_t* copy);
 static void mvhd_write_bat_entry(MVHDMeta* vhdm, int blk);
 static void mvhd_create_block(MVHDMeta* vhdm, int blk);
+static inline void mvhd_lock_block(MVHDMeta* vhdm, int blk);
+static inline void mvhd_unlock_block(MVHDMeta* vhdm, int blk);
+static void mvhd_write_sect_bitmap(MVHDMeta* vhdm, MVHDBitmapCacheEntry* entry);
+static void mvhd_evict_bitmap_slot(MVHDMeta* vhdm, MVHDBitmapCacheEntry* entry);
 static void mvhd_write_curr_sect_bitmap(MVHDMeta* vhdm);
+static int mvhd_cmp_meta_write(const void* a, const void* b);
+static uint8_t mvhd_block_owner_below(MVHDMeta* vhdm, uint32_t blk);
+static MVHDMeta* mvhd_block_owner(MVHDMeta* vhdm, int blk, int* depth);
+static void mvhd_diff_read_range(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out);
+static int mvhd_cursor_slice(const MVHDIOCursor* cur, size_t len, MVHDIOVec* vec, int max_vec, size_t* slice_len);
+static void mvhd_cursor_read_at(MVHDMeta* vhdm, MVHDIOCursor* cur, size_t len, int64_t addr);
+static void mvhd_cursor_write_at(MVHDMeta* vhdm, MVHDIOCursor* cur, size_t len, int64_t addr);
+static void mvhd_cursor_zero(MVHDIOCursor* cur, size_t len);
+static void mvhd_drop_block(MVHDMeta* vhdm, int blk);
+static void mvhd_release_block_space(MVHDMeta* vhdm, uint32_t blk_offset);
+static void mvhd_discard_in_block(MVHDMeta* vhdm, int blk, int sib, int blk_sect);
+static void mvhd_discard_range(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+static void mvhd_write_zero_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+static bool mvhd_cursor_is_zero(const MVHDIOCursor* cur, size_t len);
+static void mvhd_write_range(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* in);
+static void mvhd_diff_discard_range(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+static bool mvhd_add_extent(MVHDExtentList* list, uint32_t offset, uint32_t num_sectors, MVHDExtentType type, int layer, int64_t file_offset);
+static bool mvhd_map_range(MVHDMeta* vhdm, int layer, uint32_t offset, int num_sectors, MVHDExtentList* list);
 
 /**
  * \brief Check that we will not be overflowing buffers
@@ -40,56 +69,332 @@ static inline void mvhd_check_sectors(uint32_t offset, int num_sectors, uint32_t
     }
 }
 
-void mvhd_write_empty_sectors(FILE* f, int sector_count) {
-    uint8_t zero_bytes[MVHD_SECTOR_SIZE] = {0};
-    for (int i = 0; i < sector_count; i++) {
-        fwrite(zero_bytes, sizeof zero_bytes, 1, f);
+/**
+ * \brief Find the bitmap cache slot to use for a block
+ * 
+ * If the block's bitmap is already cached, its slot is returned. Otherwise the 
+ * least recently used slot is returned, ready to be overwritten.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block to look up
+ * \param [out] found Set to true if the block's bitmap is already in the returned slot
+ * 
+ * \return The cache slot for blk
+ */
+static MVHDBitmapCacheEntry* mvhd_find_bitmap_slot(MVHDMeta* vhdm, int blk, bool* found) {
+    MVHDBitmapCacheEntry* lru = &vhdm->bitmap.cache[0];
+    for (int i = 0; i < vhdm->bitmap.cache_size; i++) {
+        MVHDBitmapCacheEntry* entry = &vhdm->bitmap.cache[i];
+        if (entry->block == blk) {
+            *found = true;
+            return entry;
+        }
+        if (entry->last_used < lru->last_used) {
+            lru = entry;
+        }
     }
+    *found = false;
+    return lru;
+}
+
+/**
+ * \brief Make a cache slot the current sector bitmap
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] entry The cache slot to use
+ * \param [in] blk The block the slot holds the bitmap for
+ */
+static void mvhd_use_bitmap_slot(MVHDMeta* vhdm, MVHDBitmapCacheEntry* entry, int blk) {
+    entry->block = blk;
+    entry->last_used = ++vhdm->bitmap.use_count;
+    vhdm->bitmap.curr_bitmap = entry->bitmap;
+    vhdm->bitmap.curr_block = blk;
 }
 
 /**
  * \brief Read the sector bitmap for a block.
  * 
- * If the block is sparse, the sector bitmap in memory will be 
- * zeroed. Otherwise, the sector bitmap is read from the VHD file.
+ * The bitmap is served from the bitmap cache if possible. Otherwise, if the 
+ * block is sparse, the sector bitmap in memory will be zeroed, and if not the 
+ * sector bitmap is read from the VHD file into the least recently used slot.
+ * 
+ * On return, the bitmap is available as the current sector bitmap.
  * 
  * \param [in] vhdm MiniVHD data structure
  * \param [in] blk The block for which to read the sector bitmap from
  */
 static void mvhd_read_sect_bitmap(MVHDMeta* vhdm, int blk) {
-    if (vhdm->block_offset[blk] != MVHD_SPARSE_BLK) {
-        mvhd_fseeko64(vhdm->f, (uint64_t)vhdm->block_offset[blk] * MVHD_SECTOR_SIZE, SEEK_SET);
-        fread(vhdm->bitmap.curr_bitmap, vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE, 1, vhdm->f);
+    bool found;
+    if (vhdm->bitmap.curr_block == blk) {
+        vhdm->bitmap.hits++;
+        return;
+    }
+    MVHDBitmapCacheEntry* entry = mvhd_find_bitmap_slot(vhdm, blk, &found);
+    if (found) {
+        vhdm->bitmap.hits++;
     } else {
-        memset(vhdm->bitmap.curr_bitmap, 0, vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+        vhdm->bitmap.misses++;
+        mvhd_evict_bitmap_slot(vhdm, entry);
+        if (vhdm->block_offset[blk] != MVHD_SPARSE_BLK) {
+            mvhd_read_at(vhdm, entry->bitmap, (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE, (int64_t)vhdm->block_offset[blk] * MVHD_SECTOR_SIZE);
+        } else {
+            memset(entry->bitmap, 0, vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+        }
     }
-    vhdm->bitmap.curr_block = blk;
+    mvhd_use_bitmap_slot(vhdm, entry, blk);
 }
 
 /**
- * \brief Write the current sector bitmap in memory to file
+ * \brief Take the lock guarding the BAT and the sector bitmap cache, in thread-safe mode
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+static inline void mvhd_lock_bitmaps(MVHDMeta* vhdm) {
+    if (vhdm->sync.enabled) {
+        mvhd_mutex_lock(&vhdm->sync.bitmap_lock);
+    }
+}
+
+static inline void mvhd_unlock_bitmaps(MVHDMeta* vhdm) {
+    if (vhdm->sync.enabled) {
+        mvhd_mutex_unlock(&vhdm->sync.bitmap_lock);
+    }
+}
+
+/**
+ * \brief Take the lock serialising writes to a block, in thread-safe mode
+ * 
+ * Blocks share a fixed number of locks, so unrelated blocks may occasionally wait for each other.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block about to be written to
+ */
+static inline void mvhd_lock_block(MVHDMeta* vhdm, int blk) {
+    if (vhdm->sync.enabled) {
+        mvhd_mutex_lock(&vhdm->sync.block_locks[blk % MVHD_BLOCK_LOCK_STRIPES]);
+    }
+}
+
+static inline void mvhd_unlock_block(MVHDMeta* vhdm, int blk) {
+    if (vhdm->sync.enabled) {
+        mvhd_mutex_unlock(&vhdm->sync.block_locks[blk % MVHD_BLOCK_LOCK_STRIPES]);
+    }
+}
+
+/**
+ * \brief Get a block's sector bitmap for a read-only operation
+ * 
+ * In thread-safe mode, other threads may replace the entries of the bitmap cache, and 
+ * allocate blocks, at any time. A bitmap of a single sector is therefore copied out of 
+ * the cache while holding the cache lock, so that the (slow) data transfers can go ahead 
+ * without it. A larger bitmap is returned in place, with the cache lock held until it is 
+ * released.
+ * 
+ * Every call that returns a bitmap must be paired with a call to mvhd_release_sect_bitmap().
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block for which to get the sector bitmap
+ * \param [in] copy A buffer of MVHD_SECTOR_SIZE bytes, for the copied bitmap
+ * \param [out] blk_offset The sector offset of the block, as found in the BAT
+ * 
+ * \return The sector bitmap of blk, or NULL if the block is not allocated
+ */
+static const uint8_t* mvhd_acquire_sect_bitmap(MVHDMeta* vhdm, int blk, uint8_t* copy, uint32_t* blk_offset) {
+    mvhd_lock_bitmaps(vhdm);
+    *blk_offset = vhdm->block_offset[blk];
+    if (*blk_offset == MVHD_SPARSE_BLK) {
+        mvhd_unlock_bitmaps(vhdm);
+        return NULL;
+    }
+    mvhd_read_sect_bitmap(vhdm, blk);
+    if (!vhdm->sync.enabled || vhdm->bitmap.sector_count > 1) {
+        return vhdm->bitmap.curr_bitmap;
+    }
+    memcpy(copy, vhdm->bitmap.curr_bitmap, MVHD_SECTOR_SIZE);
+    mvhd_unlock_bitmaps(vhdm);
+    return copy;
+}
+
+/**
+ * \brief Release a sector bitmap obtained with mvhd_acquire_sect_bitmap()
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] bitmap The bitmap returned by mvhd_acquire_sect_bitmap()
+ * \param [in] copy The buffer that was passed to mvhd_acquire_sect_bitmap()
+ */
+static void mvhd_release_sect_bitmap(MVHDMeta* vhdm, const uint8_t* bitmap, const uint8_t* copy) {
+    if (bitmap != copy) {
+        mvhd_unlock_bitmaps(vhdm);
+    }
+}
+
+/**
+ * \brief Make a block's sector bitmap current without reading it from file
+ * 
+ * For use when the caller is about to overwrite the entire bitmap anyway.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block for which the bitmap will be replaced
+ */
+static void mvhd_claim_sect_bitmap(MVHDMeta* vhdm, int blk) {
+    bool found;
+    MVHDBitmapCacheEntry* entry = mvhd_find_bitmap_slot(vhdm, blk, &found);
+    if (!found) {
+        mvhd_evict_bitmap_slot(vhdm, entry);
+    }
+    mvhd_use_bitmap_slot(vhdm, entry, blk);
+}
+
+/**
+ * \brief Write a cached sector bitmap to file
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] entry The cache slot holding the bitmap to write
+ */
+static void mvhd_write_sect_bitmap(MVHDMeta* vhdm, MVHDBitmapCacheEntry* entry) {
+    int64_t abs_offset = (int64_t)vhdm->block_offset[entry->block] * MVHD_SECTOR_SIZE;
+    mvhd_write_at(vhdm, entry->bitmap, (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE, abs_offset);
+    if (entry->dirty) {
+        entry->dirty = false;
+        vhdm->write_back.dirty_bytes -= (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE;
+    }
+}
+
+/**
+ * \brief Prepare a bitmap cache slot for reuse by another block
+ * 
+ * If the slot holds a bitmap that has not yet been written back, it is written now.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] entry The cache slot about to be reused
+ */
+static void mvhd_evict_bitmap_slot(MVHDMeta* vhdm, MVHDBitmapCacheEntry* entry) {
+    if (entry->dirty) {
+        mvhd_write_sect_bitmap(vhdm, entry);
+    }
+    entry->block = -1;
+}
+
+/**
+ * \brief Persist the current sector bitmap, or mark it dirty in write-back mode
  * 
  * \param [in] vhdm MiniVHD data structure
  */
 static void mvhd_write_curr_sect_bitmap(MVHDMeta* vhdm) {
-    if (vhdm->bitmap.curr_block >= 0) {
-        int64_t abs_offset = (int64_t)vhdm->block_offset[vhdm->bitmap.curr_block] * MVHD_SECTOR_SIZE;
-        mvhd_fseeko64(vhdm->f, abs_offset, SEEK_SET);
-        fwrite(vhdm->bitmap.curr_bitmap, MVHD_SECTOR_SIZE, vhdm->bitmap.sector_count, vhdm->f);
+    if (vhdm->bitmap.curr_block < 0) {
+        return;
+    }
+    bool found;
+    MVHDBitmapCacheEntry* entry = mvhd_find_bitmap_slot(vhdm, vhdm->bitmap.curr_block, &found);
+    if (!vhdm->write_back.enabled) {
+        mvhd_write_sect_bitmap(vhdm, entry);
+    } else if (!entry->dirty) {
+        entry->dirty = true;
+        vhdm->write_back.dirty_bytes += (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE;
     }
 }
 
 /**
  * \brief Write block offset from memory into file
  * 
+ * In write-back mode, the BAT sector containing the entry is only marked dirty.
+ * 
  * \param [in] vhdm MiniVHD data structure
  * \param [in] blk The block for which to write the offset for
  */
 static void mvhd_write_bat_entry(MVHDMeta* vhdm, int blk) {
+    if (vhdm->write_back.enabled) {
+        int bat_sect = blk / MVHD_BAT_ENT_PER_SECT;
+        if (!vhdm->write_back.bat_dirty[bat_sect]) {
+            vhdm->write_back.bat_dirty[bat_sect] = 1;
+            vhdm->write_back.dirty_bytes += MVHD_SECTOR_SIZE;
+        }
+        return;
+    }
     uint64_t table_offset = vhdm->sparse.bat_offset + ((uint64_t)blk * sizeof *vhdm->block_offset);
     uint32_t offset = mvhd_to_be32(vhdm->block_offset[blk]);
-    mvhd_fseeko64(vhdm->f, table_offset, SEEK_SET);
-    fwrite(&offset, sizeof offset, 1, vhdm->f);
+    mvhd_write_at(vhdm, &offset, sizeof offset, (int64_t)table_offset);
+}
+
+/**
+ * \brief Order pending metadata writes by their file offset
+ */
+static int mvhd_cmp_meta_write(const void* a, const void* b) {
+    const MVHDMetaWrite* wa = (const MVHDMetaWrite*)a;
+    const MVHDMetaWrite* wb = (const MVHDMetaWrite*)b;
+    if (wa->offset < wb->offset) {
+        return -1;
+    }
+    return wa->offset > wb->offset;
+}
+
+int mvhd_write_footer(MVHDMeta* vhdm) {
+    uint8_t footer_buff[MVHD_FOOTER_SIZE];
+    mvhd_footer_to_buffer(&vhdm->footer, footer_buff);
+    if (mvhd_write_at(vhdm, footer_buff, sizeof footer_buff, vhdm->data_end) != sizeof footer_buff) {
+        return -1;
+    }
+    vhdm->footer_dirty = false;
+    return 0;
+}
+
+int mvhd_write_back_metadata(MVHDMeta* vhdm) {
+    if (!vhdm->write_back.enabled || vhdm->write_back.dirty_bytes == 0) {
+        return 0;
+    }
+    int rv = 0;
+    int num_bat_sect = (vhdm->sparse.max_bat_ent + MVHD_BAT_ENT_PER_SECT - 1) / MVHD_BAT_ENT_PER_SECT;
+    int num_writes = 0;
+    int num_dirty_bat = 0;
+    for (int i = 0; i < num_bat_sect; i++) {
+        num_dirty_bat += vhdm->write_back.bat_dirty[i];
+    }
+    MVHDMetaWrite* writes = calloc((size_t)num_dirty_bat + vhdm->bitmap.cache_size, sizeof *writes);
+    uint32_t* bat_buff = calloc((size_t)num_dirty_bat * MVHD_BAT_ENT_PER_SECT, sizeof *bat_buff);
+    if (writes == NULL || bat_buff == NULL) {
+        rv = MVHD_ERR_MEM;
+        goto end;
+    }
+    /* Gather the dirty BAT sectors, converted to their on-disk representation */
+    uint32_t* bat_sect_buff = bat_buff;
+    for (int i = 0; i < num_bat_sect; i++) {
+        if (!vhdm->write_back.bat_dirty[i]) {
+            continue;
+        }
+        for (uint32_t j = 0; j < MVHD_BAT_ENT_PER_SECT; j++) {
+            uint32_t ent = (uint32_t)i * MVHD_BAT_ENT_PER_SECT + j;
+            bat_sect_buff[j] = ent < vhdm->sparse.max_bat_ent ? mvhd_to_be32(vhdm->block_offset[ent]) : MVHD_SPARSE_BLK;
+        }
+        writes[num_writes].offset = (int64_t)vhdm->sparse.bat_offset + ((int64_t)i * MVHD_SECTOR_SIZE);
+        writes[num_writes].data = bat_sect_buff;
+        writes[num_writes].len = MVHD_SECTOR_SIZE;
+        num_writes++;
+        bat_sect_buff += MVHD_BAT_ENT_PER_SECT;
+    }
+    /* And the dirty sector bitmaps */
+    for (int i = 0; i < vhdm->bitmap.cache_size; i++) {
+        MVHDBitmapCacheEntry* entry = &vhdm->bitmap.cache[i];
+        if (!entry->dirty) {
+            continue;
+        }
+        writes[num_writes].offset = (int64_t)vhdm->block_offset[entry->block] * MVHD_SECTOR_SIZE;
+        writes[num_writes].data = entry->bitmap;
+        writes[num_writes].len = (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE;
+        num_writes++;
+    }
+    qsort(writes, num_writes, sizeof *writes, mvhd_cmp_meta_write);
+    for (int i = 0; i < num_writes; i++) {
+        mvhd_write_at(vhdm, writes[i].data, writes[i].len, writes[i].offset);
+    }
+    memset(vhdm->write_back.bat_dirty, 0, num_bat_sect);
+    for (int i = 0; i < vhdm->bitmap.cache_size; i++) {
+        vhdm->bitmap.cache[i].dirty = false;
+    }
+    vhdm->write_back.dirty_bytes = 0;
+end:
+    free(writes);
+    free(bat_buff);
+    return rv;
 }
 
 /**
@@ -99,178 +404,893 @@ static void mvhd_write_bat_entry(MVHDMeta* vhdm, int blk) {
  * (~2MB). These blocks may be stored on disk in any order. Blocks are created 
  * on demand when required.
  * 
- * This function creates new, empty blocks, by replacing the footer at the end of the file 
- * and then re-inserting the footer at the new file end. The BAT table entry for the
- * new block is updated with the new offset.
+ * This function creates new, empty blocks, by extending the file past the end of the 
+ * data. The footer held in memory is written to the new end when the image is flushed 
+ * or closed. The BAT table entry for the new block is updated with the new offset.
+ * 
+ * In thread-safe mode, allocations are serialised by the allocator lock, and the caller 
+ * must hold the block's write lock.
  * 
  * \param [in] vhdm MiniVHD data structure
  * \param [in] blk The block number to create
  */
 static void mvhd_create_block(MVHDMeta* vhdm, int blk) {
-    uint8_t footer[MVHD_FOOTER_SIZE];
-    /* Seek to where the footer SHOULD be */
-    mvhd_fseeko64(vhdm->f, -MVHD_FOOTER_SIZE, SEEK_END);
-    fread(footer, sizeof footer, 1, vhdm->f);
-    mvhd_fseeko64(vhdm->f, -MVHD_FOOTER_SIZE, SEEK_END);
-    if (!mvhd_is_conectix_str(footer)) {
-        /* Oh dear. We use the header instead, since something has gone wrong at the footer */
-        mvhd_fseeko64(vhdm->f, 0, SEEK_SET);
-        fread(footer, sizeof footer, 1, vhdm->f);
-        mvhd_fseeko64(vhdm->f, 0, SEEK_END);
-    }
-    int64_t abs_offset = mvhd_ftello64(vhdm->f);
+    if (vhdm->sync.enabled) {
+        mvhd_mutex_lock(&vhdm->sync.alloc_lock);
+    }
+    int64_t file_size = mvhd_storage_size(vhdm);
+    /* The new block goes where the footer currently is (or would be) */
+    int64_t abs_offset = vhdm->data_end;
     if (abs_offset % MVHD_SECTOR_SIZE != 0) {
         /* Yikes! We're supposed to be on a sector boundary. Add some padding */
-        int64_t padding_amount = (int64_t)MVHD_SECTOR_SIZE - (abs_offset % MVHD_SECTOR_SIZE);
-        uint8_t zero_byte = 0;
-        for (int i = 0; i < padding_amount; i++) {
-            fwrite(&zero_byte, sizeof zero_byte, 1, vhdm->f);
-        }
-        abs_offset += padding_amount;
+        abs_offset += (int64_t)MVHD_SECTOR_SIZE - (abs_offset % MVHD_SECTOR_SIZE);
     }
     uint32_t sect_offset = (uint32_t)(abs_offset / MVHD_SECTOR_SIZE);
     int blk_size_sectors = vhdm->sparse.block_sz / MVHD_SECTOR_SIZE;
-    mvhd_write_empty_sectors(vhdm->f, vhdm->bitmap.sector_count + blk_size_sectors);
-    /* Add a bit of padding. That's what Windows appears to do, although it's not strictly necessary... */
-    mvhd_write_empty_sectors(vhdm->f, 5);
-    /* And we finish with the footer */
-    fwrite(footer, sizeof footer, 1, vhdm->f);
+    /* Add a bit of padding after the block. That's what Windows appears to do, although it's not strictly necessary... */
+    int64_t blk_bytes = ((int64_t)vhdm->bitmap.sector_count + blk_size_sectors + 5) * MVHD_SECTOR_SIZE;
+    int64_t new_end = abs_offset + blk_bytes;
+    if (file_size < new_end + MVHD_FOOTER_SIZE) {
+        if (vhdm->reserve_blocks > 0 && vhdm->storage->reserve != NULL) {
+            /* Allocate space for several blocks, and the footer after them, in one go */
+            int64_t reserve_end = abs_offset + blk_bytes * vhdm->reserve_blocks + MVHD_FOOTER_SIZE;
+            if (vhdm->storage->reserve(vhdm->storage_ctx, file_size, reserve_end - file_size) == 0) {
+                file_size = reserve_end;
+            }
+        }
+    }
+    /* Otherwise grow the file in one go. The new space reads as zero, and the file system 
+       is free to not allocate it until it is written to */
+    if (file_size < new_end && vhdm->storage->set_size(vhdm->storage_ctx, new_end) != 0) {
+        mvhd_write_zeros_at(vhdm, (size_t)(new_end - file_size), file_size);
+    }
+    /* Wipe the old footer, if there is one, which is now part of the new block */
+    int64_t stale_end = vhdm->data_end + MVHD_FOOTER_SIZE;
+    if (stale_end > file_size) {
+        stale_end = file_size;
+    }
+    if (stale_end > vhdm->data_end) {
+        mvhd_write_zeros_at(vhdm, (size_t)(stale_end - vhdm->data_end), vhdm->data_end);
+    }
+    /* The trailing footer is only rewritten on flush or close. Until then the image is 
+       'open and dirty', which mvhd_open() detects and repairs from the footer copy at the start */
+    vhdm->data_end = new_end;
+    vhdm->footer_dirty = true;
     /* We no longer have a sparse block. Update that BAT! */
+    mvhd_lock_bitmaps(vhdm);
     vhdm->block_offset[blk] = sect_offset;
     mvhd_write_bat_entry(vhdm, blk);
+    if (vhdm->block_owner != NULL) {
+        vhdm->block_owner[blk] = 0;
+    }
+    /* A new block has an empty sector bitmap, no need to read it back */
+    mvhd_claim_sect_bitmap(vhdm, blk);
+    memset(vhdm->bitmap.curr_bitmap, 0, vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+    mvhd_unlock_bitmaps(vhdm);
+    if (vhdm->sync.enabled) {
+        mvhd_mutex_unlock(&vhdm->sync.alloc_lock);
+    }
+}
+
+/**
+ * \brief Describe the next bytes of a scatter/gather list, without advancing the cursor
+ * 
+ * \param [in] cur The cursor to start at
+ * \param [in] len The number of bytes wanted
+ * \param [out] vec Array to store the pieces of the buffers holding the bytes in
+ * \param [in] max_vec The number of elements in vec
+ * \param [out] slice_len The number of bytes described, which is less than len if vec 
+ * filled up or the list ended
+ * 
+ * \return The number of elements stored in vec
+ */
+static int mvhd_cursor_slice(const MVHDIOCursor* cur, size_t len, MVHDIOVec* vec, int max_vec, size_t* slice_len) {
+    int n = 0;
+    size_t pos = cur->pos;
+    *slice_len = 0;
+    for (int i = cur->idx; i < cur->iovcnt && n < max_vec && *slice_len < len; i++, pos = 0) {
+        size_t avail = cur->iov[i].len - pos;
+        if (avail == 0) {
+            continue;
+        }
+        if (avail > len - *slice_len) {
+            avail = len - *slice_len;
+        }
+        vec[n].base = (uint8_t*)cur->iov[i].base + pos;
+        vec[n].len = avail;
+        n++;
+        *slice_len += avail;
+    }
+    return n;
+}
+
+void mvhd_cursor_advance(MVHDIOCursor* cur, size_t len) {
+    while (cur->idx < cur->iovcnt && len >= cur->iov[cur->idx].len - cur->pos) {
+        len -= cur->iov[cur->idx].len - cur->pos;
+        cur->pos = 0;
+        cur->idx++;
+    }
+    cur->pos += len;
+}
+
+/**
+ * \brief Read from the storage backend of an image into the next bytes of a scatter/gather list
+ * 
+ * Bytes which span several buffers are read in a single call where the backend has a 
+ * readv_at callback, and one buffer at a time otherwise.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] cur The buffers to read into. Advanced past the bytes read
+ * \param [in] len The number of bytes to read
+ * \param [in] addr The absolute offset to read from
+ */
+static void mvhd_cursor_read_at(MVHDMeta* vhdm, MVHDIOCursor* cur, size_t len, int64_t addr) {
+    MVHDIOVec vec[MVHD_IOV_BATCH];
+    int max_vec = vhdm->storage->readv_at != NULL ? MVHD_IOV_BATCH : 1;
+    while (len > 0) {
+        size_t chunk;
+        int n = mvhd_cursor_slice(cur, len, vec, max_vec, &chunk);
+        if (n == 0) {
+            break;
+        } else if (n == 1) {
+            mvhd_read_at(vhdm, vec[0].base, vec[0].len, addr);
+        } else {
+            vhdm->storage->readv_at(vhdm->storage_ctx, vec, n, addr);
+        }
+        mvhd_cursor_advance(cur, chunk);
+        addr += (int64_t)chunk;
+        len -= chunk;
+    }
+}
+
+/**
+ * \brief Write the next bytes of a scatter/gather list to the storage backend of an image
+ * 
+ * The counterpart to mvhd_cursor_read_at(), using the backend's writev_at callback.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] cur The buffers to write from. Advanced past the bytes written
+ * \param [in] len The number of bytes to write
+ * \param [in] addr The absolute offset to write to
+ */
+static void mvhd_cursor_write_at(MVHDMeta* vhdm, MVHDIOCursor* cur, size_t len, int64_t addr) {
+    MVHDIOVec vec[MVHD_IOV_BATCH];
+    int max_vec = vhdm->storage->writev_at != NULL ? MVHD_IOV_BATCH : 1;
+    while (len > 0) {
+        size_t chunk;
+        int n = mvhd_cursor_slice(cur, len, vec, max_vec, &chunk);
+        if (n == 0) {
+            break;
+        } else if (n == 1) {
+            mvhd_write_at(vhdm, vec[0].base, vec[0].len, addr);
+        } else {
+            vhdm->storage->writev_at(vhdm->storage_ctx, vec, n, addr);
+        }
+        mvhd_cursor_advance(cur, chunk);
+        addr += (int64_t)chunk;
+        len -= chunk;
+    }
+}
+
+/**
+ * \brief Zero the next bytes of a scatter/gather list
+ * 
+ * \param [in] cur The buffers to zero. Advanced past the zeroed bytes
+ * \param [in] len The number of bytes to zero
+ */
+static void mvhd_cursor_zero(MVHDIOCursor* cur, size_t len) {
+    MVHDIOVec vec;
+    size_t chunk;
+    while (len > 0 && mvhd_cursor_slice(cur, len, &vec, 1, &chunk) == 1) {
+        memset(vec.base, 0, chunk);
+        mvhd_cursor_advance(cur, chunk);
+        len -= chunk;
+    }
+}
+
+void mvhd_cursor_copy(MVHDIOCursor* cur, uint8_t* mem, size_t len, bool to_cursor) {
+    MVHDIOVec vec;
+    size_t chunk;
+    while (len > 0 && mvhd_cursor_slice(cur, len, &vec, 1, &chunk) == 1) {
+        if (to_cursor) {
+            memcpy(vec.base, mem, chunk);
+        } else {
+            memcpy(mem, vec.base, chunk);
+        }
+        mvhd_cursor_advance(cur, chunk);
+        mem += chunk;
+        len -= chunk;
+    }
+}
+
+/**
+ * \brief Check whether the next bytes of a scatter/gather list are all zero
+ * 
+ * \param [in] cur The buffers to check. The cursor is not advanced
+ * \param [in] len The number of bytes to check
+ * 
+ * \return true if every byte is zero
+ */
+static bool mvhd_cursor_is_zero(const MVHDIOCursor* cur, size_t len) {
+    MVHDIOVec vec[MVHD_IOV_BATCH];
+    MVHDIOCursor pos = *cur;
+    while (len > 0) {
+        size_t chunk;
+        int n = mvhd_cursor_slice(&pos, len, vec, MVHD_IOV_BATCH, &chunk);
+        if (n == 0) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (!mvhd_is_zero(vec[i].base, vec[i].len)) {
+                return false;
+            }
+        }
+        mvhd_cursor_advance(&pos, chunk);
+        len -= chunk;
+    }
+    return true;
 }
 
-int mvhd_fixed_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff) {
+int mvhd_fixed_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out) {
     int64_t addr;
     int transfer_sectors, truncated_sectors;
     uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
     mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
     addr = (int64_t)offset * MVHD_SECTOR_SIZE;
-    mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
-    fread(out_buff, transfer_sectors*MVHD_SECTOR_SIZE, 1, vhdm->f);
+    mvhd_cursor_read_at(vhdm, out, (size_t)transfer_sectors * MVHD_SECTOR_SIZE, addr);
+    return truncated_sectors;
+}
+
+int mvhd_mapped_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out) {
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    mvhd_cursor_copy(out, vhdm->mapping.data + (size_t)offset * MVHD_SECTOR_SIZE, (size_t)transfer_sectors * MVHD_SECTOR_SIZE, true);
     return truncated_sectors;
 }
 
-int mvhd_sparse_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff) {
+int mvhd_sparse_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out) {
     int transfer_sectors, truncated_sectors;
     uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
     mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
-    uint8_t* buff = (uint8_t*)out_buff;
     int64_t addr;
     uint32_t s, ls;
-    int blk, prev_blk, sib;
+    int blk, sib, blk_sect, run;
+    bool run_set;
+    uint8_t bm_copy[MVHD_SECTOR_SIZE];
+    const uint8_t* bitmap;
+    uint32_t blk_offset;
     ls = offset + transfer_sectors;
-    prev_blk = -1;
-    for (s = offset; s < ls; s++) {
+    for (s = offset; s < ls; s += blk_sect) {
         blk = s / vhdm->sect_per_block;
         sib = s % vhdm->sect_per_block;
-        if (blk != prev_blk) {
-            prev_blk = blk;
-            if (vhdm->bitmap.curr_block != blk) {
-                mvhd_read_sect_bitmap(vhdm, blk);
-                mvhd_fseeko64(vhdm->f, (uint64_t)sib * MVHD_SECTOR_SIZE, SEEK_CUR);
+        blk_sect = vhdm->sect_per_block - sib;
+        if ((uint32_t)blk_sect > ls - s) {
+            blk_sect = ls - s;
+        }
+        bitmap = mvhd_acquire_sect_bitmap(vhdm, blk, bm_copy, &blk_offset);
+        if (bitmap == NULL) {
+            /* Nothing has ever been written to this block */
+            mvhd_cursor_zero(out, (size_t)blk_sect * MVHD_SECTOR_SIZE);
+            continue;
+        }
+        /* Read each run of allocated sectors in one go, and zero fill the holes between them */
+        for (int i = sib; i < sib + blk_sect; i += run) {
+            run = mvhd_bitmap_run_len(bitmap, i, sib + blk_sect, &run_set);
+            if (run_set) {
+                addr = ((int64_t)blk_offset + vhdm->bitmap.sector_count + i) * MVHD_SECTOR_SIZE;
+                mvhd_cursor_read_at(vhdm, out, (size_t)run * MVHD_SECTOR_SIZE, addr);
             } else {
-                addr = ((int64_t)vhdm->block_offset[blk] + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
-                mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
+                mvhd_cursor_zero(out, (size_t)run * MVHD_SECTOR_SIZE);
             }
-        }        
-        if (VHD_TESTBIT(vhdm->bitmap.curr_bitmap, sib)) {
-            fread(buff, MVHD_SECTOR_SIZE, 1, vhdm->f);
-        } else {
-            memset(buff, 0, MVHD_SECTOR_SIZE);
-            mvhd_fseeko64(vhdm->f, MVHD_SECTOR_SIZE, SEEK_CUR);
         }
-        buff += MVHD_SECTOR_SIZE;
+        mvhd_release_sect_bitmap(vhdm, bitmap, bm_copy);
     }
     return truncated_sectors;
 }
 
-int mvhd_diff_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff) {
-    int transfer_sectors, truncated_sectors;
-    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
-    mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
-    uint8_t* buff = (uint8_t*)out_buff;
-    MVHDMeta* curr_vhdm = vhdm;
+/**
+ * \brief Work out the block owner map entry of a block which an image does not have allocated
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block
+ * 
+ * \return the number of layers down the chain to the first one holding the block, or 
+ * MVHD_OWNER_NONE if none does
+ */
+static uint8_t mvhd_block_owner_below(MVHDMeta* vhdm, uint32_t blk) {
+    MVHDMeta* parent = vhdm->parent;
+    if (parent == NULL) {
+        return MVHD_OWNER_NONE;
+    } else if (parent->block_owner == NULL || parent->sect_per_block != vhdm->sect_per_block || 
+               blk >= parent->sparse.max_bat_ent) {
+        return 1;
+    } else if (parent->block_owner[blk] == MVHD_OWNER_NONE) {
+        return MVHD_OWNER_NONE;
+    } else if (parent->block_owner[blk] >= MVHD_OWNER_MAX) {
+        return MVHD_OWNER_MAX;
+    }
+    return parent->block_owner[blk] + 1;
+}
+
+int mvhd_build_block_owner(MVHDMeta* vhdm) {
+    if (vhdm->sparse.max_bat_ent == 0) {
+        return 0;
+    }
+    vhdm->block_owner = malloc(vhdm->sparse.max_bat_ent);
+    if (vhdm->block_owner == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < vhdm->sparse.max_bat_ent; i++) {
+        vhdm->block_owner[i] = vhdm->block_offset[i] != MVHD_SPARSE_BLK ? 0 : mvhd_block_owner_below(vhdm, i);
+    }
+    return 0;
+}
+
+/**
+ * \brief Find the layer of a chain which holds a block, without loading any sector bitmaps
+ * 
+ * Uses the block owner map to skip over layers that have nothing allocated for the 
+ * block. Layers without a map are their own answer.
+ * 
+ * \param [in] vhdm MiniVHD data structure of the layer to start at
+ * \param [in] blk the block, in the block size of vhdm
+ * \param [out] depth how many layers below vhdm the returned layer is
+ * 
+ * \return the layer to continue the lookup at, or NULL if no layer holds the block
+ */
+static MVHDMeta* mvhd_block_owner(MVHDMeta* vhdm, int blk, int* depth) {
+    *depth = 0;
+    if (vhdm->block_owner == NULL) {
+        return vhdm;
+    }
+    int dist;
+    if (vhdm->readonly) {
+        dist = vhdm->block_owner[blk];
+    } else {
+        /* The map of a writable image changes along with its BAT, under the same lock */
+        mvhd_lock_bitmaps(vhdm);
+        dist = vhdm->block_owner[blk];
+        mvhd_unlock_bitmaps(vhdm);
+    }
+    if (dist == MVHD_OWNER_NONE) {
+        return NULL;
+    }
+    for (int i = 0; i < dist; i++) {
+        vhdm = vhdm->parent;
+    }
+    *depth = dist;
+    return vhdm;
+}
+
+/**
+ * \brief Read a range of sectors from a layer of a differencing chain
+ * 
+ * The range is split into maximal runs of sectors which are either present in 
+ * this layer, or must be fetched from the parent. Each present run is read in 
+ * a single call, and each absent run is resolved against the parent in the same 
+ * manner, so no layer is visited more than once per run. Blocks that the owner map 
+ * places further down the chain go straight to the layer holding them, or are zero 
+ * filled if none does.
+ * 
+ * The range must already have been checked against the size of the image.
+ * 
+ * \param [in] vhdm MiniVHD data structure of the layer to start at
+ * \param [in] offset Sector offset to read from
+ * \param [in] num_sectors The number of sectors to read
+ * \param [out] out The buffers to store the sectors in, with room for num_sectors
+ */
+static void mvhd_diff_read_range(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out) {
+    if (vhdm->footer.disk_type == MVHD_TYPE_FIXED) {
+        mvhd_fixed_read(vhdm, offset, num_sectors, out);
+        return;
+    } else if (vhdm->footer.disk_type == MVHD_TYPE_DYNAMIC) {
+        mvhd_sparse_read(vhdm, offset, num_sectors, out);
+        return;
+    }
+    int64_t addr;
     uint32_t s, ls;
-    int blk, sib;
-    ls = offset + transfer_sectors;
-    for (s = offset; s < ls; s++) {
-        while (curr_vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
-            blk = s / curr_vhdm->sect_per_block;
-            sib = s % curr_vhdm->sect_per_block;
-            if (curr_vhdm->bitmap.curr_block != blk) {
-                mvhd_read_sect_bitmap(curr_vhdm, blk);
+    int blk, sib, blk_sect, run, depth;
+    bool run_set;
+    uint8_t bm_copy[MVHD_SECTOR_SIZE];
+    const uint8_t* bitmap;
+    uint32_t blk_offset;
+    MVHDMeta* owner;
+    ls = offset + num_sectors;
+    for (s = offset; s < ls; s += blk_sect) {
+        blk = s / vhdm->sect_per_block;
+        sib = s % vhdm->sect_per_block;
+        blk_sect = vhdm->sect_per_block - sib;
+        if ((uint32_t)blk_sect > ls - s) {
+            blk_sect = ls - s;
+        }
+        owner = mvhd_block_owner(vhdm, blk, &depth);
+        if (owner == NULL) {
+            mvhd_cursor_zero(out, (size_t)blk_sect * MVHD_SECTOR_SIZE);
+            continue;
+        } else if (owner != vhdm) {
+            mvhd_diff_read_range(owner, s, blk_sect, out);
+            continue;
+        }
+        bitmap = mvhd_acquire_sect_bitmap(vhdm, blk, bm_copy, &blk_offset);
+        if (bitmap == NULL) {
+            /* This layer has nothing for the block, so the parent owns all of it */
+            mvhd_diff_read_range(vhdm->parent, s, blk_sect, out);
+            continue;
+        }
+        for (int i = sib; i < sib + blk_sect; i += run) {
+            run = mvhd_bitmap_run_len(bitmap, i, sib + blk_sect, &run_set);
+            if (run_set) {
+                addr = ((int64_t)blk_offset + vhdm->bitmap.sector_count + i) * MVHD_SECTOR_SIZE;
+                mvhd_cursor_read_at(vhdm, out, (size_t)run * MVHD_SECTOR_SIZE, addr);
+            } else {
+                mvhd_diff_read_range(vhdm->parent, s + (i - sib), run, out);
             }
-            if (!VHD_TESTBIT(curr_vhdm->bitmap.curr_bitmap, sib)) {
-                curr_vhdm = curr_vhdm->parent;
-            } else { break; }
-        }
-        /* We handle actual sector reading using the fixed or sparse functions,
-           as a differencing VHD is also a sparse VHD */
-        if (curr_vhdm->footer.disk_type == MVHD_TYPE_DIFF || curr_vhdm->footer.disk_type == MVHD_TYPE_DYNAMIC) {
-            mvhd_sparse_read(curr_vhdm, s, 1, buff);
-        } else {
-            mvhd_fixed_read(curr_vhdm, s, 1, buff);
         }
-        curr_vhdm = vhdm;
-        buff += MVHD_SECTOR_SIZE;
+        mvhd_release_sect_bitmap(vhdm, bitmap, bm_copy);
     }
+}
+
+int mvhd_diff_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out) {
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    mvhd_diff_read_range(vhdm, offset, transfer_sectors, out);
     return truncated_sectors;
 }
 
-int mvhd_fixed_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff) {
+int mvhd_fixed_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* in) {
     int64_t addr;
     int transfer_sectors, truncated_sectors;
     uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
     mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
     addr = (int64_t)offset * MVHD_SECTOR_SIZE;
-    mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
-    fwrite(in_buff, transfer_sectors*MVHD_SECTOR_SIZE, 1, vhdm->f);
+    mvhd_cursor_write_at(vhdm, in, (size_t)transfer_sectors * MVHD_SECTOR_SIZE, addr);
     return truncated_sectors;
 }
 
-int mvhd_sparse_diff_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff) {
+int mvhd_mapped_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* in) {
     int transfer_sectors, truncated_sectors;
     uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
     mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
-    uint8_t* buff = (uint8_t*)in_buff;
+    mvhd_cursor_copy(in, vhdm->mapping.data + (size_t)offset * MVHD_SECTOR_SIZE, (size_t)transfer_sectors * MVHD_SECTOR_SIZE, false);
+    return truncated_sectors;
+}
+
+/**
+ * \brief Write a range of sectors of a sparse or differencing image, block by block
+ * 
+ * Blocks are allocated as needed. The range must already have been checked against the 
+ * size of the image.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset to write to
+ * \param [in] num_sectors The number of sectors to write
+ * \param [in] in The buffers to write sectors from, advanced past them
+ */
+static void mvhd_write_range(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* in) {
     int64_t addr;
     uint32_t s, ls;
-    int blk, prev_blk, sib;
-    ls = offset + transfer_sectors;
-    prev_blk = -1;
-    for (s = offset; s < ls; s++) {
+    int blk, sib, blk_sect;
+    bool full_block, bitmap_dirty;
+    ls = offset + num_sectors;
+    for (s = offset; s < ls; s += blk_sect) {
         blk = s / vhdm->sect_per_block;
         sib = s % vhdm->sect_per_block;
-        if (vhdm->bitmap.curr_block != blk && prev_blk >= 0) {            
-            /* Write the sector bitmap for the previous block, before we replace it. */
-            mvhd_write_curr_sect_bitmap(vhdm);
+        blk_sect = vhdm->sect_per_block - sib;
+        if ((uint32_t)blk_sect > ls - s) {
+            blk_sect = ls - s;
         }
+        full_block = (blk_sect == vhdm->sect_per_block);
+        /* Only writers holding this lock allocate the block, so its BAT entry is stable from here on */
+        mvhd_lock_block(vhdm, blk);
         if (vhdm->block_offset[blk] == MVHD_SPARSE_BLK) {
-            /* "read" the sector bitmap first, before creating a new block, as the bitmap will be
-               zero either way */
-            mvhd_read_sect_bitmap(vhdm, blk);
             mvhd_create_block(vhdm, blk);
-        } 
-        if (blk != prev_blk) {
-            if (vhdm->bitmap.curr_block != blk) {                
-                mvhd_read_sect_bitmap(vhdm, blk);
-                mvhd_fseeko64(vhdm->f, (uint64_t)sib * MVHD_SECTOR_SIZE, SEEK_CUR);
+        }
+        addr = ((int64_t)vhdm->block_offset[blk] + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
+        mvhd_cursor_write_at(vhdm, in, (size_t)blk_sect * MVHD_SECTOR_SIZE, addr);
+        /* The sectors only become visible once the data is in place */
+        mvhd_lock_bitmaps(vhdm);
+        if (full_block) {
+            /* Every sector is set, so the old bitmap is irrelevant */
+            mvhd_claim_sect_bitmap(vhdm, blk);
+            memset(vhdm->bitmap.curr_bitmap, 0xff, vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+            bitmap_dirty = true;
+        } else {
+            mvhd_read_sect_bitmap(vhdm, blk);
+            bitmap_dirty = mvhd_bitmap_set_range(vhdm->bitmap.curr_bitmap, sib, sib + blk_sect);
+        }
+        /* Overwriting sectors that are already allocated leaves the bitmap untouched */
+        if (bitmap_dirty) {
+            mvhd_write_curr_sect_bitmap(vhdm);
+        }
+        mvhd_unlock_bitmaps(vhdm);
+        mvhd_unlock_block(vhdm, blk);
+    }
+    mvhd_lock_bitmaps(vhdm);
+    if (vhdm->write_back.enabled && vhdm->write_back.dirty_bytes >= vhdm->write_back.threshold) {
+        mvhd_write_back_metadata(vhdm);
+    }
+    mvhd_unlock_bitmaps(vhdm);
+}
+
+int mvhd_sparse_diff_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* in) {
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    if (!vhdm->elide_zero_writes) {
+        mvhd_write_range(vhdm, offset, transfer_sectors, in);
+        return truncated_sectors;
+    }
+    /* Zeros written to a block are stored by discarding the sectors instead, which never 
+       allocates a block, and may even free one */
+    uint32_t s, ls;
+    int blk_sect;
+    ls = offset + transfer_sectors;
+    for (s = offset; s < ls; s += blk_sect) {
+        blk_sect = vhdm->sect_per_block - (s % vhdm->sect_per_block);
+        if ((uint32_t)blk_sect > ls - s) {
+            blk_sect = ls - s;
+        }
+        size_t len = (size_t)blk_sect * MVHD_SECTOR_SIZE;
+        if (!mvhd_cursor_is_zero(in, len)) {
+            mvhd_write_range(vhdm, s, blk_sect, in);
+        } else if (vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
+            mvhd_diff_discard_range(vhdm, s, blk_sect);
+            mvhd_cursor_advance(in, len);
+        } else {
+            mvhd_discard_range(vhdm, s, blk_sect);
+            mvhd_cursor_advance(in, len);
+        }
+    }
+    return truncated_sectors;
+}
+
+/**
+ * \brief Add a run of sectors to an extent list, merging it with the previous run if possible
+ * 
+ * \retval true if the run was added
+ * \retval false if the list is full
+ */
+static bool mvhd_add_extent(MVHDExtentList* list, uint32_t offset, uint32_t num_sectors, MVHDExtentType type, int layer, int64_t file_offset) {
+    /* Zero runs read the same whichever layer they were found in */
+    if (type == MVHD_EXTENT_ZERO) {
+        layer = -1;
+        file_offset = -1;
+    }
+    if (list->count > 0) {
+        MVHDExtent* prev = &list->extents[list->count - 1];
+        if (prev->type == type && prev->layer == layer && prev->offset + prev->num_sectors == offset &&
+            (type == MVHD_EXTENT_ZERO || prev->file_offset + (int64_t)prev->num_sectors * MVHD_SECTOR_SIZE == file_offset)) {
+            prev->num_sectors += num_sectors;
+            return true;
+        }
+    }
+    if (list->count == list->max) {
+        return false;
+    }
+    MVHDExtent* ext = &list->extents[list->count++];
+    ext->offset = offset;
+    ext->num_sectors = num_sectors;
+    ext->type = type;
+    ext->layer = layer;
+    ext->file_offset = file_offset;
+    return true;
+}
+
+/**
+ * \brief Describe a range of sectors of one layer as a list of extents
+ * 
+ * Works the same way as mvhd_diff_read_range(), but records where each run lives 
+ * instead of reading it.
+ * 
+ * \param [in] vhdm MiniVHD data structure of the layer to start at
+ * \param [in] layer the depth of vhdm in the chain
+ * \param [in] offset the first sector of the range
+ * \param [in] num_sectors the number of sectors in the range
+ * \param [in] list the extent list to add to
+ * 
+ * \retval true if the whole range was described
+ * \retval false if the list filled up
+ */
+static bool mvhd_map_range(MVHDMeta* vhdm, int layer, uint32_t offset, int num_sectors, MVHDExtentList* list) {
+    if (vhdm->footer.disk_type == MVHD_TYPE_FIXED) {
+        return mvhd_add_extent(list, offset, num_sectors, MVHD_EXTENT_DATA, layer, (int64_t)offset * MVHD_SECTOR_SIZE);
+    }
+    int64_t addr;
+    uint32_t s, ls;
+    int blk, sib, blk_sect, run, depth;
+    bool run_set, more;
+    uint8_t bm_copy[MVHD_SECTOR_SIZE];
+    const uint8_t* bitmap;
+    uint32_t blk_offset;
+    MVHDMeta* owner;
+    ls = offset + num_sectors;
+    for (s = offset; s < ls; s += blk_sect) {
+        blk = s / vhdm->sect_per_block;
+        sib = s % vhdm->sect_per_block;
+        blk_sect = vhdm->sect_per_block - sib;
+        if ((uint32_t)blk_sect > ls - s) {
+            blk_sect = ls - s;
+        }
+        owner = mvhd_block_owner(vhdm, blk, &depth);
+        if (owner != vhdm) {
+            if (owner == NULL) {
+                more = mvhd_add_extent(list, s, blk_sect, MVHD_EXTENT_ZERO, layer, -1);
+            } else {
+                more = mvhd_map_range(owner, layer + depth, s, blk_sect, list);
+            }
+            if (!more) {
+                return false;
+            }
+            continue;
+        }
+        bitmap = mvhd_acquire_sect_bitmap(vhdm, blk, bm_copy, &blk_offset);
+        if (bitmap == NULL) {
+            if (vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
+                more = mvhd_map_range(vhdm->parent, layer + 1, s, blk_sect, list);
+            } else {
+                more = mvhd_add_extent(list, s, blk_sect, MVHD_EXTENT_ZERO, layer, -1);
+            }
+            if (!more) {
+                return false;
+            }
+            continue;
+        }
+        more = true;
+        for (int i = sib; more && i < sib + blk_sect; i += run) {
+            run = mvhd_bitmap_run_len(bitmap, i, sib + blk_sect, &run_set);
+            if (run_set) {
+                addr = ((int64_t)blk_offset + vhdm->bitmap.sector_count + i) * MVHD_SECTOR_SIZE;
+                more = mvhd_add_extent(list, s + (i - sib), run, MVHD_EXTENT_DATA, layer, addr);
+            } else if (vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
+                more = mvhd_map_range(vhdm->parent, layer + 1, s + (i - sib), run, list);
+            } else {
+                more = mvhd_add_extent(list, s + (i - sib), run, MVHD_EXTENT_ZERO, layer, -1);
+            }
+        }
+        mvhd_release_sect_bitmap(vhdm, bitmap, bm_copy);
+        if (!more) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int mvhd_get_extents(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDExtent* extents, int max_extents) {
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    if (extents == NULL || max_extents <= 0 || num_sectors < 0 || offset > total_sectors) {
+        return MVHD_ERR_INVALID_PARAMS;
+    }
+    mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    MVHDExtentList list = { .extents = extents, .count = 0, .max = max_extents };
+    mvhd_lock_shared(vhdm);
+    mvhd_map_range(vhdm, 0, offset, transfer_sectors, &list);
+    mvhd_unlock_shared(vhdm);
+    return list.count;
+}
+
+int mvhd_noop_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* in) {
+    (void)vhdm;
+    (void)offset;
+    (void)num_sectors;
+    (void)in;
+    return 0;
+}
+
+/**
+ * \brief Turn an allocated block back into a sparse one. Must be called with the bitmap lock held
+ * 
+ * The block's bitmap is dropped from the cache, even if it has not been written back yet.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block to drop
+ */
+static void mvhd_drop_block(MVHDMeta* vhdm, int blk) {
+    bool found;
+    MVHDBitmapCacheEntry* entry = mvhd_find_bitmap_slot(vhdm, blk, &found);
+    if (found) {
+        if (entry->dirty) {
+            entry->dirty = false;
+            vhdm->write_back.dirty_bytes -= (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE;
+        }
+        entry->block = -1;
+    }
+    if (vhdm->bitmap.curr_block == blk) {
+        vhdm->bitmap.curr_block = -1;
+    }
+    vhdm->block_offset[blk] = MVHD_SPARSE_BLK;
+    mvhd_write_bat_entry(vhdm, blk);
+    if (vhdm->block_owner != NULL) {
+        vhdm->block_owner[blk] = mvhd_block_owner_below(vhdm, blk);
+    }
+}
+
+/**
+ * \brief Give back the file space of a block that has been dropped
+ * 
+ * If the block was the last one in the file, the next new block is placed where it was. 
+ * This is not done in thread-safe mode, where readers may still be using the block's old 
+ * location. The space is released to the host file system, if the storage backend can do so.
+ * 
+ * The BAT entry of a new block may reach the file before its sector bitmap does. So if the 
+ * space is to be reused, and could not be released, the old bitmap is wiped on disk, so 
+ * that a crash in between can not expose the old block's sectors through the new block.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk_offset The sector offset the block was stored at
+ */
+static void mvhd_release_block_space(MVHDMeta* vhdm, uint32_t blk_offset) {
+    int64_t start = (int64_t)blk_offset * MVHD_SECTOR_SIZE;
+    int64_t len = ((int64_t)vhdm->bitmap.sector_count + vhdm->sect_per_block) * MVHD_SECTOR_SIZE;
+    bool reuse = false;
+    if (!vhdm->sync.enabled && start + len + 5 * MVHD_SECTOR_SIZE == vhdm->data_end) {
+        /* Including the padding added by mvhd_create_block() */
+        len += 5 * MVHD_SECTOR_SIZE;
+        vhdm->data_end = start;
+        vhdm->footer_dirty = true;
+        reuse = true;
+    }
+    bool punched = vhdm->storage->punch_hole != NULL && vhdm->storage->punch_hole(vhdm->storage_ctx, start, len) == 0;
+    if (reuse && !punched) {
+        mvhd_write_zeros_at(vhdm, (size_t)vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE, start);
+    }
+}
+
+/**
+ * \brief Discard sectors within a single block of a sparse or differencing image
+ * 
+ * The sectors are marked unallocated in the block's bitmap, and their space is released 
+ * to the host file system. Once no sector of the block is left allocated, the whole block 
+ * is dropped.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] blk The block to discard sectors of
+ * \param [in] sib The first sector to discard, counted from the start of the block
+ * \param [in] blk_sect The number of sectors to discard
+ */
+static void mvhd_discard_in_block(MVHDMeta* vhdm, int blk, int sib, int blk_sect) {
+    /* As with writes, only holders of this lock allocate or drop the block */
+    mvhd_lock_block(vhdm, blk);
+    uint32_t blk_offset = vhdm->block_offset[blk];
+    if (blk_offset == MVHD_SPARSE_BLK) {
+        mvhd_unlock_block(vhdm, blk);
+        return;
+    }
+    mvhd_lock_bitmaps(vhdm);
+    mvhd_read_sect_bitmap(vhdm, blk);
+    bool changed = mvhd_bitmap_clear_range(vhdm->bitmap.curr_bitmap, sib, sib + blk_sect);
+    bool empty = mvhd_bitmap_find_next_set(vhdm->bitmap.curr_bitmap, 0, vhdm->sect_per_block) == vhdm->sect_per_block;
+    if (empty) {
+        mvhd_drop_block(vhdm, blk);
+    } else if (changed) {
+        mvhd_write_curr_sect_bitmap(vhdm);
+    }
+    mvhd_unlock_bitmaps(vhdm);
+    if (empty) {
+        if (vhdm->sync.enabled) {
+            mvhd_mutex_lock(&vhdm->sync.alloc_lock);
+        }
+        mvhd_release_block_space(vhdm, blk_offset);
+        if (vhdm->sync.enabled) {
+            mvhd_mutex_unlock(&vhdm->sync.alloc_lock);
+        }
+    } else if (changed && vhdm->storage->punch_hole != NULL) {
+        /* The sectors are no longer read from the file, whatever it holds for them */
+        int64_t addr = ((int64_t)blk_offset + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
+        vhdm->storage->punch_hole(vhdm->storage_ctx, addr, (int64_t)blk_sect * MVHD_SECTOR_SIZE);
+    }
+    mvhd_unlock_block(vhdm, blk);
+}
+
+/**
+ * \brief Discard a range of sectors of a sparse or differencing image, block by block
+ * 
+ * The range must already have been checked against the size of the image.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset The first sector to discard
+ * \param [in] num_sectors The number of sectors to discard
+ */
+static void mvhd_discard_range(MVHDMeta* vhdm, uint32_t offset, int num_sectors) {
+    uint32_t s, ls;
+    int blk_sect;
+    ls = offset + num_sectors;
+    for (s = offset; s < ls; s += blk_sect) {
+        int blk = s / vhdm->sect_per_block;
+        int sib = s % vhdm->sect_per_block;
+        blk_sect = vhdm->sect_per_block - sib;
+        if ((uint32_t)blk_sect > ls - s) {
+            blk_sect = ls - s;
+        }
+        mvhd_discard_in_block(vhdm, blk, sib, blk_sect);
+    }
+    mvhd_lock_bitmaps(vhdm);
+    if (vhdm->write_back.enabled && vhdm->write_back.dirty_bytes >= vhdm->write_back.threshold) {
+        mvhd_write_back_metadata(vhdm);
+    }
+    mvhd_unlock_bitmaps(vhdm);
+}
+
+/**
+ * \brief Write zeros to a range of sectors of a sparse or differencing image
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset The first sector to write to
+ * \param [in] num_sectors The number of sectors to write
+ */
+static void mvhd_write_zero_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors) {
+    while (num_sectors > 0) {
+        int n = num_sectors < vhdm->format_buffer.sector_count ? num_sectors : vhdm->format_buffer.sector_count;
+        MVHDIOVec iov = { vhdm->format_buffer.zero_data, (size_t)n * MVHD_SECTOR_SIZE };
+        MVHDIOCursor cur = { &iov, 1, 0, 0 };
+        mvhd_write_range(vhdm, offset, n, &cur);
+        offset += n;
+        num_sectors -= n;
+    }
+}
+
+int mvhd_fixed_discard(MVHDMeta* vhdm, uint32_t offset, int num_sectors) {
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    int64_t addr = (int64_t)offset * MVHD_SECTOR_SIZE;
+    size_t len = (size_t)transfer_sectors * MVHD_SECTOR_SIZE;
+    if (len > 0 && (vhdm->storage->punch_hole == NULL || vhdm->storage->punch_hole(vhdm->storage_ctx, addr, (int64_t)len) != 0)) {
+        mvhd_write_zeros_at(vhdm, len, addr);
+    }
+    return truncated_sectors;
+}
+
+int mvhd_sparse_discard(MVHDMeta* vhdm, uint32_t offset, int num_sectors) {
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    mvhd_discard_range(vhdm, offset, transfer_sectors);
+    return truncated_sectors;
+}
+
+/**
+ * \brief Discard a range of sectors of a differencing image
+ * 
+ * Sectors which read as zero in the parent are discarded as in a sparse image, and 
+ * zeros are written to the others. The range must already have been checked against 
+ * the size of the image.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset The first sector to discard
+ * \param [in] num_sectors The number of sectors to discard
+ */
+static void mvhd_diff_discard_range(MVHDMeta* vhdm, uint32_t offset, int num_sectors) {
+    MVHDExtent extents[16];
+    uint32_t s = offset, ls = offset + num_sectors;
+    while (s < ls) {
+        MVHDExtentList list = { .extents = extents, .count = 0, .max = 16 };
+        mvhd_map_range(vhdm->parent, 1, s, ls - s, &list);
+        for (int i = 0; i < list.count; i++) {
+            /* Unallocated sectors would show the parent's data, so those must hold zeros instead */
+            if (extents[i].type == MVHD_EXTENT_ZERO) {
+                mvhd_discard_range(vhdm, extents[i].offset, extents[i].num_sectors);
             } else {
-                addr = ((int64_t)vhdm->block_offset[blk] + vhdm->bitmap.sector_count + sib) * MVHD_SECTOR_SIZE;
-                mvhd_fseeko64(vhdm->f, addr, SEEK_SET);
+                mvhd_write_zero_sectors(vhdm, extents[i].offset, extents[i].num_sectors);
             }
-            prev_blk = blk;
         }
-        fwrite(buff, MVHD_SECTOR_SIZE, 1, vhdm->f);
-        VHD_SETBIT(vhdm->bitmap.curr_bitmap, sib);
-        buff += MVHD_SECTOR_SIZE;
+        s = extents[list.count - 1].offset + extents[list.count - 1].num_sectors;
     }
-    /* And write the sector bitmap for the last block we visited to disk */
-    mvhd_write_curr_sect_bitmap(vhdm);
+}
+
+int mvhd_diff_discard(MVHDMeta* vhdm, uint32_t offset, int num_sectors) {
+    int transfer_sectors, truncated_sectors;
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    mvhd_check_sectors(offset, num_sectors, total_sectors, &transfer_sectors, &truncated_sectors);
+    mvhd_diff_discard_range(vhdm, offset, transfer_sectors);
     return truncated_sectors;
 }
 
-int mvhd_noop_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff) {
+int mvhd_noop_discard(MVHDMeta* vhdm, uint32_t offset, int num_sectors) {
+    (void)vhdm;
+    (void)offset;
+    (void)num_sectors;
     return 0;
 }
@@ -1,17 +1,65 @@
 #ifndef MINIVHD_IO_H
 #define MINIVHD_IO_H
 #include "minivhd.h"
+#include "minivhd_internal.h"
 
 /**
- * \brief Write zero filled sectors to file.
+ * \brief Write the footer held in memory to the end of the image data
  * 
- * Note, the caller should set the file position before calling this 
- * function for correct operation.
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \retval 0 if the footer was written
+ * \retval -1 if the write failed
+ */
+int mvhd_write_footer(MVHDMeta* vhdm);
+
+/**
+ * \brief Write all dirty sector bitmaps and BAT sectors to file
+ * 
+ * Only has an effect when write-back mode is enabled for the image. The pending 
+ * writes are issued in file offset order.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \retval 0 if the metadata was written
+ * \retval MVHD_ERR_MEM if a temporary buffer could not be allocated
+ */
+int mvhd_write_back_metadata(MVHDMeta* vhdm);
+
+/**
+ * \brief Work out which layer of the chain holds each block of a sparse or differencing image
+ * 
+ * Each entry is 0 if this image has the block allocated, the number of layers down 
+ * the chain to the first one that has, or MVHD_OWNER_NONE if none do and the block 
+ * reads as zeros. Parents are read-only, so only the entries of a writable image 
+ * change, as its blocks are allocated and dropped. The parent's own map is reused 
+ * when its blocks line up with ours; otherwise the lookup stops at the parent. Must 
+ * be called once the parent is open.
+ * 
+ * \param [in] vhdm MiniVHD data structure of a sparse or differencing image
+ * 
+ * \retval 0 if the map was built
+ * \retval -1 if memory could not be allocated
+ */
+int mvhd_build_block_owner(MVHDMeta* vhdm);
+
+/**
+ * \brief Move a cursor forward through its scatter/gather list
  * 
- * \param [in] f File to write sectors to
- * \param [in] sector_count The number of sectors to write
+ * \param [in] cur The cursor to advance
+ * \param [in] len The number of bytes to move forward
  */
-void mvhd_write_empty_sectors(FILE* f, int sector_count);
+void mvhd_cursor_advance(MVHDIOCursor* cur, size_t len);
+
+/**
+ * \brief Copy between memory and the next bytes of a scatter/gather list
+ * 
+ * \param [in] cur The buffers to copy to or from. Advanced past the copied bytes
+ * \param [in] mem The memory to copy from or to
+ * \param [in] len The number of bytes to copy
+ * \param [in] to_cursor true to copy from mem into the buffers, false to copy the other way
+ */
+void mvhd_cursor_copy(MVHDIOCursor* cur, uint8_t* mem, size_t len, bool to_cursor);
 
 /**
  * \brief Read a fixed VHD image
@@ -22,13 +70,30 @@ void mvhd_write_empty_sectors(FILE* f, int sector_count);
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to read from
  * \param [in] num_sectors The desired number of sectors to read
- * \param [out] out_buff An output buffer to store read sectors. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [out] out The buffers to store read sectors in, advanced past them. Must 
+ * have room for num_sectors worth of sectors.
+ * 
+ * \retval 0 num_sectors were read from file
+ * \retval >0 < num_sectors were read from file
+ */
+int mvhd_fixed_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out);
+
+/**
+ * \brief Read a memory mapped fixed VHD image
+ * 
+ * Sectors are copied straight out of the mapping. Used for fixed images opened 
+ * with mvhd_open_mapped().
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset to read from
+ * \param [in] num_sectors The desired number of sectors to read
+ * \param [out] out The buffers to store read sectors in, advanced past them. Must 
+ * have room for num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were read from file
  * \retval >0 < num_sectors were read from file
  */
-int mvhd_fixed_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff);
+int mvhd_mapped_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out);
 
 /**
  * \brief Read a sparse VHD image
@@ -42,13 +107,13 @@ int mvhd_fixed_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to read from
  * \param [in] num_sectors The desired number of sectors to read
- * \param [out] out_buff An output buffer to store read sectors. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [out] out The buffers to store read sectors in, advanced past them. Must 
+ * have room for num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were read from file
  * \retval >0 < num_sectors were read from file
  */
-int mvhd_sparse_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff);
+int mvhd_sparse_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out);
 
 /**
  * \brief Read a differencing VHD image
@@ -65,13 +130,13 @@ int mvhd_sparse_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to read from
  * \param [in] num_sectors The desired number of sectors to read
- * \param [out] out_buff An output buffer to store read sectors. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [out] out The buffers to store read sectors in, advanced past them. Must 
+ * have room for num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were read from file
  * \retval >0 < num_sectors were read from file
  */
-int mvhd_diff_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff);
+int mvhd_diff_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out);
 
 /**
  * \brief Write to a fixed VHD image
@@ -82,13 +147,30 @@ int mvhd_diff_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_b
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to write to
  * \param [in] num_sectors The desired number of sectors to write
- * \param [in] in_buff A source buffer to write sectors from. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [in] in The buffers to write sectors from, advanced past them. Must 
+ * hold num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were written to file
  * \retval >0 < num_sectors were written to file
  */
-int mvhd_fixed_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
+int mvhd_fixed_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* in);
+
+/**
+ * \brief Write to a memory mapped fixed VHD image
+ * 
+ * Sectors are stored straight into the mapping. They reach the file when the 
+ * mapping is synced by mvhd_flush() or mvhd_close(), or whenever the OS decides to.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset to write to
+ * \param [in] num_sectors The desired number of sectors to write
+ * \param [in] in The buffers to write sectors from, advanced past them. Must 
+ * hold num_sectors worth of sectors.
+ * 
+ * \retval 0 num_sectors were written to file
+ * \retval >0 < num_sectors were written to file
+ */
+int mvhd_mapped_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* in);
 
 /**
  * \brief Write to a sparse or differencing VHD image
@@ -107,13 +189,13 @@ int mvhd_fixed_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to write to
  * \param [in] num_sectors The desired number of sectors to write
- * \param [in] in_buff A source buffer to write sectors from. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [in] in The buffers to write sectors from, advanced past them. Must 
+ * hold num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were written to file
  * \retval >0 < num_sectors were written to file
  */
-int mvhd_sparse_diff_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
+int mvhd_sparse_diff_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* in);
 
 /**
  * \brief A no-op function to "write" to read-only VHD images
@@ -121,12 +203,69 @@ int mvhd_sparse_diff_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, voi
  * \param [in] vhdm MiniVHD data structure
  * \param [in] offset Sector offset to write to
  * \param [in] num_sectors The desired number of sectors to write
- * \param [in] in_buff A source buffer to write sectors from. Must be 
- * large enough to hold num_sectors worth of sectors.
+ * \param [in] in The buffers to write sectors from, advanced past them. Must 
+ * hold num_sectors worth of sectors.
  * 
  * \retval 0 num_sectors were written to file
  * \retval >0 < num_sectors were written to file
  */
-int mvhd_noop_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff);
+int mvhd_noop_write(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* in);
+
+/**
+ * \brief Discard sectors of a fixed VHD image
+ * 
+ * The sectors are turned into a hole in the file where the storage backend supports 
+ * that, and overwritten with zeros otherwise.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset to discard from
+ * \param [in] num_sectors The desired number of sectors to discard
+ * 
+ * \retval 0 num_sectors were discarded
+ * \retval >0 < num_sectors were discarded
+ */
+int mvhd_fixed_discard(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Discard sectors of a sparse VHD image
+ * 
+ * The sectors are marked unallocated in the sector bitmaps, and blocks left without 
+ * allocated sectors are returned to the sparse state. Their space is released to the host 
+ * file system where the storage backend supports that.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset to discard from
+ * \param [in] num_sectors The desired number of sectors to discard
+ * 
+ * \retval 0 num_sectors were discarded
+ * \retval >0 < num_sectors were discarded
+ */
+int mvhd_sparse_discard(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Discard sectors of a differencing VHD image
+ * 
+ * Sectors which read as zero in the parent are discarded as in a sparse image. Marking 
+ * the others unallocated would expose the parent's data, so zeros are written to them.
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset to discard from
+ * \param [in] num_sectors The desired number of sectors to discard
+ * 
+ * \retval 0 num_sectors were discarded
+ * \retval >0 < num_sectors were discarded
+ */
+int mvhd_diff_discard(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief A no-op function to "discard" sectors of read-only VHD images
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset Sector offset to discard from
+ * \param [in] num_sectors The desired number of sectors to discard
+ * 
+ * \retval 0 always
+ */
+int mvhd_noop_discard(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
 
 #endif
\ No newline at end of file
@@ -3,21 +3,27 @@
  * \brief VHD management functions (open, close, read write etc)
  */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* for pthread_rwlock_t */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include "cwalk.h"
 #include "libxml2_encoding.h"
 #include "minivhd_internal.h"
+#include "minivhd_cache.h"
 #include "minivhd_io.h"
+#include "minivhd_readahead.h"
 #include "minivhd_util.h"
 #include "minivhd_struct_rw.h"
 #include "minivhd.h"
 
 int mvhd_errno = 0;
-static char tmp_open_path[MVHD_MAX_PATH_BYTES] = {0};
 struct MVHDPaths {
     char dir_path[MVHD_MAX_PATH_BYTES];
     char file_name[MVHD_MAX_PATH_BYTES];
@@ -27,23 +33,38 @@ struct MVHDPaths {
     uint16_t tmp_src_path[MVHD_MAX_PATH_CHARS];
 };
 
-static void mvhd_read_footer(MVHDMeta* vhdm);
+static void mvhd_read_footer(MVHDMeta* vhdm, int64_t offset);
 static void mvhd_read_sparse_header(MVHDMeta* vhdm);
 static bool mvhd_footer_checksum_valid(MVHDMeta* vhdm);
 static bool mvhd_sparse_checksum_valid(MVHDMeta* vhdm);
 static int mvhd_read_bat(MVHDMeta *vhdm, MVHDError* err);
 static void mvhd_calc_sparse_values(MVHDMeta* vhdm);
-static int mvhd_init_sector_bitmap(MVHDMeta* vhdm, MVHDError* err);
+static int mvhd_init_sector_bitmap(MVHDMeta* vhdm, int cache_size, MVHDError* err);
+static void mvhd_free_sector_bitmap(MVHDMeta* vhdm);
+static bool mvhd_storage_is_vhd(MVHDMeta* vhdm, int64_t* footer_offset);
+static int64_t mvhd_calc_data_end(MVHDMeta* vhdm);
+static int mvhd_init_sync(MVHDMeta* vhdm);
+static void mvhd_destroy_sync(MVHDMeta* vhdm);
+static int mvhd_iov_sectors(const MVHDIOVec* iov, int iovcnt);
+static MVHDMeta* mvhd_open_parent(const char* path, const uint8_t* uuid, int* err);
+static void mvhd_release_parent(MVHDMeta* parent);
+
+/* Parents of open differencing images, each shared by all of its children */
+static MVHDMutex mvhd_parents_lock = MVHD_MUTEX_INITIALIZER;
+static MVHDMeta* mvhd_parents = NULL;
+
+/* Serialises parent path lookups, as cwalk keeps the path style in a global */
+static MVHDMutex mvhd_path_lock = MVHD_MUTEX_INITIALIZER;
 
 /**
  * \brief Populate data stuctures with content from a VHD footer
  * 
  * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset where in the image the footer is located
  */
-static void mvhd_read_footer(MVHDMeta* vhdm) {
+static void mvhd_read_footer(MVHDMeta* vhdm, int64_t offset) {
     uint8_t buffer[MVHD_FOOTER_SIZE];
-    mvhd_fseeko64(vhdm->f, -MVHD_FOOTER_SIZE, SEEK_END);
-    fread(buffer, sizeof buffer, 1, vhdm->f);
+    mvhd_read_at(vhdm, buffer, sizeof buffer, offset);
     mvhd_buffer_to_footer(&vhdm->footer, buffer);
 }
 
@@ -54,8 +75,7 @@ static void mvhd_read_footer(MVHDMeta* vhdm) {
  */
 static void mvhd_read_sparse_header(MVHDMeta* vhdm) {
     uint8_t buffer[MVHD_SPARSE_SIZE];
-    mvhd_fseeko64(vhdm->f, vhdm->footer.data_offset, SEEK_SET);
-    fread(buffer, sizeof buffer, 1, vhdm->f);
+    mvhd_read_at(vhdm, buffer, sizeof buffer, (int64_t)vhdm->footer.data_offset);
     mvhd_buffer_to_header(&vhdm->sparse, buffer);
 }
 
@@ -86,7 +106,8 @@ static bool mvhd_sparse_checksum_valid(MVHDMeta* vhdm) {
  * 
  * The Block Allocation Table (BAT) is the structure in a sparse and differencing VHD which stores 
  * the 4-byte sector offsets for each data block. This function allocates enough memory to contain
- * the entire BAT, and then reads the contents of the BAT into the buffer.
+ * the entire BAT, and then reads the contents of the BAT into the buffer in one go, converting the 
+ * entries to host byte order afterwards.
  * 
  * \param [in] vhdm MiniVHD data structure
  * \param [out] err this is populated with MVHD_ERR_MEM if the calloc fails
@@ -100,11 +121,8 @@ static int mvhd_read_bat(MVHDMeta *vhdm, MVHDError* err) {
         *err = MVHD_ERR_MEM;
         return -1;
     }
-    mvhd_fseeko64(vhdm->f, vhdm->sparse.bat_offset, SEEK_SET);
-    for (uint32_t i = 0; i < vhdm->sparse.max_bat_ent; i++) {
-        fread(&vhdm->block_offset[i], sizeof *vhdm->block_offset, 1, vhdm->f);
-        vhdm->block_offset[i] = mvhd_from_be32(vhdm->block_offset[i]);
-    }
+    mvhd_read_at(vhdm, vhdm->block_offset, (size_t)vhdm->sparse.max_bat_ent * sizeof *vhdm->block_offset, (int64_t)vhdm->sparse.bat_offset);
+    mvhd_from_be32_array(vhdm->block_offset, vhdm->sparse.max_bat_ent);
     return 0;
 }
 
@@ -123,28 +141,152 @@ static void mvhd_calc_sparse_values(MVHDMeta* vhdm) {
 }
 
 /**
- * \brief Allocate memory for a sector bitmap.
+ * \brief Work out where the data of a sparse VHD image ends, without relying on the file size
+ * 
+ * This is where the trailing footer belongs, and is the end of the furthest of the sparse header, 
+ * the BAT, the parent locators and the allocated blocks.
+ * 
+ * \param [in] vhdm MiniVHD data structure, with the BAT loaded and sparse values calculated
+ * 
+ * \return the offset one past the last byte of data
+ */
+static int64_t mvhd_calc_data_end(MVHDMeta* vhdm) {
+    int64_t data_end = (int64_t)vhdm->footer.data_offset + MVHD_SPARSE_SIZE;
+    int64_t bat_end = (int64_t)vhdm->sparse.bat_offset + (int64_t)vhdm->sparse.max_bat_ent * sizeof *vhdm->block_offset;
+    bat_end = ((bat_end + MVHD_SECTOR_SIZE - 1) / MVHD_SECTOR_SIZE) * MVHD_SECTOR_SIZE;
+    if (bat_end > data_end) {
+        data_end = bat_end;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (vhdm->sparse.par_loc_entry[i].plat_code == 0) {
+            continue;
+        }
+        int64_t loc_end = (int64_t)vhdm->sparse.par_loc_entry[i].plat_data_offset + vhdm->sparse.par_loc_entry[i].plat_data_space;
+        if (loc_end > data_end) {
+            data_end = loc_end;
+        }
+    }
+    for (uint32_t i = 0; i < vhdm->sparse.max_bat_ent; i++) {
+        if (vhdm->block_offset[i] == MVHD_SPARSE_BLK) {
+            continue;
+        }
+        int64_t blk_end = ((int64_t)vhdm->block_offset[i] + vhdm->bitmap.sector_count + vhdm->sect_per_block) * MVHD_SECTOR_SIZE;
+        if (blk_end > data_end) {
+            data_end = blk_end;
+        }
+    }
+    return ((data_end + MVHD_SECTOR_SIZE - 1) / MVHD_SECTOR_SIZE) * MVHD_SECTOR_SIZE;
+}
+
+/**
+ * \brief Create the locks used in thread-safe mode
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \retval -1 if a lock could not be created. Any locks already created are destroyed again
+ * \retval 0 if the function call succeeds
+ */
+static int mvhd_init_sync(MVHDMeta* vhdm) {
+    int i = 0;
+    if (mvhd_rwlock_init(&vhdm->sync.lock) != 0) {
+        goto fail;
+    }
+    if (mvhd_mutex_init(&vhdm->sync.bitmap_lock) != 0) {
+        goto fail_rwlock;
+    }
+    if (mvhd_mutex_init(&vhdm->sync.alloc_lock) != 0) {
+        goto fail_bitmap_lock;
+    }
+    for (; i < MVHD_BLOCK_LOCK_STRIPES; i++) {
+        if (mvhd_mutex_init(&vhdm->sync.block_locks[i]) != 0) {
+            goto fail_block_locks;
+        }
+    }
+    return 0;
+fail_block_locks:
+    while (i-- > 0) {
+        mvhd_mutex_destroy(&vhdm->sync.block_locks[i]);
+    }
+    mvhd_mutex_destroy(&vhdm->sync.alloc_lock);
+fail_bitmap_lock:
+    mvhd_mutex_destroy(&vhdm->sync.bitmap_lock);
+fail_rwlock:
+    mvhd_rwlock_destroy(&vhdm->sync.lock);
+fail:
+    return -1;
+}
+
+/**
+ * \brief Destroy the locks used in thread-safe mode
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+static void mvhd_destroy_sync(MVHDMeta* vhdm) {
+    for (int i = 0; i < MVHD_BLOCK_LOCK_STRIPES; i++) {
+        mvhd_mutex_destroy(&vhdm->sync.block_locks[i]);
+    }
+    mvhd_mutex_destroy(&vhdm->sync.alloc_lock);
+    mvhd_mutex_destroy(&vhdm->sync.bitmap_lock);
+    mvhd_rwlock_destroy(&vhdm->sync.lock);
+}
+
+/**
+ * \brief Allocate memory for the sector bitmap cache.
  * 
  * Each data block is preceded by a sector bitmap. Each bit indicates whether the corresponding sector
  * is considered 'clean' or 'dirty' (for sparse VHD images), or whether to read from the parent or current 
  * image (for differencing images).
  * 
+ * The bitmaps of the most recently used blocks are kept in memory, so that I/O alternating between 
+ * several blocks does not need to read the bitmaps from file again.
+ * 
  * \param [in] vhdm MiniVHD data structure
+ * \param [in] cache_size the number of block bitmaps to keep in memory
  * \param [out] err this is populated with MVHD_ERR_MEM if the calloc fails
  * 
  * \retval -1 if an error occurrs. Check value of err in this case
  * \retval 0 if the function call succeeds
  */
-static int mvhd_init_sector_bitmap(MVHDMeta* vhdm, MVHDError* err) {
-    vhdm->bitmap.curr_bitmap = calloc(vhdm->bitmap.sector_count, MVHD_SECTOR_SIZE);
-    if (vhdm->bitmap.curr_bitmap == NULL) {
+static int mvhd_init_sector_bitmap(MVHDMeta* vhdm, int cache_size, MVHDError* err) {
+    vhdm->bitmap.cache = calloc(cache_size, sizeof *vhdm->bitmap.cache);
+    if (vhdm->bitmap.cache == NULL) {
         *err = MVHD_ERR_MEM;
         return -1;
     }
+    vhdm->bitmap.cache_data = calloc((size_t)cache_size * vhdm->bitmap.sector_count, MVHD_SECTOR_SIZE);
+    if (vhdm->bitmap.cache_data == NULL) {
+        free(vhdm->bitmap.cache);
+        vhdm->bitmap.cache = NULL;
+        *err = MVHD_ERR_MEM;
+        return -1;
+    }
+    for (int i = 0; i < cache_size; i++) {
+        vhdm->bitmap.cache[i].bitmap = vhdm->bitmap.cache_data + ((size_t)i * vhdm->bitmap.sector_count * MVHD_SECTOR_SIZE);
+        vhdm->bitmap.cache[i].block = -1;
+        vhdm->bitmap.cache[i].last_used = 0;
+    }
+    vhdm->bitmap.cache_size = cache_size;
+    vhdm->bitmap.use_count = 0;
+    vhdm->bitmap.curr_bitmap = vhdm->bitmap.cache[0].bitmap;
     vhdm->bitmap.curr_block = -1;
     return 0;
 }
 
+/**
+ * \brief Free the sector bitmap cache
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+static void mvhd_free_sector_bitmap(MVHDMeta* vhdm) {
+    free(vhdm->bitmap.cache_data);
+    vhdm->bitmap.cache_data = NULL;
+    free(vhdm->bitmap.cache);
+    vhdm->bitmap.cache = NULL;
+    vhdm->bitmap.curr_bitmap = NULL;
+    vhdm->bitmap.curr_block = -1;
+    vhdm->bitmap.cache_size = 0;
+}
+
 /**
  * \brief Check if the path for a given platform code exists
  * 
@@ -182,7 +324,6 @@ static bool mvhd_parent_path_exists(struct MVHDPaths* paths, uint32_t plat_code)
     f = mvhd_fopen((const char*)paths->joined_path, "rb", &ferr);
     if (f != NULL) {
         /* We found a file at the requested path! */
-        strncpy_s(tmp_open_path, sizeof tmp_open_path, paths->joined_path, sizeof tmp_open_path);
         fclose(f);
         return true;
     } else {
@@ -200,12 +341,12 @@ static bool mvhd_parent_path_exists(struct MVHDPaths* paths, uint32_t plat_code)
  * This function does not verify if the path returned is a valid parent image.
  * 
  * \param [in] vhdm current MiniVHD data structure
+ * \param [out] par_path buffer of MVHD_MAX_PATH_BYTES bytes to store the path in
  * \param [out] err any errors that may occurr. Check this if NULL is returned
  * 
- * \return a pointer to the global string `tmp_open_path`, or NULL if a path could 
- * not be found, or some error occurred
+ * \return par_path, or NULL if a path could not be found, or some error occurred
  */
-static char* mvhd_get_diff_parent_path(MVHDMeta* vhdm, int* err) {
+static char* mvhd_get_diff_parent_path(MVHDMeta* vhdm, char* par_path, int* err) {
     int utf_outlen, utf_inlen, utf_ret;
     char* par_fp = NULL;
     /* We can't resolve relative paths if we don't have an absolute 
@@ -250,8 +391,7 @@ static char* mvhd_get_diff_parent_path(MVHDMeta* vhdm, int* err) {
             *err = MVHD_ERR_PATH_LEN;
             goto paths_cleanup;
         }
-        mvhd_fseeko64(vhdm->f, vhdm->sparse.par_loc_entry[i].plat_data_offset, SEEK_SET);
-        fread(paths->tmp_src_path, sizeof (uint8_t), utf_inlen, vhdm->f);
+        mvhd_read_at(vhdm, paths->tmp_src_path, utf_inlen, (int64_t)vhdm->sparse.par_loc_entry[i].plat_data_offset);
         /* Note, the W2*u parent locators are UTF-16LE, unlike the filename field previously obtained, 
            which is UTF-16BE */
         utf_ret = UTF16LEToUTF8(loc_path, &utf_outlen, (const unsigned char*)paths->tmp_src_path, &utf_inlen);
@@ -263,23 +403,23 @@ static char* mvhd_get_diff_parent_path(MVHDMeta* vhdm, int* err) {
     /* We have paths in UTF-8. We should have enough info to try and find the parent VHD */
     /* Does the relative path exist? */
     if (mvhd_parent_path_exists(paths, MVHD_DIF_LOC_W2RU)) {
-        par_fp = tmp_open_path;
-        goto paths_cleanup;
+        goto path_found;
     }
     /* What about trying the child directory? */
     if (mvhd_parent_path_exists(paths, 0)) {
-        par_fp = tmp_open_path;
-        goto paths_cleanup;
+        goto path_found;
     }
     /* Well, all else fails, try the stored absolute path, if it exists */
     if (mvhd_parent_path_exists(paths, MVHD_DIF_LOC_W2KU)) {
-        par_fp = tmp_open_path;
-        goto paths_cleanup;
+        goto path_found;
     }
     /* If we reach this point, we could not find a path with a valid file */
     par_fp = NULL;
     *err = MVHD_ERR_PAR_NOT_FOUND;
-    
+    goto paths_cleanup;
+path_found:
+    strcpy_s(par_path, MVHD_MAX_PATH_BYTES, paths->joined_path);
+    par_fp = par_path;
 paths_cleanup:
     free(paths);
     paths = NULL;
@@ -300,18 +440,107 @@ static void mvhd_assign_io_funcs(MVHDMeta* vhdm) {
     case MVHD_TYPE_FIXED:
         vhdm->read_sectors = mvhd_fixed_read;
         vhdm->write_sectors = mvhd_fixed_write;
+        vhdm->discard_sectors = mvhd_fixed_discard;
         break;
     case MVHD_TYPE_DYNAMIC:
         vhdm->read_sectors = mvhd_sparse_read;
         vhdm->write_sectors = mvhd_sparse_diff_write;
+        vhdm->discard_sectors = mvhd_sparse_discard;
         break;
     case MVHD_TYPE_DIFF:
         vhdm->read_sectors = mvhd_diff_read;
         vhdm->write_sectors = mvhd_sparse_diff_write;
+        vhdm->discard_sectors = mvhd_diff_discard;
         break;
     }
     if (vhdm->readonly) {
         vhdm->write_sectors = mvhd_noop_write;
+        vhdm->discard_sectors = mvhd_noop_discard;
+    }
+}
+
+/**
+ * \brief Get a handle for the parent of a differencing image
+ * 
+ * Parents are shared by all open differencing images which refer to the same file and 
+ * UUID, so that each parent is only held in memory once. The parent is opened read-only 
+ * and in thread-safe mode the first time it is needed, as its children may be used from 
+ * different threads.
+ * 
+ * \param [in] path the absolute path of the parent
+ * \param [in] uuid the UUID the parent must have
+ * \param [out] err MVHD_ERR_INVALID_PAR_UUID if the file at path has another UUID, or 
+ * the reason the parent could not be opened
+ * 
+ * \return the parent, to be given back with mvhd_release_parent(), or NULL on error
+ */
+static MVHDMeta* mvhd_open_parent(const char* path, const uint8_t* uuid, int* err) {
+    MVHDMeta* parent;
+    mvhd_mutex_lock(&mvhd_parents_lock);
+    for (parent = mvhd_parents; parent != NULL; parent = parent->shared.next) {
+        if (strcmp(parent->filename, path) == 0 && memcmp(parent->footer.uuid, uuid, sizeof parent->footer.uuid) == 0) {
+            parent->shared.refs++;
+            mvhd_mutex_unlock(&mvhd_parents_lock);
+            return parent;
+        }
+    }
+    mvhd_mutex_unlock(&mvhd_parents_lock);
+    /* Opening the parent may open and register its own parent, so this is done unlocked */
+    MVHDMeta* opened = mvhd_open(path, true, err);
+    if (opened == NULL) {
+        return NULL;
+    }
+    if (memcmp(opened->footer.uuid, uuid, sizeof opened->footer.uuid) != 0) {
+        *err = MVHD_ERR_INVALID_PAR_UUID;
+        mvhd_close(opened);
+        return NULL;
+    }
+    if (mvhd_set_thread_safe(opened, true) != 0) {
+        *err = MVHD_ERR_MEM;
+        mvhd_close(opened);
+        return NULL;
+    }
+    mvhd_mutex_lock(&mvhd_parents_lock);
+    for (parent = mvhd_parents; parent != NULL; parent = parent->shared.next) {
+        if (strcmp(parent->filename, path) == 0 && memcmp(parent->footer.uuid, uuid, sizeof parent->footer.uuid) == 0) {
+            break;
+        }
+    }
+    if (parent == NULL) {
+        parent = opened;
+        opened = NULL;
+        parent->shared.next = mvhd_parents;
+        mvhd_parents = parent;
+    }
+    parent->shared.refs++;
+    mvhd_mutex_unlock(&mvhd_parents_lock);
+    if (opened != NULL) {
+        /* Another thread opened the same parent in the meantime */
+        mvhd_close(opened);
+    }
+    return parent;
+}
+
+/**
+ * \brief Give back a parent handle obtained with mvhd_open_parent()
+ * 
+ * The parent is closed once none of its children use it any more.
+ * 
+ * \param [in] parent the parent handle
+ */
+static void mvhd_release_parent(MVHDMeta* parent) {
+    mvhd_mutex_lock(&mvhd_parents_lock);
+    bool last = --parent->shared.refs == 0;
+    if (last) {
+        MVHDMeta** link = &mvhd_parents;
+        while (*link != parent) {
+            link = &(*link)->shared.next;
+        }
+        *link = parent->shared.next;
+    }
+    mvhd_mutex_unlock(&mvhd_parents_lock);
+    if (last) {
+        mvhd_close(parent);
     }
 }
 
@@ -320,12 +549,45 @@ bool mvhd_file_is_vhd(FILE* f) {
         uint8_t con_str[8];
         mvhd_fseeko64(f, -MVHD_FOOTER_SIZE, SEEK_END);
         fread(con_str, sizeof con_str, 1, f);
+        if (mvhd_is_conectix_str(con_str)) {
+            return true;
+        }
+        /* A sparse image left open and dirty still has the footer copy at the start */
+        mvhd_fseeko64(f, 0, SEEK_SET);
+        fread(con_str, sizeof con_str, 1, f);
         return mvhd_is_conectix_str(con_str);
     } else {
         return false;
     }
 }
 
+/**
+ * \brief A simple test to see if an image's storage holds a VHD
+ * 
+ * The footer is normally at the end of the image. If it is missing there, the image may 
+ * have been left open and dirty, with blocks allocated but the trailing footer not yet 
+ * rewritten. Sparse images keep a copy of the footer at the start, which is used instead.
+ * 
+ * \param [in] vhdm MiniVHD data structure, with its storage backend set
+ * \param [out] footer_offset where the footer was found
+ */
+static bool mvhd_storage_is_vhd(MVHDMeta* vhdm, int64_t* footer_offset) {
+    uint8_t con_str[8];
+    int64_t size = mvhd_storage_size(vhdm);
+    if (size < MVHD_FOOTER_SIZE) {
+        return false;
+    }
+    if (mvhd_read_at(vhdm, con_str, sizeof con_str, size - MVHD_FOOTER_SIZE) == sizeof con_str && mvhd_is_conectix_str(con_str)) {
+        *footer_offset = size - MVHD_FOOTER_SIZE;
+        return true;
+    }
+    if (mvhd_read_at(vhdm, con_str, sizeof con_str, 0) == sizeof con_str && mvhd_is_conectix_str(con_str)) {
+        *footer_offset = 0;
+        return true;
+    }
+    return false;
+}
+
 MVHDGeom mvhd_calculate_geometry(uint64_t size) {
     MVHDGeom chs;
     uint32_t ts = (uint32_t)(size / MVHD_SECTOR_SIZE);
@@ -363,28 +625,62 @@ MVHDGeom mvhd_calculate_geometry(uint64_t size) {
 }
 
 MVHDMeta* mvhd_open(const char* path, bool readonly, int* err) {
+    FILE* f = readonly ? mvhd_fopen(path, "rb", err) : mvhd_fopen(path, "rb+", err);
+    if (f == NULL) {
+        /* note, mvhd_fopen sets err for us */
+        return NULL;
+    }
+    MVHDMeta* vhdm = mvhd_open_storage(path, &mvhd_file_storage_ops, f, readonly, err);
+    if (vhdm == NULL) {
+        fclose(f);
+    }
+    return vhdm;
+}
+
+MVHDMeta* mvhd_open_mapped(const char* path, bool readonly, int* err) {
+    MVHDMeta* vhdm = mvhd_open(path, readonly, err);
+    if (vhdm == NULL || vhdm->footer.disk_type != MVHD_TYPE_FIXED) {
+        return vhdm;
+    }
+    size_t len = (size_t)vhdm->footer.curr_sz;
+    if ((uint64_t)len != vhdm->footer.curr_sz || len == 0) {
+        /* Too large to map on this host */
+        return vhdm;
+    }
+    vhdm->mapping.data = mvhd_map_file((FILE*)vhdm->storage_ctx, len, readonly, &vhdm->mapping.handle);
+    if (vhdm->mapping.data != NULL) {
+        vhdm->mapping.len = len;
+        vhdm->read_sectors = mvhd_mapped_read;
+        if (!readonly) {
+            vhdm->write_sectors = mvhd_mapped_write;
+        }
+    }
+    return vhdm;
+}
+
+MVHDMeta* mvhd_open_storage(const char* path, const MVHDStorageOps* ops, void* ctx, bool readonly, int* err) {
     MVHDError open_err;
+    int64_t footer_offset;
     MVHDMeta *vhdm = calloc(sizeof *vhdm, 1);
     if (vhdm == NULL) {
         *err = MVHD_ERR_MEM;
         goto end;
     }
-    if (strlen(path) >= sizeof vhdm->filename) {
-        *err = MVHD_ERR_PATH_LEN;
-        goto cleanup_vhdm;
-    }
-    strcpy_s(vhdm->filename, sizeof vhdm->filename, path);
-    vhdm->f = readonly ? mvhd_fopen((const char*)vhdm->filename, "rb", err) : mvhd_fopen((const char*)vhdm->filename, "rb+", err);
-    if (vhdm->f == NULL) {
-        /* note, mvhd_fopen sets err for us */
-        goto cleanup_vhdm;
+    if (path != NULL) {
+        if (strlen(path) >= sizeof vhdm->filename) {
+            *err = MVHD_ERR_PATH_LEN;
+            goto cleanup_vhdm;
+        }
+        strcpy_s(vhdm->filename, sizeof vhdm->filename, path);
     }
+    vhdm->storage = ops;
+    vhdm->storage_ctx = ctx;
     vhdm->readonly = readonly;
-    if (!mvhd_file_is_vhd(vhdm->f)) {
+    if (!mvhd_storage_is_vhd(vhdm, &footer_offset)) {
         *err = MVHD_ERR_NOT_VHD;
         goto cleanup_file;
     }
-    mvhd_read_footer(vhdm);
+    mvhd_read_footer(vhdm, footer_offset);
     if (!mvhd_footer_checksum_valid(vhdm)) {
         *err = MVHD_ERR_FOOTER_CHECKSUM;
         goto cleanup_file;
@@ -400,14 +696,35 @@ MVHDMeta* mvhd_open(const char* path, bool readonly, int* err) {
             goto cleanup_file;
         }
         mvhd_calc_sparse_values(vhdm);
-        if (mvhd_init_sector_bitmap(vhdm, &open_err) == -1) {
+        if (mvhd_init_sector_bitmap(vhdm, MVHD_BITMAP_CACHE_DEFAULT, &open_err) == -1) {
             *err = open_err;
             goto cleanup_bat;
         }
+        if (footer_offset == 0) {
+            /* No trailing footer. Put it back after the data, if we are allowed to. Anything 
+             * past the blocks in the BAT is kept, as it may be blocks whose BAT entries were 
+             * never written, so the footer goes after the end of the file if that is further */
+            int64_t file_end = ((mvhd_storage_size(vhdm) + MVHD_SECTOR_SIZE - 1) / MVHD_SECTOR_SIZE) * MVHD_SECTOR_SIZE;
+            vhdm->data_end = mvhd_calc_data_end(vhdm);
+            if (file_end > vhdm->data_end) {
+                vhdm->data_end = file_end;
+            }
+            if (!vhdm->readonly) {
+                mvhd_write_footer(vhdm);
+            }
+        } else {
+            vhdm->data_end = footer_offset;
+        }
 
     } else if (vhdm->footer.disk_type != MVHD_TYPE_FIXED) {
         *err = MVHD_ERR_TYPE;
         goto cleanup_bitmap;
+    } else if (footer_offset == 0) {
+        /* Fixed images have no footer copy at the start. This is raw data that happens to look like one */
+        *err = MVHD_ERR_NOT_VHD;
+        goto cleanup_file;
+    } else {
+        vhdm->data_end = footer_offset;
     }
     mvhd_assign_io_funcs(vhdm);
     vhdm->format_buffer.zero_data = calloc(64, MVHD_SECTOR_SIZE);
@@ -417,33 +734,45 @@ MVHDMeta* mvhd_open(const char* path, bool readonly, int* err) {
     }
     vhdm->format_buffer.sector_count = 64;
     if (vhdm->footer.disk_type == MVHD_TYPE_DIFF) {
-        char* par_path = mvhd_get_diff_parent_path(vhdm, err);
-        if (par_path == NULL) {
+        /* Each open resolves its parent into its own buffer, as opening the parent 
+         * resolves the grandparent in turn, possibly on several threads at once */
+        char par_path[MVHD_MAX_PATH_BYTES];
+        mvhd_mutex_lock(&mvhd_path_lock);
+        char* found = mvhd_get_diff_parent_path(vhdm, par_path, err);
+        mvhd_mutex_unlock(&mvhd_path_lock);
+        if (found == NULL) {
             goto cleanup_format_buff;
         }
-        vhdm->parent = mvhd_open(par_path, true, err);
+        vhdm->parent = mvhd_open_parent(par_path, vhdm->sparse.par_uuid, err);
         if (vhdm->parent == NULL) {
             goto cleanup_format_buff;
         }
-        if (memcmp(vhdm->sparse.par_uuid, vhdm->parent->footer.uuid, sizeof vhdm->sparse.par_uuid) != 0) {
-            *err = MVHD_ERR_INVALID_PAR_UUID;
-            goto cleanup_format_buff;
+    }
+    if (vhdm->footer.disk_type != MVHD_TYPE_FIXED) {
+        if (mvhd_build_block_owner(vhdm) == -1) {
+            *err = MVHD_ERR_MEM;
+            goto cleanup_parent;
         }
     }
     /* If we've reached this point, we are good to go, so skip the cleanup steps */
     goto end;
+cleanup_parent:
+    if (vhdm->parent != NULL) {
+        mvhd_release_parent(vhdm->parent);
+        vhdm->parent = NULL;
+    }
 cleanup_format_buff:
     free(vhdm->format_buffer.zero_data);
     vhdm->format_buffer.zero_data = NULL;
 cleanup_bitmap:
-    free(vhdm->bitmap.curr_bitmap);
-    vhdm->bitmap.curr_bitmap = NULL;
+    mvhd_free_sector_bitmap(vhdm);
 cleanup_bat:
     free(vhdm->block_offset);
     vhdm->block_offset = NULL;
 cleanup_file:
-    fclose(vhdm->f);
-    vhdm->f = NULL;
+    /* The storage belongs to the caller until the open succeeds */
+    vhdm->storage = NULL;
+    vhdm->storage_ctx = NULL;
 cleanup_vhdm:
     free(vhdm);
     vhdm = NULL;
@@ -453,42 +782,301 @@ end:
 
 void mvhd_close(MVHDMeta* vhdm) {
     if (vhdm != NULL) {
+        mvhd_readahead_stop(vhdm);
+        mvhd_cache_free(vhdm);
         if (vhdm->parent != NULL) {
-            mvhd_close(vhdm->parent);
+            mvhd_release_parent(vhdm->parent);
+        }
+        mvhd_write_back_metadata(vhdm);
+        if (vhdm->footer_dirty) {
+            mvhd_write_footer(vhdm);
+        }
+        if (vhdm->footer.disk_type != MVHD_TYPE_FIXED && !vhdm->readonly && 
+            mvhd_storage_size(vhdm) > vhdm->data_end + MVHD_FOOTER_SIZE) {
+            /* Give back any space reserved for blocks that were never allocated */
+            vhdm->storage->set_size(vhdm->storage_ctx, vhdm->data_end + MVHD_FOOTER_SIZE);
+        }
+        if (vhdm->mapping.data != NULL) {
+            if (!vhdm->readonly) {
+                mvhd_sync_mapping(vhdm->mapping.data, vhdm->mapping.len);
+            }
+            mvhd_unmap_file(vhdm->mapping.data, vhdm->mapping.len, vhdm->mapping.handle);
+            vhdm->mapping.data = NULL;
+        }
+        if (vhdm->storage->close != NULL) {
+            vhdm->storage->close(vhdm->storage_ctx);
         }
-        fclose(vhdm->f);
         if (vhdm->block_offset != NULL) {
             free(vhdm->block_offset);
             vhdm->block_offset = NULL;
         }
-        if (vhdm->bitmap.curr_bitmap != NULL) {
-            free(vhdm->bitmap.curr_bitmap);
-            vhdm->bitmap.curr_bitmap = NULL;
+        free(vhdm->block_owner);
+        vhdm->block_owner = NULL;
+        mvhd_free_sector_bitmap(vhdm);
+        if (vhdm->write_back.bat_dirty != NULL) {
+            free(vhdm->write_back.bat_dirty);
+            vhdm->write_back.bat_dirty = NULL;
         }
         if (vhdm->format_buffer.zero_data != NULL) {
             free(vhdm->format_buffer.zero_data);
             vhdm->format_buffer.zero_data = NULL;
         }
+        if (vhdm->sync.enabled) {
+            mvhd_destroy_sync(vhdm);
+        }
         free(vhdm);
         vhdm = NULL;
     }
 }
 
+/**
+ * \brief Count the sectors held by a scatter/gather list
+ * 
+ * \param [in] iov the buffers
+ * \param [in] iovcnt the number of elements in iov
+ * 
+ * \return the number of sectors, or MVHD_ERR_INVALID_PARAMS if the total length is not a 
+ * whole number of sectors, or too large
+ */
+static int mvhd_iov_sectors(const MVHDIOVec* iov, int iovcnt) {
+    if (iovcnt < 0 || (iov == NULL && iovcnt > 0)) {
+        return MVHD_ERR_INVALID_PARAMS;
+    }
+    uint64_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].len;
+        if (len > MVHD_MAX_SIZE_IN_BYTES) {
+            return MVHD_ERR_INVALID_PARAMS;
+        }
+    }
+    if (len % MVHD_SECTOR_SIZE != 0) {
+        return MVHD_ERR_INVALID_PARAMS;
+    }
+    return (int)(len / MVHD_SECTOR_SIZE);
+}
+
 int mvhd_read_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* out_buff) {
-    return vhdm->read_sectors(vhdm, offset, num_sectors, out_buff);
+    MVHDIOVec iov = { out_buff, num_sectors > 0 ? (size_t)num_sectors * MVHD_SECTOR_SIZE : 0 };
+    MVHDIOCursor cur = { &iov, 1, 0, 0 };
+    if (vhdm->data_cache != NULL) {
+        return mvhd_cache_read(vhdm, offset, num_sectors, &cur);
+    }
+    if (vhdm->readahead != NULL) {
+        return mvhd_readahead_read(vhdm, offset, num_sectors, &cur);
+    }
+    mvhd_lock_shared(vhdm);
+    int truncated = vhdm->read_sectors(vhdm, offset, num_sectors, &cur);
+    mvhd_unlock_shared(vhdm);
+    return truncated;
 }
 
 int mvhd_write_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, void* in_buff) {
-    return vhdm->write_sectors(vhdm, offset, num_sectors, in_buff);
+    MVHDIOVec iov = { in_buff, num_sectors > 0 ? (size_t)num_sectors * MVHD_SECTOR_SIZE : 0 };
+    MVHDIOCursor cur = { &iov, 1, 0, 0 };
+    MVHDIOCursor written = cur;
+    /* Metadata changes made by writes are protected by the block, allocator and bitmap locks */
+    mvhd_lock_shared(vhdm);
+    int truncated = vhdm->write_sectors(vhdm, offset, num_sectors, &cur);
+    mvhd_unlock_shared(vhdm);
+    mvhd_readahead_invalidate(vhdm, offset, num_sectors);
+    mvhd_cache_update(vhdm, offset, num_sectors, &written);
+    return truncated;
+}
+
+int mvhd_readv(MVHDMeta* vhdm, uint32_t offset, const MVHDIOVec* iov, int iovcnt) {
+    int num_sectors = mvhd_iov_sectors(iov, iovcnt);
+    if (num_sectors < 0) {
+        return num_sectors;
+    }
+    MVHDIOCursor cur = { iov, iovcnt, 0, 0 };
+    if (vhdm->data_cache != NULL) {
+        return mvhd_cache_read(vhdm, offset, num_sectors, &cur);
+    }
+    if (vhdm->readahead != NULL) {
+        return mvhd_readahead_read(vhdm, offset, num_sectors, &cur);
+    }
+    mvhd_lock_shared(vhdm);
+    int truncated = vhdm->read_sectors(vhdm, offset, num_sectors, &cur);
+    mvhd_unlock_shared(vhdm);
+    return truncated;
+}
+
+int mvhd_writev(MVHDMeta* vhdm, uint32_t offset, const MVHDIOVec* iov, int iovcnt) {
+    int num_sectors = mvhd_iov_sectors(iov, iovcnt);
+    if (num_sectors < 0) {
+        return num_sectors;
+    }
+    MVHDIOCursor cur = { iov, iovcnt, 0, 0 };
+    MVHDIOCursor written = cur;
+    mvhd_lock_shared(vhdm);
+    int truncated = vhdm->write_sectors(vhdm, offset, num_sectors, &cur);
+    mvhd_unlock_shared(vhdm);
+    mvhd_readahead_invalidate(vhdm, offset, num_sectors);
+    mvhd_cache_update(vhdm, offset, num_sectors, &written);
+    return truncated;
+}
+
+int mvhd_discard_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors) {
+    mvhd_lock_shared(vhdm);
+    int truncated = vhdm->discard_sectors(vhdm, offset, num_sectors);
+    mvhd_unlock_shared(vhdm);
+    mvhd_readahead_invalidate(vhdm, offset, num_sectors);
+    mvhd_cache_invalidate(vhdm, offset, num_sectors);
+    return truncated;
 }
 
 int mvhd_format_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors) {
     int num_full = num_sectors / vhdm->format_buffer.sector_count;
     int remain = num_sectors % vhdm->format_buffer.sector_count;
     for (int i = 0; i < num_full; i++) {
-        vhdm->write_sectors(vhdm, offset, vhdm->format_buffer.sector_count, vhdm->format_buffer.zero_data);
+        mvhd_write_sectors(vhdm, offset, vhdm->format_buffer.sector_count, vhdm->format_buffer.zero_data);
         offset += vhdm->format_buffer.sector_count;
     }
-    vhdm->write_sectors(vhdm, offset, remain, vhdm->format_buffer.zero_data);
+    mvhd_write_sectors(vhdm, offset, remain, vhdm->format_buffer.zero_data);
+    return 0;
+}
+
+int mvhd_set_bitmap_cache_size(MVHDMeta* vhdm, int num_blocks) {
+    MVHDError cache_err;
+    if (num_blocks < 1 || num_blocks > MVHD_BITMAP_CACHE_MAX) {
+        return MVHD_ERR_INVALID_PARAMS;
+    }
+    for (MVHDMeta* curr_vhdm = vhdm; curr_vhdm != NULL; curr_vhdm = curr_vhdm->parent) {
+        if (curr_vhdm->footer.disk_type == MVHD_TYPE_FIXED) {
+            continue;
+        }
+        /* Write back any dirty bitmaps, so the old cache can simply be dropped 
+           once the new one has been allocated */
+        int flush_err = mvhd_write_back_metadata(curr_vhdm);
+        if (flush_err != 0) {
+            return flush_err;
+        }
+        /* A shared parent may be in use by other images at the same time */
+        bool shared = curr_vhdm->shared.refs > 0;
+        if (shared) {
+            mvhd_mutex_lock(&curr_vhdm->sync.bitmap_lock);
+        }
+        MVHDSectorBitmap old_bitmap = curr_vhdm->bitmap;
+        int init_rv = mvhd_init_sector_bitmap(curr_vhdm, num_blocks, &cache_err);
+        if (init_rv == -1) {
+            curr_vhdm->bitmap = old_bitmap;
+        }
+        if (shared) {
+            mvhd_mutex_unlock(&curr_vhdm->sync.bitmap_lock);
+        }
+        if (init_rv == -1) {
+            return cache_err;
+        }
+        free(old_bitmap.cache_data);
+        free(old_bitmap.cache);
+    }
     return 0;
+}
+
+void mvhd_get_bitmap_cache_stats(MVHDMeta* vhdm, uint64_t* hits, uint64_t* misses) {
+    if (vhdm->sync.enabled) {
+        mvhd_mutex_lock(&vhdm->sync.bitmap_lock);
+    }
+    *hits = vhdm->bitmap.hits;
+    *misses = vhdm->bitmap.misses;
+    if (vhdm->sync.enabled) {
+        mvhd_mutex_unlock(&vhdm->sync.bitmap_lock);
+    }
+}
+
+int mvhd_set_write_back(MVHDMeta* vhdm, bool enable, size_t dirty_threshold) {
+    if (vhdm->footer.disk_type == MVHD_TYPE_FIXED || vhdm->readonly) {
+        /* There is no metadata to defer */
+        return 0;
+    }
+    if (!enable) {
+        int flush_err = mvhd_write_back_metadata(vhdm);
+        if (flush_err != 0) {
+            return flush_err;
+        }
+        vhdm->write_back.enabled = false;
+        return 0;
+    }
+    if (vhdm->write_back.bat_dirty == NULL) {
+        uint32_t num_bat_sect = (vhdm->sparse.max_bat_ent + MVHD_BAT_ENT_PER_SECT - 1) / MVHD_BAT_ENT_PER_SECT;
+        vhdm->write_back.bat_dirty = calloc(num_bat_sect, sizeof *vhdm->write_back.bat_dirty);
+        if (vhdm->write_back.bat_dirty == NULL) {
+            return MVHD_ERR_MEM;
+        }
+    }
+    vhdm->write_back.threshold = dirty_threshold > 0 ? dirty_threshold : MVHD_WRITE_BACK_DEFAULT_THRESHOLD;
+    vhdm->write_back.enabled = true;
+    return 0;
+}
+
+int mvhd_set_block_reservation(MVHDMeta* vhdm, int num_blocks) {
+    if (num_blocks < 0) {
+        return MVHD_ERR_INVALID_PARAMS;
+    }
+    if (vhdm->footer.disk_type == MVHD_TYPE_FIXED || vhdm->readonly) {
+        /* Fixed images never grow */
+        return 0;
+    }
+    vhdm->reserve_blocks = num_blocks;
+    return 0;
+}
+
+int mvhd_set_zero_write_elision(MVHDMeta* vhdm, bool enable) {
+    if (vhdm->footer.disk_type == MVHD_TYPE_FIXED || vhdm->readonly) {
+        return 0;
+    }
+    vhdm->elide_zero_writes = enable;
+    return 0;
+}
+
+int mvhd_set_thread_safe(MVHDMeta* vhdm, bool enable) {
+    /* Shared parents always stay in thread-safe mode */
+    for (MVHDMeta* curr_vhdm = vhdm; curr_vhdm != NULL && curr_vhdm->shared.refs == 0; curr_vhdm = curr_vhdm->parent) {
+        if (curr_vhdm->sync.enabled == enable) {
+            continue;
+        }
+        if (enable) {
+            if (mvhd_init_sync(curr_vhdm) == -1) {
+                return MVHD_ERR_MEM;
+            }
+        } else {
+            mvhd_readahead_stop(curr_vhdm);
+            mvhd_destroy_sync(curr_vhdm);
+        }
+        curr_vhdm->sync.enabled = enable;
+    }
+    return 0;
+}
+
+int mvhd_flush(MVHDMeta* vhdm) {
+    mvhd_lock_excl(vhdm);
+    int rv = mvhd_write_back_metadata(vhdm);
+    if (vhdm->footer_dirty && mvhd_write_footer(vhdm) != 0) {
+        mvhd_errno = errno;
+        rv = MVHD_ERR_FILE;
+    }
+    if (vhdm->mapping.data != NULL && !vhdm->readonly && mvhd_sync_mapping(vhdm->mapping.data, vhdm->mapping.len) != 0) {
+        mvhd_errno = errno;
+        rv = MVHD_ERR_FILE;
+    }
+    if (vhdm->storage->flush != NULL && vhdm->storage->flush(vhdm->storage_ctx) != 0) {
+        mvhd_errno = errno;
+        rv = MVHD_ERR_FILE;
+    }
+    mvhd_unlock_excl(vhdm);
+    return rv;
+}
+
+const void* mvhd_map_sectors(MVHDMeta* vhdm, uint32_t offset, int num_sectors, size_t* len) {
+    uint32_t total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    *len = 0;
+    if (vhdm->mapping.data == NULL || offset >= total_sectors || num_sectors <= 0) {
+        return NULL;
+    }
+    uint32_t avail = total_sectors - offset;
+    if ((uint32_t)num_sectors < avail) {
+        avail = (uint32_t)num_sectors;
+    }
+    *len = (size_t)avail * MVHD_SECTOR_SIZE;
+    return vhdm->mapping.data + (size_t)offset * MVHD_SECTOR_SIZE;
 }
\ No newline at end of file
@@ -0,0 +1,465 @@
+/**
+ * \file
+ * \brief Readahead for sequential reads
+ *
+ * Reads are matched against a few recently seen streams. A read which starts where a
+ * stream's previous read ended continues that stream, and data past it is queued for
+ * prefetching by a background thread. The distance kept ahead of a stream starts at one
+ * chunk, and doubles with every further sequential read, up to the size of the buffer.
+ *
+ * Prefetched data is held in a fixed number of chunks, each covering an aligned run of
+ * sectors. A chunk is prefetched with the image's normal read function, so differencing
+ * images are read through the whole chain, and the sector bitmaps of the blocks involved
+ * end up in the bitmap cache. A chunk is freed again once a read has used its last
+ * sector, or when sectors it holds are written to.
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* for pthread_rwlock_t */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "minivhd_internal.h"
+#include "minivhd_io.h"
+#include "minivhd_readahead.h"
+#include "minivhd_util.h"
+#include "minivhd.h"
+
+/* Sectors per prefetched chunk */
+#define MVHD_READAHEAD_CHUNK 128
+
+/* Buffer size used when readahead is enabled by mvhd_advise() */
+#define MVHD_READAHEAD_DEFAULT 4096
+
+/* Largest buffer mvhd_set_readahead() accepts */
+#define MVHD_READAHEAD_MAX 131072
+
+/* Number of sequential streams tracked per image */
+#define MVHD_READAHEAD_STREAMS 4
+
+typedef enum MVHDChunkState {
+    MVHD_CHUNK_EMPTY,
+    MVHD_CHUNK_QUEUED,
+    MVHD_CHUNK_READING,
+    MVHD_CHUNK_READY
+} MVHDChunkState;
+
+typedef struct MVHDReadaheadChunk {
+    uint32_t offset; /* A multiple of MVHD_READAHEAD_CHUNK */
+    int num_sectors;
+    MVHDChunkState state;
+    bool stale; /* Written to while being read, so dropped once the read completes */
+    uint64_t last_used;
+    uint8_t* data;
+} MVHDReadaheadChunk;
+
+typedef struct MVHDReadaheadStream {
+    bool active;
+    uint32_t next; /* The sector following the stream's last read */
+    uint32_t ahead; /* Chunks have been queued up to here */
+    int window; /* Sectors to keep queued past next, 0 until the stream is known to be sequential */
+    uint64_t last_used;
+} MVHDReadaheadStream;
+
+struct MVHDReadahead {
+    MVHDMeta* vhdm;
+    uint32_t total_sectors;
+    int max_window;
+    MVHDReadaheadChunk* chunks;
+    int num_chunks;
+    uint8_t* chunk_data;
+    MVHDReadaheadStream streams[MVHD_READAHEAD_STREAMS];
+    uint64_t use_count;
+    struct {
+        MVHDAdvice advice; /* MVHD_ADVICE_SEQUENTIAL, MVHD_ADVICE_RANDOM or MVHD_ADVICE_NORMAL */
+        uint32_t start;
+        uint32_t end;
+    } hint;
+    bool stopping;
+    MVHDMutex lock;
+    MVHDCond work_cond; /* Signalled when a chunk is queued, or when stopping */
+    MVHDCond done_cond; /* Signalled when a chunk has been read */
+    MVHDThread thread;
+};
+
+static int mvhd_readahead_start(MVHDMeta* vhdm, int max_sectors);
+static MVHDReadaheadChunk* mvhd_ra_find(MVHDReadahead* ra, uint32_t sector);
+static MVHDReadaheadChunk* mvhd_ra_victim(MVHDReadahead* ra, uint32_t keep_start, uint32_t keep_end);
+static uint32_t mvhd_ra_queue(MVHDReadahead* ra, uint32_t start, uint32_t end);
+static uint32_t mvhd_ra_copy(MVHDReadahead* ra, uint32_t offset, uint32_t end, MVHDIOCursor* out);
+static void mvhd_ra_track(MVHDReadahead* ra, uint32_t offset, uint32_t end);
+static void mvhd_ra_worker(void* arg);
+
+/**
+ * \brief Find the chunk holding, or about to hold, a sector. Must be called with ra->lock held
+ *
+ * \return the chunk, or NULL if the sector is not in the buffer
+ */
+static MVHDReadaheadChunk* mvhd_ra_find(MVHDReadahead* ra, uint32_t sector) {
+    uint32_t chunk_offset = sector - sector % MVHD_READAHEAD_CHUNK;
+    for (int i = 0; i < ra->num_chunks; i++) {
+        if (ra->chunks[i].state != MVHD_CHUNK_EMPTY && ra->chunks[i].offset == chunk_offset) {
+            return &ra->chunks[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief Pick a chunk to prefetch into. Must be called with ra->lock held
+ *
+ * Empty chunks are used first, then the least recently used chunk holding data. Chunks
+ * being read, waiting to be read, or covering the range being queued are left alone.
+ *
+ * \param [in] ra the readahead state
+ * \param [in] keep_start the first sector of the range being queued
+ * \param [in] keep_end one past the last sector of the range being queued
+ *
+ * \return the chunk, or NULL if there is none to spare
+ */
+static MVHDReadaheadChunk* mvhd_ra_victim(MVHDReadahead* ra, uint32_t keep_start, uint32_t keep_end) {
+    MVHDReadaheadChunk* victim = NULL;
+    for (int i = 0; i < ra->num_chunks; i++) {
+        MVHDReadaheadChunk* chunk = &ra->chunks[i];
+        if (chunk->state == MVHD_CHUNK_EMPTY) {
+            return chunk;
+        }
+        if (chunk->state != MVHD_CHUNK_READY || (chunk->offset >= keep_start && chunk->offset < keep_end)) {
+            continue;
+        }
+        if (victim == NULL || chunk->last_used < victim->last_used) {
+            victim = chunk;
+        }
+    }
+    return victim;
+}
+
+/**
+ * \brief Queue the chunks covering a range for prefetching. Must be called with ra->lock held
+ *
+ * Chunks already in the buffer are skipped. Queueing stops early if the buffer is full.
+ *
+ * \param [in] ra the readahead state
+ * \param [in] start the first sector to prefetch
+ * \param [in] end one past the last sector to prefetch
+ *
+ * \return the sector up to which the range has been queued
+ */
+static uint32_t mvhd_ra_queue(MVHDReadahead* ra, uint32_t start, uint32_t end) {
+    bool queued = false;
+    if (end > ra->total_sectors) {
+        end = ra->total_sectors;
+    }
+    uint32_t first = start - start % MVHD_READAHEAD_CHUNK;
+    uint32_t c;
+    for (c = first; c < end; c += MVHD_READAHEAD_CHUNK) {
+        if (mvhd_ra_find(ra, c) != NULL) {
+            continue;
+        }
+        MVHDReadaheadChunk* chunk = mvhd_ra_victim(ra, first, end);
+        if (chunk == NULL) {
+            break;
+        }
+        chunk->offset = c;
+        chunk->num_sectors = ra->total_sectors - c < MVHD_READAHEAD_CHUNK ? (int)(ra->total_sectors - c) : MVHD_READAHEAD_CHUNK;
+        chunk->state = MVHD_CHUNK_QUEUED;
+        chunk->stale = false;
+        chunk->last_used = ++ra->use_count;
+        queued = true;
+    }
+    if (queued) {
+        mvhd_cond_signal(&ra->work_cond);
+    }
+    return c < end ? c : end;
+}
+
+/**
+ * \brief Copy the leading sectors of a read from the buffer. Must be called with ra->lock held
+ *
+ * Waits for chunks which are being read. A chunk is freed once its last sector has been
+ * copied out.
+ *
+ * \param [in] ra the readahead state
+ * \param [in] offset the first sector of the read
+ * \param [in] end one past the last sector of the read, no further than the end of the disk
+ * \param [out] out the buffers to copy sectors to, advanced past them
+ *
+ * \return the first sector which was not found in the buffer, or end
+ */
+static uint32_t mvhd_ra_copy(MVHDReadahead* ra, uint32_t offset, uint32_t end, MVHDIOCursor* out) {
+    uint32_t s = offset;
+    while (s < end) {
+        MVHDReadaheadChunk* chunk = mvhd_ra_find(ra, s);
+        if (chunk == NULL || chunk->state == MVHD_CHUNK_QUEUED) {
+            break;
+        }
+        if (chunk->state == MVHD_CHUNK_READING) {
+            mvhd_cond_wait(&ra->done_cond, &ra->lock);
+            continue;
+        }
+        uint32_t chunk_end = chunk->offset + chunk->num_sectors;
+        uint32_t n = (chunk_end < end ? chunk_end : end) - s;
+        mvhd_cursor_copy(out, chunk->data + (size_t)(s - chunk->offset) * MVHD_SECTOR_SIZE, (size_t)n * MVHD_SECTOR_SIZE, true);
+        chunk->last_used = ++ra->use_count;
+        if (s + n == chunk_end) {
+            chunk->state = MVHD_CHUNK_EMPTY;
+        }
+        s += n;
+    }
+    return s;
+}
+
+/**
+ * \brief Match a read to a stream, and queue data past it. Must be called with ra->lock held
+ *
+ * \param [in] ra the readahead state
+ * \param [in] offset the first sector of the read
+ * \param [in] end one past the last sector of the read
+ */
+static void mvhd_ra_track(MVHDReadahead* ra, uint32_t offset, uint32_t end) {
+    bool hinted = ra->hint.advice != MVHD_ADVICE_NORMAL && offset >= ra->hint.start && offset < ra->hint.end;
+    if (hinted && ra->hint.advice == MVHD_ADVICE_RANDOM) {
+        return;
+    }
+    MVHDReadaheadStream* st = NULL;
+    for (int i = 0; i < MVHD_READAHEAD_STREAMS; i++) {
+        if (ra->streams[i].active && ra->streams[i].next == offset) {
+            st = &ra->streams[i];
+            break;
+        }
+    }
+    if (st != NULL) {
+        st->window = st->window == 0 ? MVHD_READAHEAD_CHUNK : st->window * 2;
+        if (st->window > ra->max_window) {
+            st->window = ra->max_window;
+        }
+    } else {
+        /* Start a new stream in place of the least recently used one */
+        st = &ra->streams[0];
+        for (int i = 1; i < MVHD_READAHEAD_STREAMS && st->active; i++) {
+            if (!ra->streams[i].active || ra->streams[i].last_used < st->last_used) {
+                st = &ra->streams[i];
+            }
+        }
+        st->active = true;
+        st->ahead = end;
+        st->window = hinted ? ra->max_window : 0;
+    }
+    st->next = end;
+    st->last_used = ++ra->use_count;
+    if (st->window > 0) {
+        uint64_t limit = (uint64_t)end + st->window;
+        st->ahead = mvhd_ra_queue(ra, st->ahead > end ? st->ahead : end, limit < ra->total_sectors ? (uint32_t)limit : ra->total_sectors);
+    }
+}
+
+/**
+ * \brief Read queued chunks, oldest first, until readahead is stopped
+ *
+ * \param [in] arg the readahead state
+ */
+static void mvhd_ra_worker(void* arg) {
+    MVHDReadahead* ra = (MVHDReadahead*)arg;
+    mvhd_mutex_lock(&ra->lock);
+    for (;;) {
+        MVHDReadaheadChunk* chunk = NULL;
+        for (int i = 0; i < ra->num_chunks; i++) {
+            if (ra->chunks[i].state == MVHD_CHUNK_QUEUED && (chunk == NULL || ra->chunks[i].last_used < chunk->last_used)) {
+                chunk = &ra->chunks[i];
+            }
+        }
+        if (ra->stopping) {
+            break;
+        }
+        if (chunk == NULL) {
+            mvhd_cond_wait(&ra->work_cond, &ra->lock);
+            continue;
+        }
+        chunk->state = MVHD_CHUNK_READING;
+        mvhd_mutex_unlock(&ra->lock);
+        MVHDIOVec iov = { chunk->data, (size_t)chunk->num_sectors * MVHD_SECTOR_SIZE };
+        MVHDIOCursor cur = { &iov, 1, 0, 0 };
+        mvhd_lock_shared(ra->vhdm);
+        ra->vhdm->read_sectors(ra->vhdm, chunk->offset, chunk->num_sectors, &cur);
+        mvhd_unlock_shared(ra->vhdm);
+        mvhd_mutex_lock(&ra->lock);
+        chunk->state = chunk->stale ? MVHD_CHUNK_EMPTY : MVHD_CHUNK_READY;
+        mvhd_cond_broadcast(&ra->done_cond);
+    }
+    mvhd_mutex_unlock(&ra->lock);
+}
+
+/**
+ * \brief Allocate the readahead buffer of an image and start its thread
+ *
+ * \param [in] vhdm MiniVHD data structure, with readahead disabled
+ * \param [in] max_sectors the size of the buffer in sectors
+ *
+ * \retval 0 on success
+ * \retval MVHD_ERR_MEM if the buffer, a lock or the thread could not be created
+ */
+static int mvhd_readahead_start(MVHDMeta* vhdm, int max_sectors) {
+    if (mvhd_set_thread_safe(vhdm, true) != 0) {
+        return MVHD_ERR_MEM;
+    }
+    MVHDReadahead* ra = calloc(1, sizeof *ra);
+    if (ra == NULL) {
+        goto end;
+    }
+    ra->vhdm = vhdm;
+    ra->total_sectors = (uint32_t)(vhdm->footer.curr_sz / MVHD_SECTOR_SIZE);
+    ra->num_chunks = (max_sectors + MVHD_READAHEAD_CHUNK - 1) / MVHD_READAHEAD_CHUNK;
+    ra->max_window = ra->num_chunks * MVHD_READAHEAD_CHUNK;
+    ra->hint.advice = MVHD_ADVICE_NORMAL;
+    ra->chunks = calloc(ra->num_chunks, sizeof *ra->chunks);
+    ra->chunk_data = malloc((size_t)ra->max_window * MVHD_SECTOR_SIZE);
+    if (ra->chunks == NULL || ra->chunk_data == NULL) {
+        goto cleanup_ra;
+    }
+    for (int i = 0; i < ra->num_chunks; i++) {
+        ra->chunks[i].data = ra->chunk_data + (size_t)i * MVHD_READAHEAD_CHUNK * MVHD_SECTOR_SIZE;
+    }
+    if (mvhd_mutex_init(&ra->lock) != 0) {
+        goto cleanup_ra;
+    }
+    if (mvhd_cond_init(&ra->work_cond) != 0) {
+        goto cleanup_lock;
+    }
+    if (mvhd_cond_init(&ra->done_cond) != 0) {
+        goto cleanup_work_cond;
+    }
+    if (mvhd_thread_create(&ra->thread, mvhd_ra_worker, ra) != 0) {
+        goto cleanup_done_cond;
+    }
+    vhdm->readahead = ra;
+    return 0;
+cleanup_done_cond:
+    mvhd_cond_destroy(&ra->done_cond);
+cleanup_work_cond:
+    mvhd_cond_destroy(&ra->work_cond);
+cleanup_lock:
+    mvhd_mutex_destroy(&ra->lock);
+cleanup_ra:
+    free(ra->chunk_data);
+    free(ra->chunks);
+    free(ra);
+end:
+    return MVHD_ERR_MEM;
+}
+
+void mvhd_readahead_stop(MVHDMeta* vhdm) {
+    MVHDReadahead* ra = vhdm->readahead;
+    if (ra == NULL) {
+        return;
+    }
+    mvhd_mutex_lock(&ra->lock);
+    ra->stopping = true;
+    mvhd_cond_signal(&ra->work_cond);
+    mvhd_mutex_unlock(&ra->lock);
+    mvhd_thread_join(ra->thread);
+    mvhd_cond_destroy(&ra->done_cond);
+    mvhd_cond_destroy(&ra->work_cond);
+    mvhd_mutex_destroy(&ra->lock);
+    free(ra->chunk_data);
+    free(ra->chunks);
+    free(ra);
+    vhdm->readahead = NULL;
+}
+
+int mvhd_readahead_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out) {
+    MVHDReadahead* ra = vhdm->readahead;
+    int truncated = 0;
+    if (num_sectors <= 0 || offset >= ra->total_sectors) {
+        mvhd_lock_shared(vhdm);
+        truncated = vhdm->read_sectors(vhdm, offset, num_sectors, out);
+        mvhd_unlock_shared(vhdm);
+        return truncated;
+    }
+    uint32_t end = (uint32_t)num_sectors < ra->total_sectors - offset ? offset + (uint32_t)num_sectors : ra->total_sectors;
+    mvhd_mutex_lock(&ra->lock);
+    uint32_t s = mvhd_ra_copy(ra, offset, end, out);
+    mvhd_mutex_unlock(&ra->lock);
+    if (s - offset < (uint32_t)num_sectors) {
+        mvhd_lock_shared(vhdm);
+        truncated = vhdm->read_sectors(vhdm, s, num_sectors - (int)(s - offset), out);
+        mvhd_unlock_shared(vhdm);
+    }
+    mvhd_mutex_lock(&ra->lock);
+    mvhd_ra_track(ra, offset, end);
+    mvhd_mutex_unlock(&ra->lock);
+    return truncated;
+}
+
+void mvhd_readahead_invalidate(MVHDMeta* vhdm, uint32_t offset, int num_sectors) {
+    MVHDReadahead* ra = vhdm->readahead;
+    if (ra == NULL || num_sectors <= 0) {
+        return;
+    }
+    uint64_t end = (uint64_t)offset + (uint64_t)num_sectors;
+    mvhd_mutex_lock(&ra->lock);
+    for (int i = 0; i < ra->num_chunks; i++) {
+        MVHDReadaheadChunk* chunk = &ra->chunks[i];
+        if (chunk->state == MVHD_CHUNK_EMPTY || chunk->offset >= end || chunk->offset + (uint32_t)chunk->num_sectors <= offset) {
+            continue;
+        }
+        if (chunk->state == MVHD_CHUNK_READING) {
+            chunk->stale = true;
+        } else {
+            chunk->state = MVHD_CHUNK_EMPTY;
+        }
+    }
+    /* Let streams queue the dropped chunks again */
+    for (int i = 0; i < MVHD_READAHEAD_STREAMS; i++) {
+        if (ra->streams[i].active && ra->streams[i].ahead > offset) {
+            ra->streams[i].ahead = offset;
+        }
+    }
+    mvhd_mutex_unlock(&ra->lock);
+}
+
+int mvhd_set_readahead(MVHDMeta* vhdm, int max_sectors) {
+    if (max_sectors < 0 || max_sectors > MVHD_READAHEAD_MAX) {
+        return MVHD_ERR_INVALID_PARAMS;
+    }
+    mvhd_readahead_stop(vhdm);
+    if (max_sectors == 0 || vhdm->mapping.data != NULL) {
+        /* Mapped images are read straight from memory already */
+        return 0;
+    }
+    return mvhd_readahead_start(vhdm, max_sectors);
+}
+
+int mvhd_advise(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDAdvice advice) {
+    if (num_sectors < 0 || advice < MVHD_ADVICE_NORMAL || advice > MVHD_ADVICE_DONTNEED) {
+        return MVHD_ERR_INVALID_PARAMS;
+    }
+    if (vhdm->readahead == NULL) {
+        if (advice != MVHD_ADVICE_SEQUENTIAL && advice != MVHD_ADVICE_WILLNEED) {
+            return 0;
+        }
+        int err = mvhd_set_readahead(vhdm, MVHD_READAHEAD_DEFAULT);
+        if (err != 0 || vhdm->readahead == NULL) {
+            return err;
+        }
+    }
+    MVHDReadahead* ra = vhdm->readahead;
+    uint32_t end = ra->total_sectors;
+    if (num_sectors > 0 && (uint32_t)num_sectors < ra->total_sectors - offset && offset < ra->total_sectors) {
+        end = offset + (uint32_t)num_sectors;
+    }
+    if (advice == MVHD_ADVICE_DONTNEED) {
+        mvhd_readahead_invalidate(vhdm, offset, (int)(end > offset ? end - offset : 0));
+        return 0;
+    }
+    mvhd_mutex_lock(&ra->lock);
+    if (advice == MVHD_ADVICE_WILLNEED) {
+        mvhd_ra_queue(ra, offset, end);
+    } else {
+        ra->hint.advice = advice;
+        ra->hint.start = offset;
+        ra->hint.end = end;
+    }
+    mvhd_mutex_unlock(&ra->lock);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef MINIVHD_READAHEAD_H
+#define MINIVHD_READAHEAD_H
+#include "minivhd.h"
+#include "minivhd_internal.h"
+
+/**
+ * \brief Read sectors of an image with readahead enabled
+ *
+ * Sectors are copied from prefetched data where possible, and read from the image
+ * otherwise. The read is then used to detect sequential streams, and more data is
+ * queued for prefetching if it belongs to one. Must be called without the handle's
+ * lock held, as it may wait for a prefetch in progress.
+ *
+ * \param [in] vhdm MiniVHD data structure, with readahead enabled
+ * \param [in] offset Sector offset to read from
+ * \param [in] num_sectors The desired number of sectors to read
+ * \param [out] out The buffers to store read sectors in, advanced past them
+ *
+ * \retval 0 num_sectors were read from file
+ * \retval >0 < num_sectors were read from file
+ */
+int mvhd_readahead_read(MVHDMeta* vhdm, uint32_t offset, int num_sectors, MVHDIOCursor* out);
+
+/**
+ * \brief Drop prefetched data for sectors which have been written or discarded
+ *
+ * Data which is being prefetched at the time is dropped once the read completes. Does
+ * nothing unless readahead is enabled.
+ *
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] offset The first sector that changed
+ * \param [in] num_sectors The number of sectors that changed
+ */
+void mvhd_readahead_invalidate(MVHDMeta* vhdm, uint32_t offset, int num_sectors);
+
+/**
+ * \brief Stop the readahead thread of an image and free its buffer
+ *
+ * Does nothing unless readahead is enabled.
+ *
+ * \param [in] vhdm MiniVHD data structure
+ */
+void mvhd_readahead_stop(MVHDMeta* vhdm);
+
+#endif
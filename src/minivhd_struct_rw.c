@@ -3,6 +3,10 @@
  * \brief Header and footer serialize/deserialize functions
  */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* for pthread_rwlock_t */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
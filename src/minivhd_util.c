@@ -3,12 +3,31 @@
  * \brief Utility functions
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for fallocate() */
+#endif
+
 #include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MVHD_X86_SIMD
+#include <immintrin.h>
+#endif
 #include "libxml2_encoding.h"
 #include "minivhd_internal.h"
 #include "minivhd_util.h"
@@ -77,6 +96,93 @@ uint64_t mvhd_to_be64(uint64_t val) {
     return ret;
 }
 
+#ifdef MVHD_X86_SIMD
+__attribute__((target("avx2")))
+static size_t mvhd_from_be32_avx2(uint32_t* vals, size_t count) {
+    const __m256i shuf = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(vals + i));
+        _mm256_storeu_si256((__m256i*)(vals + i), _mm256_shuffle_epi8(v, shuf));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t mvhd_from_be32_ssse3(uint32_t* vals, size_t count) {
+    const __m128i shuf = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(vals + i));
+        _mm_storeu_si128((__m128i*)(vals + i), _mm_shuffle_epi8(v, shuf));
+    }
+    return i;
+}
+#endif
+
+void mvhd_from_be32_array(uint32_t* vals, size_t count) {
+    size_t i = 0;
+#ifdef MVHD_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        i = mvhd_from_be32_avx2(vals, count);
+    } else if (__builtin_cpu_supports("ssse3")) {
+        i = mvhd_from_be32_ssse3(vals, count);
+    }
+#endif
+    /* Whatever is left over, or everything on other CPUs */
+    for (; i < count; i++) {
+        vals[i] = mvhd_from_be32(vals[i]);
+    }
+}
+
+#ifdef MVHD_X86_SIMD
+__attribute__((target("avx2")))
+static size_t mvhd_zero_prefix_avx2(const uint8_t* buff, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(buff + i)), 
+                                                    _mm256_loadu_si256((const __m256i*)(buff + i + 32))), 
+                                    _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(buff + i + 64)), 
+                                                    _mm256_loadu_si256((const __m256i*)(buff + i + 96))));
+        if (!_mm256_testz_si256(v, v)) {
+            break;
+        }
+    }
+    return i;
+}
+#endif
+
+bool mvhd_is_zero(const void* buff, size_t len) {
+    const uint8_t* bytes = buff;
+    size_t i = 0;
+#ifdef MVHD_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        i = mvhd_zero_prefix_avx2(bytes, len);
+        if (i + 128 <= len) {
+            return false;
+        }
+    }
+#endif
+    for (; i + 64 <= len; i += 64) {
+        uint64_t acc = 0;
+        for (int j = 0; j < 64; j += 8) {
+            uint64_t word;
+            memcpy(&word, bytes + i + j, sizeof word);
+            acc |= word;
+        }
+        if (acc != 0) {
+            return false;
+        }
+    }
+    for (; i < len; i++) {
+        if (bytes[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool mvhd_is_conectix_str(const void* buffer) {
     if (strncmp(buffer, MVHD_CONECTIX_COOKIE, strlen(MVHD_CONECTIX_COOKIE)) == 0) {
         return true;
@@ -233,6 +339,8 @@ const char* mvhd_strerr(MVHDError err) {
         return "invalid parameters passed to function";
     case MVHD_ERR_CONV_SIZE:
         return "error converting image. Size mismatch detechted";
+    case MVHD_ERR_QUEUE_FULL:
+        return "asynchronous request queue is full";
     default:
         return "unknown error";
     }
@@ -256,21 +364,590 @@ int mvhd_fseeko64(FILE* stream, int64_t offset, int origin)
 #endif
 }
 
+size_t mvhd_pread(FILE* f, void* buf, size_t len, int64_t offset) {
+    uint8_t* pos = (uint8_t*)buf;
+    size_t done = 0;
+#ifdef _WIN32
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(f));
+    while (done < len) {
+        OVERLAPPED ov = {0};
+        DWORD chunk = (len - done) > 0x40000000 ? 0x40000000 : (DWORD)(len - done);
+        DWORD n = 0;
+        ov.Offset = (DWORD)((uint64_t)offset & 0xffffffff);
+        ov.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
+        if (!ReadFile(h, pos, chunk, &n, &ov) || n == 0) {
+            break;
+        }
+        pos += n;
+        done += n;
+        offset += n;
+    }
+#else
+    int fd = fileno(f);
+    while (done < len) {
+        ssize_t n = pread(fd, pos, len - done, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        pos += n;
+        done += (size_t)n;
+        offset += n;
+    }
+#endif
+    return done;
+}
+
+size_t mvhd_pwrite(FILE* f, const void* buf, size_t len, int64_t offset) {
+    const uint8_t* pos = (const uint8_t*)buf;
+    size_t done = 0;
+#ifdef _WIN32
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(f));
+    while (done < len) {
+        OVERLAPPED ov = {0};
+        DWORD chunk = (len - done) > 0x40000000 ? 0x40000000 : (DWORD)(len - done);
+        DWORD n = 0;
+        ov.Offset = (DWORD)((uint64_t)offset & 0xffffffff);
+        ov.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
+        if (!WriteFile(h, pos, chunk, &n, &ov) || n == 0) {
+            break;
+        }
+        pos += n;
+        done += n;
+        offset += n;
+    }
+#else
+    int fd = fileno(f);
+    while (done < len) {
+        ssize_t n = pwrite(fd, pos, len - done, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        pos += n;
+        done += (size_t)n;
+        offset += n;
+    }
+#endif
+    if (done < len) {
+        mvhd_errno = errno;
+    }
+    return done;
+}
+
+#ifndef _WIN32
+/**
+ * \brief Read or write a scatter/gather list at an absolute file offset
+ * 
+ * \param [in] f The file to access
+ * \param [in] iov The buffers to transfer
+ * \param [in] iovcnt The number of elements in iov
+ * \param [in] offset The absolute file offset to start at
+ * \param [in] write true to write to the file, false to read from it
+ * 
+ * \return The total number of bytes transferred
+ */
+static size_t mvhd_prwv(FILE* f, const MVHDIOVec* iov, int iovcnt, int64_t offset, bool write) {
+    struct iovec vec[MVHD_IOV_BATCH];
+    int fd = fileno(f);
+    size_t done = 0;
+    size_t skip = 0; /* Bytes of iov[i] already transferred */
+    int i = 0;
+    while (i < iovcnt) {
+        int n = 0;
+        for (int j = i; j < iovcnt && n < MVHD_IOV_BATCH; j++) {
+            size_t from = j == i ? skip : 0;
+            vec[n].iov_base = (uint8_t*)iov[j].base + from;
+            vec[n].iov_len = iov[j].len - from;
+            n++;
+        }
+        ssize_t r = write ? pwritev(fd, vec, n, (off_t)(offset + done)) : preadv(fd, vec, n, (off_t)(offset + done));
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            break;
+        }
+        done += (size_t)r;
+        size_t adv = (size_t)r;
+        while (i < iovcnt && adv >= iov[i].len - skip) {
+            adv -= iov[i].len - skip;
+            skip = 0;
+            i++;
+        }
+        skip += adv;
+    }
+    return done;
+}
+#endif
+
+size_t mvhd_preadv(FILE* f, const MVHDIOVec* iov, int iovcnt, int64_t offset) {
+#ifdef _WIN32
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t n = mvhd_pread(f, iov[i].base, iov[i].len, offset + (int64_t)done);
+        done += n;
+        if (n < iov[i].len) {
+            break;
+        }
+    }
+    return done;
+#else
+    return mvhd_prwv(f, iov, iovcnt, offset, false);
+#endif
+}
+
+size_t mvhd_pwritev(FILE* f, const MVHDIOVec* iov, int iovcnt, int64_t offset) {
+    size_t done = 0;
+#ifdef _WIN32
+    for (int i = 0; i < iovcnt; i++) {
+        size_t n = mvhd_pwrite(f, iov[i].base, iov[i].len, offset + (int64_t)done);
+        done += n;
+        if (n < iov[i].len) {
+            break;
+        }
+    }
+#else
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].len;
+    }
+    done = mvhd_prwv(f, iov, iovcnt, offset, true);
+    if (done < len) {
+        mvhd_errno = errno;
+    }
+#endif
+    return done;
+}
+
+int64_t mvhd_get_file_size(FILE* f) {
+#ifdef _WIN32
+    struct _stati64 st;
+    if (_fstati64(_fileno(f), &st) != 0) {
+        return -1;
+    }
+#else
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) {
+        return -1;
+    }
+#endif
+    return (int64_t)st.st_size;
+}
+
+int mvhd_set_file_size(FILE* f, int64_t new_size) {
+#ifdef _WIN32
+    return _chsize_s(_fileno(f), new_size) == 0 ? 0 : -1;
+#else
+    return ftruncate(fileno(f), (off_t)new_size);
+#endif
+}
+
+void* mvhd_map_file(FILE* f, size_t len, bool readonly, void** map_handle) {
+    void* addr = NULL;
+#ifdef _WIN32
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(f));
+    HANDLE mapping = CreateFileMappingW(h, NULL, readonly ? PAGE_READONLY : PAGE_READWRITE, 
+                                        (DWORD)((uint64_t)len >> 32), (DWORD)((uint64_t)len & 0xffffffff), NULL);
+    if (mapping == NULL) {
+        return NULL;
+    }
+    addr = MapViewOfFile(mapping, readonly ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, len);
+    if (addr == NULL) {
+        CloseHandle(mapping);
+        return NULL;
+    }
+    *map_handle = mapping;
+#else
+    addr = mmap(NULL, len, readonly ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, fileno(f), 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    *map_handle = NULL;
+#endif
+    return addr;
+}
+
+int mvhd_sync_mapping(void* addr, size_t len) {
+#ifdef _WIN32
+    return FlushViewOfFile(addr, len) ? 0 : -1;
+#else
+    return msync(addr, len, MS_SYNC);
+#endif
+}
+
+void mvhd_unmap_file(void* addr, size_t len, void* map_handle) {
+#ifdef _WIN32
+    UnmapViewOfFile(addr);
+    CloseHandle((HANDLE)map_handle);
+#else
+    (void)map_handle;
+    munmap(addr, len);
+#endif
+}
+
+static size_t mvhd_file_read_at(void* ctx, void* buf, size_t len, int64_t offset) {
+    return mvhd_pread((FILE*)ctx, buf, len, offset);
+}
+
+static size_t mvhd_file_write_at(void* ctx, const void* buf, size_t len, int64_t offset) {
+    return mvhd_pwrite((FILE*)ctx, buf, len, offset);
+}
+
+static size_t mvhd_file_readv_at(void* ctx, const MVHDIOVec* iov, int iovcnt, int64_t offset) {
+    return mvhd_preadv((FILE*)ctx, iov, iovcnt, offset);
+}
+
+static size_t mvhd_file_writev_at(void* ctx, const MVHDIOVec* iov, int iovcnt, int64_t offset) {
+    return mvhd_pwritev((FILE*)ctx, iov, iovcnt, offset);
+}
+
+static int64_t mvhd_file_size(void* ctx) {
+    return mvhd_get_file_size((FILE*)ctx);
+}
+
+static int mvhd_file_set_size(void* ctx, int64_t new_size) {
+    return mvhd_set_file_size((FILE*)ctx, new_size);
+}
+
+static int mvhd_file_flush(void* ctx) {
+    FILE* f = (FILE*)ctx;
+    if (fflush(f) != 0) {
+        return -1;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(f));
+#else
+    return fsync(fileno(f));
+#endif
+}
+
+static int mvhd_file_punch_hole(void* ctx, int64_t offset, int64_t len) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    return fallocate(fileno((FILE*)ctx), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)len);
+#else
+    /* Not supported on this platform */
+    return -1;
+#endif
+}
+
+static int mvhd_file_reserve(void* ctx, int64_t offset, int64_t len) {
+    FILE* f = (FILE*)ctx;
+#if defined(__linux__)
+    return fallocate(fileno(f), 0, (off_t)offset, (off_t)len);
+#elif defined(_WIN32)
+    /* Extending the file allocates the new space on NTFS */
+    int64_t size = mvhd_get_file_size(f);
+    return size >= offset + len ? 0 : mvhd_set_file_size(f, offset + len);
+#elif defined(__FreeBSD__) || defined(__NetBSD__)
+    return posix_fallocate(fileno(f), (off_t)offset, (off_t)len) == 0 ? 0 : -1;
+#else
+    /* Not supported on this platform, so the file is extended as blocks are allocated */
+    (void)f;
+    (void)offset;
+    (void)len;
+    return -1;
+#endif
+}
+
+static void mvhd_file_close(void* ctx) {
+    fclose((FILE*)ctx);
+}
+
+const MVHDStorageOps mvhd_file_storage_ops = {
+    .read_at = mvhd_file_read_at,
+    .write_at = mvhd_file_write_at,
+    .size = mvhd_file_size,
+    .set_size = mvhd_file_set_size,
+    .flush = mvhd_file_flush,
+    .punch_hole = mvhd_file_punch_hole,
+    .close = mvhd_file_close,
+    .reserve = mvhd_file_reserve,
+    .readv_at = mvhd_file_readv_at,
+    .writev_at = mvhd_file_writev_at
+};
+
+size_t mvhd_read_at(MVHDMeta* vhdm, void* buf, size_t len, int64_t offset) {
+    return vhdm->storage->read_at(vhdm->storage_ctx, buf, len, offset);
+}
+
+size_t mvhd_write_at(MVHDMeta* vhdm, const void* buf, size_t len, int64_t offset) {
+    return vhdm->storage->write_at(vhdm->storage_ctx, buf, len, offset);
+}
+
+size_t mvhd_write_zeros_at(MVHDMeta* vhdm, size_t len, int64_t offset) {
+    static const uint8_t zero_buff[64 * MVHD_SECTOR_SIZE] = {0};
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = (len - done) > sizeof zero_buff ? sizeof zero_buff : (len - done);
+        size_t n = mvhd_write_at(vhdm, zero_buff, chunk, offset + (int64_t)done);
+        done += n;
+        if (n < chunk) {
+            break;
+        }
+    }
+    return done;
+}
+
+int64_t mvhd_storage_size(MVHDMeta* vhdm) {
+    return vhdm->storage->size(vhdm->storage_ctx);
+}
+
 uint32_t mvhd_crc32_for_byte(uint32_t r) {
     for (int j = 0; j < 8; ++j)
         r = (r & 1 ? 0 : (uint32_t)0xEDB88320L) ^ r >> 1;
     return r ^ (uint32_t)0xFF000000L;
 }
 
-uint32_t mvhd_crc32(const void* data, size_t n_bytes) {
-    static uint32_t table[0x100];
-    if (!*table)
-        for (size_t i = 0; i < 0x100; ++i)
-            table[i] = mvhd_crc32_for_byte(i);
+/* mvhd_crc32_for_byte() of every byte value, precomputed so that no initialisation is 
+   needed and concurrent callers can share it */
+static const uint32_t mvhd_crc32_table[0x100] = {
+    0xd202ef8d, 0xa505df1b, 0x3c0c8ea1, 0x4b0bbe37, 0xd56f2b94, 0xa2681b02,
+    0x3b614ab8, 0x4c667a2e, 0xdcd967bf, 0xabde5729, 0x32d70693, 0x45d03605,
+    0xdbb4a3a6, 0xacb39330, 0x35bac28a, 0x42bdf21c, 0xcfb5ffe9, 0xb8b2cf7f,
+    0x21bb9ec5, 0x56bcae53, 0xc8d83bf0, 0xbfdf0b66, 0x26d65adc, 0x51d16a4a,
+    0xc16e77db, 0xb669474d, 0x2f6016f7, 0x58672661, 0xc603b3c2, 0xb1048354,
+    0x280dd2ee, 0x5f0ae278, 0xe96ccf45, 0x9e6bffd3, 0x0762ae69, 0x70659eff,
+    0xee010b5c, 0x99063bca, 0x000f6a70, 0x77085ae6, 0xe7b74777, 0x90b077e1,
+    0x09b9265b, 0x7ebe16cd, 0xe0da836e, 0x97ddb3f8, 0x0ed4e242, 0x79d3d2d4,
+    0xf4dbdf21, 0x83dcefb7, 0x1ad5be0d, 0x6dd28e9b, 0xf3b61b38, 0x84b12bae,
+    0x1db87a14, 0x6abf4a82, 0xfa005713, 0x8d076785, 0x140e363f, 0x630906a9,
+    0xfd6d930a, 0x8a6aa39c, 0x1363f226, 0x6464c2b0, 0xa4deae1d, 0xd3d99e8b,
+    0x4ad0cf31, 0x3dd7ffa7, 0xa3b36a04, 0xd4b45a92, 0x4dbd0b28, 0x3aba3bbe,
+    0xaa05262f, 0xdd0216b9, 0x440b4703, 0x330c7795, 0xad68e236, 0xda6fd2a0,
+    0x4366831a, 0x3461b38c, 0xb969be79, 0xce6e8eef, 0x5767df55, 0x2060efc3,
+    0xbe047a60, 0xc9034af6, 0x500a1b4c, 0x270d2bda, 0xb7b2364b, 0xc0b506dd,
+    0x59bc5767, 0x2ebb67f1, 0xb0dff252, 0xc7d8c2c4, 0x5ed1937e, 0x29d6a3e8,
+    0x9fb08ed5, 0xe8b7be43, 0x71beeff9, 0x06b9df6f, 0x98dd4acc, 0xefda7a5a,
+    0x76d32be0, 0x01d41b76, 0x916b06e7, 0xe66c3671, 0x7f6567cb, 0x0862575d,
+    0x9606c2fe, 0xe101f268, 0x7808a3d2, 0x0f0f9344, 0x82079eb1, 0xf500ae27,
+    0x6c09ff9d, 0x1b0ecf0b, 0x856a5aa8, 0xf26d6a3e, 0x6b643b84, 0x1c630b12,
+    0x8cdc1683, 0xfbdb2615, 0x62d277af, 0x15d54739, 0x8bb1d29a, 0xfcb6e20c,
+    0x65bfb3b6, 0x12b88320, 0x3fba6cad, 0x48bd5c3b, 0xd1b40d81, 0xa6b33d17,
+    0x38d7a8b4, 0x4fd09822, 0xd6d9c998, 0xa1def90e, 0x3161e49f, 0x4666d409,
+    0xdf6f85b3, 0xa868b525, 0x360c2086, 0x410b1010, 0xd80241aa, 0xaf05713c,
+    0x220d7cc9, 0x550a4c5f, 0xcc031de5, 0xbb042d73, 0x2560b8d0, 0x52678846,
+    0xcb6ed9fc, 0xbc69e96a, 0x2cd6f4fb, 0x5bd1c46d, 0xc2d895d7, 0xb5dfa541,
+    0x2bbb30e2, 0x5cbc0074, 0xc5b551ce, 0xb2b26158, 0x04d44c65, 0x73d37cf3,
+    0xeada2d49, 0x9ddd1ddf, 0x03b9887c, 0x74beb8ea, 0xedb7e950, 0x9ab0d9c6,
+    0x0a0fc457, 0x7d08f4c1, 0xe401a57b, 0x930695ed, 0x0d62004e, 0x7a6530d8,
+    0xe36c6162, 0x946b51f4, 0x19635c01, 0x6e646c97, 0xf76d3d2d, 0x806a0dbb,
+    0x1e0e9818, 0x6909a88e, 0xf000f934, 0x8707c9a2, 0x17b8d433, 0x60bfe4a5,
+    0xf9b6b51f, 0x8eb18589, 0x10d5102a, 0x67d220bc, 0xfedb7106, 0x89dc4190,
+    0x49662d3d, 0x3e611dab, 0xa7684c11, 0xd06f7c87, 0x4e0be924, 0x390cd9b2,
+    0xa0058808, 0xd702b89e, 0x47bda50f, 0x30ba9599, 0xa9b3c423, 0xdeb4f4b5,
+    0x40d06116, 0x37d75180, 0xaede003a, 0xd9d930ac, 0x54d13d59, 0x23d60dcf,
+    0xbadf5c75, 0xcdd86ce3, 0x53bcf940, 0x24bbc9d6, 0xbdb2986c, 0xcab5a8fa,
+    0x5a0ab56b, 0x2d0d85fd, 0xb404d447, 0xc303e4d1, 0x5d677172, 0x2a6041e4,
+    0xb369105e, 0xc46e20c8, 0x72080df5, 0x050f3d63, 0x9c066cd9, 0xeb015c4f,
+    0x7565c9ec, 0x0262f97a, 0x9b6ba8c0, 0xec6c9856, 0x7cd385c7, 0x0bd4b551,
+    0x92dde4eb, 0xe5dad47d, 0x7bbe41de, 0x0cb97148, 0x95b020f2, 0xe2b71064,
+    0x6fbf1d91, 0x18b82d07, 0x81b17cbd, 0xf6b64c2b, 0x68d2d988, 0x1fd5e91e,
+    0x86dcb8a4, 0xf1db8832, 0x616495a3, 0x1663a535, 0x8f6af48f, 0xf86dc419,
+    0x660951ba, 0x110e612c, 0x88073096, 0xff000000
+};
 
+uint32_t mvhd_crc32(const void* data, size_t n_bytes) {
     uint32_t crc = 0;
     for (size_t i = 0; i < n_bytes; ++i)
-        crc = table[(uint8_t)crc ^ ((uint8_t*)data)[i]] ^ crc >> 8;
+        crc = mvhd_crc32_table[(uint8_t)crc ^ ((uint8_t*)data)[i]] ^ crc >> 8;
 
     return crc;
-}
\ No newline at end of file
+}
+
+int mvhd_rwlock_init(MVHDRwLock* lock) {
+#ifdef _WIN32
+    InitializeSRWLock(lock);
+    return 0;
+#else
+    return pthread_rwlock_init(lock, NULL);
+#endif
+}
+
+void mvhd_rwlock_destroy(MVHDRwLock* lock) {
+#ifndef _WIN32
+    pthread_rwlock_destroy(lock);
+#endif
+}
+
+void mvhd_rwlock_lock_shared(MVHDRwLock* lock) {
+#ifdef _WIN32
+    AcquireSRWLockShared(lock);
+#else
+    pthread_rwlock_rdlock(lock);
+#endif
+}
+
+void mvhd_rwlock_unlock_shared(MVHDRwLock* lock) {
+#ifdef _WIN32
+    ReleaseSRWLockShared(lock);
+#else
+    pthread_rwlock_unlock(lock);
+#endif
+}
+
+void mvhd_rwlock_lock_excl(MVHDRwLock* lock) {
+#ifdef _WIN32
+    AcquireSRWLockExclusive(lock);
+#else
+    pthread_rwlock_wrlock(lock);
+#endif
+}
+
+void mvhd_rwlock_unlock_excl(MVHDRwLock* lock) {
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(lock);
+#else
+    pthread_rwlock_unlock(lock);
+#endif
+}
+
+int mvhd_mutex_init(MVHDMutex* mutex) {
+#ifdef _WIN32
+    InitializeSRWLock(mutex);
+    return 0;
+#else
+    return pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void mvhd_mutex_destroy(MVHDMutex* mutex) {
+#ifndef _WIN32
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void mvhd_mutex_lock(MVHDMutex* mutex) {
+#ifdef _WIN32
+    AcquireSRWLockExclusive(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void mvhd_mutex_unlock(MVHDMutex* mutex) {
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+int mvhd_cond_init(MVHDCond* cond) {
+#ifdef _WIN32
+    InitializeConditionVariable(cond);
+    return 0;
+#else
+    return pthread_cond_init(cond, NULL);
+#endif
+}
+
+void mvhd_cond_destroy(MVHDCond* cond) {
+#ifndef _WIN32
+    pthread_cond_destroy(cond);
+#endif
+}
+
+void mvhd_cond_wait(MVHDCond* cond, MVHDMutex* mutex) {
+#ifdef _WIN32
+    SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void mvhd_cond_signal(MVHDCond* cond) {
+#ifdef _WIN32
+    WakeConditionVariable(cond);
+#else
+    pthread_cond_signal(cond);
+#endif
+}
+
+void mvhd_cond_broadcast(MVHDCond* cond) {
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+/* The function and argument of a thread being started, freed by the new thread */
+typedef struct MVHDThreadStart {
+    MVHDThreadFunc func;
+    void* arg;
+} MVHDThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI mvhd_thread_main(LPVOID param) {
+#else
+static void* mvhd_thread_main(void* param) {
+#endif
+    MVHDThreadStart start = *(MVHDThreadStart*)param;
+    free(param);
+    start.func(start.arg);
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+int mvhd_thread_create(MVHDThread* thread, MVHDThreadFunc func, void* arg) {
+    MVHDThreadStart* start = malloc(sizeof *start);
+    if (start == NULL) {
+        return -1;
+    }
+    start->func = func;
+    start->arg = arg;
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, mvhd_thread_main, start, 0, NULL);
+    if (*thread == NULL) {
+        free(start);
+        return -1;
+    }
+#else
+    if (pthread_create(thread, NULL, mvhd_thread_main, start) != 0) {
+        free(start);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+void mvhd_thread_join(MVHDThread thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+void mvhd_lock_shared(MVHDMeta* vhdm) {
+    if (vhdm->sync.enabled) {
+        mvhd_rwlock_lock_shared(&vhdm->sync.lock);
+    }
+}
+
+void mvhd_unlock_shared(MVHDMeta* vhdm) {
+    if (vhdm->sync.enabled) {
+        mvhd_rwlock_unlock_shared(&vhdm->sync.lock);
+    }
+}
+
+void mvhd_lock_excl(MVHDMeta* vhdm) {
+    if (vhdm->sync.enabled) {
+        mvhd_rwlock_lock_excl(&vhdm->sync.lock);
+    }
+}
+
+void mvhd_unlock_excl(MVHDMeta* vhdm) {
+    if (vhdm->sync.enabled) {
+        mvhd_rwlock_unlock_excl(&vhdm->sync.lock);
+    }
+}
@@ -17,6 +17,29 @@ uint16_t mvhd_to_be16(uint16_t val);
 uint32_t mvhd_to_be32(uint32_t val);
 uint64_t mvhd_to_be64(uint64_t val);
 
+/**
+ * \brief Convert an array of big endian 32 bit values to host order, in place
+ * 
+ * Uses SSSE3 or AVX2 byte shuffles where the CPU supports them. As byte swapping is its 
+ * own inverse, this also converts an array of host order values to big endian.
+ * 
+ * \param [in,out] vals the values to convert
+ * \param [in] count the number of values in vals
+ */
+void mvhd_from_be32_array(uint32_t* vals, size_t count);
+
+/**
+ * \brief Check whether a buffer holds only zero bytes
+ * 
+ * Uses AVX2 where the CPU supports it.
+ * 
+ * \param [in] buff the buffer to check
+ * \param [in] len the length of buff in bytes
+ * 
+ * \return true if every byte of buff is zero
+ */
+bool mvhd_is_zero(const void* buff, size_t len);
+
 /**
  * \brief Check if provided buffer begins with the string "conectix"
  * 
@@ -98,6 +121,141 @@ int64_t mvhd_ftello64(FILE* stream);
  */
 int mvhd_fseeko64(FILE* stream, int64_t offset, int origin);
 
+/**
+ * \brief Read from a file at an absolute offset
+ * 
+ * Positional reads do not use or move the stream's file position, and bypass 
+ * the stdio buffer. Short reads are retried until len bytes are read, the end 
+ * of the file is reached, or an error occurs.
+ * 
+ * \param [in] f The file to read from
+ * \param [out] buf The buffer to read into
+ * \param [in] len The number of bytes to read
+ * \param [in] offset The absolute file offset to read from
+ * 
+ * \return The number of bytes actually read
+ */
+size_t mvhd_pread(FILE* f, void* buf, size_t len, int64_t offset);
+
+/**
+ * \brief Write to a file at an absolute offset
+ * 
+ * The positional counterpart to mvhd_pread(). 
+ * 
+ * \param [in] f The file to write to
+ * \param [in] buf The buffer to write from
+ * \param [in] len The number of bytes to write
+ * \param [in] offset The absolute file offset to write to
+ * 
+ * \return The number of bytes actually written. If less than len, mvhd_errno is set
+ */
+size_t mvhd_pwrite(FILE* f, const void* buf, size_t len, int64_t offset);
+
+/**
+ * \brief Read from a file at an absolute offset into a scatter/gather list
+ * 
+ * The buffers of iov are filled in turn, using preadv() where available. Like 
+ * mvhd_pread(), short reads are retried.
+ * 
+ * \param [in] f The file to read from
+ * \param [in] iov The buffers to read into
+ * \param [in] iovcnt The number of elements in iov
+ * \param [in] offset The absolute file offset to read from
+ * 
+ * \return The total number of bytes actually read
+ */
+size_t mvhd_preadv(FILE* f, const MVHDIOVec* iov, int iovcnt, int64_t offset);
+
+/**
+ * \brief Write to a file at an absolute offset from a scatter/gather list
+ * 
+ * The positional counterpart to mvhd_preadv(), using pwritev() where available.
+ * 
+ * \param [in] f The file to write to
+ * \param [in] iov The buffers to write from
+ * \param [in] iovcnt The number of elements in iov
+ * \param [in] offset The absolute file offset to write to
+ * 
+ * \return The total number of bytes actually written. If less than requested, mvhd_errno is set
+ */
+size_t mvhd_pwritev(FILE* f, const MVHDIOVec* iov, int iovcnt, int64_t offset);
+
+/**
+ * \brief Get the current size of a file in bytes
+ * 
+ * \param [in] f The file
+ * 
+ * \return The file size, or -1 on error
+ */
+int64_t mvhd_get_file_size(FILE* f);
+
+/**
+ * \brief Change the size of a file
+ * 
+ * \param [in] f The file
+ * \param [in] new_size The new size in bytes. Bytes added to the file read back as zero
+ * 
+ * \return 0 on success, -1 on error
+ */
+int mvhd_set_file_size(FILE* f, int64_t new_size);
+
+/**
+ * \brief Map the start of a file into memory
+ * 
+ * \param [in] f The file to map
+ * \param [in] len The number of bytes to map, from the start of the file
+ * \param [in] readonly Map the file read only
+ * \param [out] map_handle Platform specific handle, to pass to mvhd_unmap_file()
+ * 
+ * \return The address of the mapping, or NULL if the file could not be mapped
+ */
+void* mvhd_map_file(FILE* f, size_t len, bool readonly, void** map_handle);
+
+/**
+ * \brief Write modified pages of a mapping back to its file
+ * 
+ * \return 0 on success, -1 on error
+ */
+int mvhd_sync_mapping(void* addr, size_t len);
+
+/**
+ * \brief Unmap a mapping created by mvhd_map_file()
+ */
+void mvhd_unmap_file(void* addr, size_t len, void* map_handle);
+
+/**
+ * The default storage backend, which stores an image in a file. The ctx for 
+ * each callback is the FILE pointer.
+ */
+extern const MVHDStorageOps mvhd_file_storage_ops;
+
+/**
+ * Read from, or write to, the storage backend of an image. These are shorthands 
+ * for calling the read_at and write_at callbacks of vhdm->storage.
+ */
+size_t mvhd_read_at(MVHDMeta* vhdm, void* buf, size_t len, int64_t offset);
+size_t mvhd_write_at(MVHDMeta* vhdm, const void* buf, size_t len, int64_t offset);
+
+/**
+ * \brief Write zeros to the storage backend of an image
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * \param [in] len The number of zero bytes to write
+ * \param [in] offset The absolute offset to write to
+ * 
+ * \return The number of bytes actually written
+ */
+size_t mvhd_write_zeros_at(MVHDMeta* vhdm, size_t len, int64_t offset);
+
+/**
+ * \brief Get the current size of the storage backend of an image
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ * 
+ * \return The size in bytes, or -1 on error
+ */
+int64_t mvhd_storage_size(MVHDMeta* vhdm);
+
 /**
  * \brief Calculate the CRC32 of a data buffer.
  * 
@@ -109,4 +267,67 @@ int mvhd_fseeko64(FILE* stream, int64_t offset, int origin);
  * \return The CRC32 of the data buffer
  */
 uint32_t mvhd_crc32(const void* data, size_t n_bytes);
+/**
+ * Wrappers around the platform's reader/writer locks and mutexes
+ */
+int mvhd_rwlock_init(MVHDRwLock* lock);
+void mvhd_rwlock_destroy(MVHDRwLock* lock);
+void mvhd_rwlock_lock_shared(MVHDRwLock* lock);
+void mvhd_rwlock_unlock_shared(MVHDRwLock* lock);
+void mvhd_rwlock_lock_excl(MVHDRwLock* lock);
+void mvhd_rwlock_unlock_excl(MVHDRwLock* lock);
+int mvhd_mutex_init(MVHDMutex* mutex);
+void mvhd_mutex_destroy(MVHDMutex* mutex);
+void mvhd_mutex_lock(MVHDMutex* mutex);
+void mvhd_mutex_unlock(MVHDMutex* mutex);
+
+/**
+ * Wrappers around the platform's condition variables. mvhd_cond_wait() must be called 
+ * with mutex held, and may wake up spuriously.
+ */
+int mvhd_cond_init(MVHDCond* cond);
+void mvhd_cond_destroy(MVHDCond* cond);
+void mvhd_cond_wait(MVHDCond* cond, MVHDMutex* mutex);
+void mvhd_cond_signal(MVHDCond* cond);
+void mvhd_cond_broadcast(MVHDCond* cond);
+
+/**
+ * \brief Start a thread
+ * 
+ * \param [out] thread the started thread, to be passed to mvhd_thread_join()
+ * \param [in] func the function to run in the new thread
+ * \param [in] arg passed to func
+ * 
+ * \retval 0 on success
+ * \retval -1 if the thread could not be started
+ */
+int mvhd_thread_create(MVHDThread* thread, MVHDThreadFunc func, void* arg);
+
+/**
+ * \brief Wait for a thread started with mvhd_thread_create() to finish
+ * 
+ * \param [in] thread the thread to wait for
+ */
+void mvhd_thread_join(MVHDThread thread);
+
+/**
+ * \brief Take a handle's lock for an operation which only reads metadata
+ * 
+ * Does nothing unless thread-safe mode is enabled with mvhd_set_thread_safe()
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+void mvhd_lock_shared(MVHDMeta* vhdm);
+void mvhd_unlock_shared(MVHDMeta* vhdm);
+
+/**
+ * \brief Take a handle's lock for an operation which may change metadata
+ * 
+ * Does nothing unless thread-safe mode is enabled with mvhd_set_thread_safe()
+ * 
+ * \param [in] vhdm MiniVHD data structure
+ */
+void mvhd_lock_excl(MVHDMeta* vhdm);
+void mvhd_unlock_excl(MVHDMeta* vhdm);
+
 #endif
\ No newline at end of file
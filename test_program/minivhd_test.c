@@ -1,13 +1,1602 @@
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700 /* for realpath() */
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 #include "../src/minivhd.h"
 
+#define TEST_SECTOR_SIZE 512
+#define TEST_PATH_LEN 4096
+
+/* Size of the scratch images used by the feature tests. 16 MB, or 8 blocks of the default size */
+#define TEST_DISK_SECTORS 32768
+#define TEST_BLOCK_SECTORS 4096
+
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("    Check failed on line %d: %s\n", __LINE__, #cond); \
+            return false; \
+        } \
+    } while (0)
+
+/* Threads for the thread-safe mode tests */
+#ifdef _WIN32
+typedef HANDLE TestThread;
+typedef DWORD (WINAPI *TestThreadFunc)(LPVOID);
+#define TEST_THREAD_FUNC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define TEST_THREAD_RETURN 0
+#else
+typedef pthread_t TestThread;
+typedef void* (*TestThreadFunc)(void*);
+#define TEST_THREAD_FUNC(name, arg) void* name(void* arg)
+#define TEST_THREAD_RETURN NULL
+#endif
+
+#define TEST_NUM_THREADS 8
+
+/* Directory the feature tests create their images in, with a trailing separator. Differencing
+   images need absolute paths, so this is the absolute directory of the sparse VHD argument */
+static char scratch_dir[TEST_PATH_LEN];
+
+static bool test_set_scratch_dir(const char* existing_path);
+static void test_path(char* path, const char* name);
+static void test_fill(uint8_t* buff, uint32_t offset, int num_sectors, uint32_t seed);
+static MVHDMeta* test_create(const char* name, int type, const char* par_name, uint32_t block_sectors);
+static bool test_verify(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const uint8_t* expected);
+static bool test_write_model(MVHDMeta* vhdm, uint8_t* model, uint32_t offset, int num_sectors, uint32_t seed);
+static bool test_sparse_read(void);
+static MVHDMeta* test_open(const char* name, bool readonly);
+static bool test_sparse_write(void);
+static bool test_diff_read(void);
+static bool test_bitmap_cache(void);
+static bool test_write_back(void);
+static bool test_fixed_io(void);
+static size_t test_mem_read_at(void* ctx, void* buf, size_t len, int64_t offset);
+static size_t test_mem_write_at(void* ctx, const void* buf, size_t len, int64_t offset);
+static int64_t test_mem_size(void* ctx);
+static int test_mem_set_size(void* ctx, int64_t new_size);
+static int test_mem_flush(void* ctx);
+static bool test_mem_storage(void);
+static bool test_mapped(void);
+static bool test_check_extents(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const signed char* layers);
+static bool test_extents(void);
+static long test_file_size(const char* name);
+static bool test_block_alloc(void);
+static bool test_copy_file(const char* src_name, const char* dest_name);
+static bool test_dirty_footer(void);
+static int test_mem_reserve(void* ctx, int64_t offset, int64_t len);
+static bool test_reservation(void);
+static bool test_bat_load(void);
+static bool test_bitmap_scan(void);
+static bool test_convert_zeros(void);
+static bool test_thread_start(TestThread* thread, TestThreadFunc func, void* arg);
+static void test_thread_join(TestThread thread);
+static bool test_thread_safe(void);
+static bool test_parallel_writes(void);
+static bool test_async_complete(MVHDAsyncQueue* q, int count);
+static bool test_async_image(const char* name, int type);
+static bool test_async(void);
+static bool test_scatter_gather(void);
+static bool test_discard(void);
+static bool test_zero_elision(void);
+static bool test_readahead(void);
+static bool test_data_cache(void);
+static bool test_shared_parent(void);
+static bool test_block_owners(void);
+
+static bool test_set_scratch_dir(const char* existing_path) {
+    char full_path[TEST_PATH_LEN];
+#ifdef _WIN32
+    if (_fullpath(full_path, existing_path, sizeof full_path) == NULL) {
+        return false;
+    }
+#else
+    if (realpath(existing_path, full_path) == NULL) {
+        return false;
+    }
+#endif
+    char* sep = strrchr(full_path, '/');
+    char* win_sep = strrchr(full_path, '\\');
+    if (win_sep > sep) {
+        sep = win_sep;
+    }
+    if (sep == NULL) {
+        return false;
+    }
+    sep[1] = '\0';
+    strcpy(scratch_dir, full_path);
+    return true;
+}
+
+static void test_path(char* path, const char* name) {
+    snprintf(path, TEST_PATH_LEN, "%sminivhd_test_%s.vhd", scratch_dir, name);
+}
+
+/* Fill sectors with data which differs for every sector, offset and seed, and is never all zero */
+static void test_fill(uint8_t* buff, uint32_t offset, int num_sectors, uint32_t seed) {
+    for (int s = 0; s < num_sectors; s++) {
+        uint32_t x = (offset + (uint32_t)s) * 2654435761u ^ seed;
+        for (int i = 0; i < TEST_SECTOR_SIZE; i++) {
+            x = x * 1103515245u + 12345u;
+            buff[(size_t)s * TEST_SECTOR_SIZE + i] = (uint8_t)(x >> 16);
+        }
+        buff[(size_t)s * TEST_SECTOR_SIZE] |= 1;
+    }
+}
+
+/* Create a new scratch image, replacing any left over from an earlier run */
+static MVHDMeta* test_create(const char* name, int type, const char* par_name, uint32_t block_sectors) {
+    char path[TEST_PATH_LEN], par_path[TEST_PATH_LEN];
+    int err;
+    test_path(path, name);
+    remove(path);
+    MVHDCreationOptions opts;
+    memset(&opts, 0, sizeof opts);
+    opts.type = type;
+    opts.path = path;
+    opts.size_in_bytes = (uint64_t)TEST_DISK_SECTORS * TEST_SECTOR_SIZE;
+    opts.block_size_in_sectors = block_sectors;
+    if (par_name != NULL) {
+        test_path(par_path, par_name);
+        opts.parent_path = par_path;
+    }
+    MVHDMeta* vhdm = mvhd_create_ex(opts, &err);
+    if (vhdm == NULL) {
+        printf("    Could not create %s: %s\n", path, mvhd_strerr(err));
+    }
+    return vhdm;
+}
+
+/* Read sectors back in one go, and compare them with what they should hold */
+static bool test_verify(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const uint8_t* expected) {
+    uint8_t* buff = malloc((size_t)num_sectors * TEST_SECTOR_SIZE);
+    TEST_CHECK(buff != NULL);
+    memset(buff, 0xa5, (size_t)num_sectors * TEST_SECTOR_SIZE);
+    int truncated = mvhd_read_sectors(vhdm, offset, num_sectors, buff);
+    bool same = memcmp(buff, expected, (size_t)num_sectors * TEST_SECTOR_SIZE) == 0;
+    free(buff);
+    TEST_CHECK(truncated == 0);
+    if (!same) {
+        printf("    Sectors %u to %u do not hold the expected data\n", offset, offset + num_sectors - 1);
+    }
+    return same;
+}
+
+/* Write fresh data to sectors, and record it in a copy of the whole disk */
+static bool test_write_model(MVHDMeta* vhdm, uint8_t* model, uint32_t offset, int num_sectors, uint32_t seed) {
+    uint8_t* dest = model + (size_t)offset * TEST_SECTOR_SIZE;
+    test_fill(dest, offset, num_sectors, seed);
+    TEST_CHECK(mvhd_write_sectors(vhdm, offset, num_sectors, dest) == 0);
+    return true;
+}
+
+/* Sparse reads are split into runs of allocated and empty sectors, within and across blocks */
+static bool test_sparse_read(void) {
+    printf("Testing sparse reads across allocated and empty runs\n");
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("sparse_read", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    /* Runs of every length around a byte of the sector bitmap, in the first block, and
+       runs either side of the boundary between the second and third */
+    TEST_CHECK(test_write_model(vhdm, model, 0, 1, 1));
+    TEST_CHECK(test_write_model(vhdm, model, 7, 2, 2));
+    TEST_CHECK(test_write_model(vhdm, model, 17, 9, 3));
+    TEST_CHECK(test_write_model(vhdm, model, 2 * TEST_BLOCK_SECTORS - 5, 3, 4));
+    TEST_CHECK(test_write_model(vhdm, model, 2 * TEST_BLOCK_SECTORS + 1, 40, 5));
+    for (uint32_t offset = 0; offset < 64; offset += 3) {
+        TEST_CHECK(test_verify(vhdm, offset, 29, model + (size_t)offset * TEST_SECTOR_SIZE));
+    }
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(test_verify(vhdm, TEST_BLOCK_SECTORS - 8, 2 * TEST_BLOCK_SECTORS, model + (size_t)(TEST_BLOCK_SECTORS - 8) * TEST_SECTOR_SIZE));
+    /* Reads past the end of the disk are cut short */
+    uint8_t buff[4 * TEST_SECTOR_SIZE];
+    TEST_CHECK(mvhd_read_sectors(vhdm, TEST_DISK_SECTORS - 1, 4, buff) == 3);
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* Open an existing scratch image */
+static MVHDMeta* test_open(const char* name, bool readonly) {
+    char path[TEST_PATH_LEN];
+    int err;
+    test_path(path, name);
+    MVHDMeta* vhdm = mvhd_open(path, readonly, &err);
+    if (vhdm == NULL) {
+        printf("    Could not open %s: %s\n", path, mvhd_strerr(err));
+    }
+    return vhdm;
+}
+
+/* Writes are split into runs per block, with whole blocks written in one go */
+static bool test_sparse_write(void) {
+    printf("Testing sparse and differencing writes across blocks\n");
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("sparse_write", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    /* A whole block, a write from the middle of one block to the middle of another, and 
+       partial writes over both */
+    TEST_CHECK(test_write_model(vhdm, model, TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS, 1));
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS - 100, 2 * TEST_BLOCK_SECTORS + 200, 2));
+    TEST_CHECK(test_write_model(vhdm, model, TEST_BLOCK_SECTORS + 10, 5, 3));
+    TEST_CHECK(test_write_model(vhdm, model, 4 * TEST_BLOCK_SECTORS - 1, 2, 4));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    vhdm = test_open("sparse_write", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    /* A child overwriting whole and partial blocks still shows the rest of its parent */
+    vhdm = test_create("sparse_write_child", MVHD_TYPE_DIFF, "sparse_write", 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, 0, TEST_BLOCK_SECTORS, 5));
+    TEST_CHECK(test_write_model(vhdm, model, 2 * TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS, 6));
+    TEST_CHECK(test_write_model(vhdm, model, TEST_BLOCK_SECTORS + 8, 3, 7));
+    TEST_CHECK(test_write_model(vhdm, model, 4 * TEST_BLOCK_SECTORS - 3, 6, 8));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    vhdm = test_open("sparse_write_child", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* Differencing reads are resolved in runs, each from the nearest layer holding the sectors */
+static bool test_diff_read(void) {
+    printf("Testing reads through a differencing chain\n");
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("diff_read_base", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, 0, 300, 1));
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS, 2));
+    mvhd_close(vhdm);
+    vhdm = test_create("diff_read_mid", MVHD_TYPE_DIFF, "diff_read_base", 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, 100, 50, 3));
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS + 1000, 20, 4));
+    TEST_CHECK(test_write_model(vhdm, model, 5 * TEST_BLOCK_SECTORS + 7, 9, 5));
+    mvhd_close(vhdm);
+    vhdm = test_create("diff_read_top", MVHD_TYPE_DIFF, "diff_read_mid", 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, 120, 10, 6));
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS + 1010, 1, 7));
+    TEST_CHECK(test_write_model(vhdm, model, 6 * TEST_BLOCK_SECTORS, 1, 8));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    /* Reads starting and ending in every layer */
+    for (uint32_t offset = 90; offset < 160; offset += 7) {
+        TEST_CHECK(test_verify(vhdm, offset, 23, model + (size_t)offset * TEST_SECTOR_SIZE));
+    }
+    for (uint32_t offset = 3 * TEST_BLOCK_SECTORS + 995; offset < 3 * TEST_BLOCK_SECTORS + 1025; offset += 5) {
+        TEST_CHECK(test_verify(vhdm, offset, 11, model + (size_t)offset * TEST_SECTOR_SIZE));
+    }
+    mvhd_close(vhdm);
+    vhdm = test_open("diff_read_top", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* The bitmaps of recently used blocks stay in memory, in a cache of configurable size */
+static bool test_bitmap_cache(void) {
+    printf("Testing the sector bitmap cache\n");
+    uint64_t hits, misses, new_hits, new_misses;
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("bitmap_cache", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(mvhd_set_bitmap_cache_size(vhdm, 0) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_set_bitmap_cache_size(vhdm, 4097) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_set_bitmap_cache_size(vhdm, 2) == 0);
+    for (uint32_t blk = 0; blk < 8; blk++) {
+        TEST_CHECK(test_write_model(vhdm, model, blk * TEST_BLOCK_SECTORS + blk, 3, blk + 1));
+    }
+    /* Reading the same block again and again hits the cache */
+    mvhd_get_bitmap_cache_stats(vhdm, &hits, &misses);
+    for (int i = 0; i < 4; i++) {
+        TEST_CHECK(test_verify(vhdm, 5 * TEST_BLOCK_SECTORS, 16, model + (size_t)5 * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE));
+    }
+    mvhd_get_bitmap_cache_stats(vhdm, &new_hits, &new_misses);
+    TEST_CHECK(new_hits >= hits + 3);
+    /* Going round more blocks than the cache holds misses it every time */
+    hits = new_hits;
+    misses = new_misses;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t blk = 0; blk < 8; blk++) {
+            TEST_CHECK(test_verify(vhdm, blk * TEST_BLOCK_SECTORS, 16, model + (size_t)blk * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE));
+        }
+    }
+    mvhd_get_bitmap_cache_stats(vhdm, &new_hits, &new_misses);
+    TEST_CHECK(new_misses >= misses + 16);
+    /* Resizing the cache keeps pending bitmaps */
+    TEST_CHECK(test_write_model(vhdm, model, 2 * TEST_BLOCK_SECTORS + 100, 5, 9));
+    TEST_CHECK(mvhd_set_bitmap_cache_size(vhdm, 1) == 0);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    vhdm = test_open("bitmap_cache", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* In write-back mode, bitmaps and BAT entries reach the file on flush or close */
+static bool test_write_back(void) {
+    printf("Testing write-back of sparse metadata\n");
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("write_back", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(mvhd_set_write_back(vhdm, true, 0) == 0);
+    TEST_CHECK(test_write_model(vhdm, model, 0, 1, 1));
+    TEST_CHECK(test_write_model(vhdm, model, TEST_BLOCK_SECTORS + 3, 50, 2));
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS - 2, 4, 3));
+    TEST_CHECK(test_write_model(vhdm, model, 6 * TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS, 4));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    /* Once flushed, the file on its own holds everything */
+    TEST_CHECK(mvhd_flush(vhdm) == 0);
+    MVHDMeta* ro = test_open("write_back", true);
+    TEST_CHECK(ro != NULL);
+    TEST_CHECK(test_verify(ro, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(ro);
+    /* With a tiny threshold, metadata is written back as it goes. Disabling write-back 
+       writes what is still pending, after which writes go straight through again */
+    TEST_CHECK(mvhd_set_write_back(vhdm, true, 1) == 0);
+    TEST_CHECK(test_write_model(vhdm, model, 4 * TEST_BLOCK_SECTORS + 5, 7, 5));
+    TEST_CHECK(test_write_model(vhdm, model, 20, 30, 6));
+    TEST_CHECK(mvhd_set_write_back(vhdm, false, 0) == 0);
+    TEST_CHECK(test_write_model(vhdm, model, 7 * TEST_BLOCK_SECTORS + 2, 1, 9));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(mvhd_flush(vhdm) == 0);
+    ro = test_open("write_back", true);
+    TEST_CHECK(ro != NULL);
+    TEST_CHECK(test_verify(ro, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(ro);
+    /* Closing writes pending metadata too */
+    TEST_CHECK(mvhd_set_write_back(vhdm, true, 0) == 0);
+    TEST_CHECK(test_write_model(vhdm, model, 2 * TEST_BLOCK_SECTORS + 9, 2, 7));
+    TEST_CHECK(test_write_model(vhdm, model, 7 * TEST_BLOCK_SECTORS - 1, 1, 8));
+    mvhd_close(vhdm);
+    vhdm = test_open("write_back", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* Fixed images are read and written in place, at any offset */
+static bool test_fixed_io(void) {
+    printf("Testing fixed image reads and writes\n");
+    static const uint32_t runs[][2] = {
+        { 0, 1 }, { 511, 2 }, { TEST_BLOCK_SECTORS - 1, 3 }, { 12345, 100 }, { TEST_DISK_SECTORS - 5, 5 }
+    };
+    uint8_t buff[4 * TEST_SECTOR_SIZE];
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("fixed_io", MVHD_TYPE_FIXED, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    for (size_t i = 0; i < sizeof runs / sizeof runs[0]; i++) {
+        TEST_CHECK(test_write_model(vhdm, model, runs[i][0], (int)runs[i][1], (uint32_t)i + 1));
+    }
+    for (size_t i = 0; i < sizeof runs / sizeof runs[0]; i++) {
+        uint32_t offset = runs[i][0] > 0 ? runs[i][0] - 1 : 0;
+        TEST_CHECK(test_verify(vhdm, offset, 3, model + (size_t)offset * TEST_SECTOR_SIZE));
+    }
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    /* Writes past the end of the disk are cut short */
+    test_fill(buff, TEST_DISK_SECTORS - 2, 4, 9);
+    TEST_CHECK(mvhd_write_sectors(vhdm, TEST_DISK_SECTORS - 2, 4, buff) == 2);
+    memcpy(model + (size_t)(TEST_DISK_SECTORS - 2) * TEST_SECTOR_SIZE, buff, 2 * TEST_SECTOR_SIZE);
+    mvhd_close(vhdm);
+    vhdm = test_open("fixed_io", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* A storage backend keeping the image in memory */
+typedef struct TestMemStorage {
+    uint8_t* data;
+    int64_t size;
+    int64_t capacity;
+} TestMemStorage;
+
+static const MVHDStorageOps test_mem_ops = {
+    .read_at = test_mem_read_at,
+    .write_at = test_mem_write_at,
+    .size = test_mem_size,
+    .set_size = test_mem_set_size,
+    .flush = test_mem_flush
+};
+
+static size_t test_mem_read_at(void* ctx, void* buf, size_t len, int64_t offset) {
+    TestMemStorage* mem = ctx;
+    if (offset >= mem->size) {
+        return 0;
+    }
+    if ((int64_t)len > mem->size - offset) {
+        len = (size_t)(mem->size - offset);
+    }
+    memcpy(buf, mem->data + offset, len);
+    return len;
+}
+
+static size_t test_mem_write_at(void* ctx, const void* buf, size_t len, int64_t offset) {
+    TestMemStorage* mem = ctx;
+    if (offset + (int64_t)len > mem->size && test_mem_set_size(ctx, offset + (int64_t)len) != 0) {
+        return 0;
+    }
+    memcpy(mem->data + offset, buf, len);
+    return len;
+}
+
+static int64_t test_mem_size(void* ctx) {
+    TestMemStorage* mem = ctx;
+    return mem->size;
+}
+
+static int test_mem_set_size(void* ctx, int64_t new_size) {
+    TestMemStorage* mem = ctx;
+    if (new_size > mem->capacity) {
+        int64_t capacity = mem->capacity * 2 > new_size ? mem->capacity * 2 : new_size;
+        uint8_t* data = realloc(mem->data, (size_t)capacity);
+        if (data == NULL) {
+            return -1;
+        }
+        mem->data = data;
+        mem->capacity = capacity;
+    }
+    if (new_size > mem->size) {
+        memset(mem->data + mem->size, 0, (size_t)(new_size - mem->size));
+    }
+    mem->size = new_size;
+    return 0;
+}
+
+static int test_mem_flush(void* ctx) {
+    (void)ctx;
+    return 0;
+}
+
+/* Images can be created and reopened on a custom storage backend, without touching files */
+static bool test_mem_storage(void) {
+    printf("Testing images on a custom storage backend\n");
+    char path[TEST_PATH_LEN];
+    int err;
+    TestMemStorage mem = { NULL, 0, 0 };
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    test_path(path, "mem_storage");
+    remove(path);
+    MVHDCreationOptions opts;
+    memset(&opts, 0, sizeof opts);
+    opts.type = MVHD_TYPE_DYNAMIC;
+    opts.path = path;
+    opts.size_in_bytes = (uint64_t)TEST_DISK_SECTORS * TEST_SECTOR_SIZE;
+    opts.storage_ops = &test_mem_ops;
+    opts.storage_ctx = &mem;
+    MVHDMeta* vhdm = mvhd_create_ex(opts, &err);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, 5, 10, 1));
+    TEST_CHECK(test_write_model(vhdm, model, 2 * TEST_BLOCK_SECTORS - 1, 2, 2));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    TEST_CHECK(mem.size > 2 * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE);
+    FILE* f = fopen(path, "rb");
+    if (f != NULL) {
+        fclose(f);
+    }
+    TEST_CHECK(f == NULL);
+    vhdm = mvhd_open_storage(path, &test_mem_ops, &mem, false, &err);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(test_write_model(vhdm, model, 7 * TEST_BLOCK_SECTORS + 3, 1, 3));
+    mvhd_close(vhdm);
+    vhdm = mvhd_open_storage(NULL, &test_mem_ops, &mem, true, &err);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    /* Storage that is not a VHD is rejected, and left to the caller */
+    memset(mem.data, 0, (size_t)mem.size);
+    TEST_CHECK(mvhd_open_storage(NULL, &test_mem_ops, &mem, true, &err) == NULL);
+    TEST_CHECK(err == MVHD_ERR_NOT_VHD);
+    free(mem.data);
+    free(model);
+    return true;
+}
+
+/* Fixed images can be memory mapped, and their sectors accessed without a copy */
+static bool test_mapped(void) {
+    printf("Testing memory mapped images\n");
+    char path[TEST_PATH_LEN];
+    int err;
+    size_t len;
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("mapped", MVHD_TYPE_FIXED, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, 0, 10, 1));
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS, 20, 2));
+    mvhd_close(vhdm);
+    test_path(path, "mapped");
+    vhdm = mvhd_open_mapped(path, false, &err);
+    TEST_CHECK(vhdm != NULL);
+    const uint8_t* sectors = mvhd_map_sectors(vhdm, 0, TEST_DISK_SECTORS, &len);
+    TEST_CHECK(sectors != NULL);
+    TEST_CHECK(len == (size_t)TEST_DISK_SECTORS * TEST_SECTOR_SIZE);
+    TEST_CHECK(memcmp(sectors, model, len) == 0);
+    /* Mapping past the end of the disk is cut short, or fails */
+    TEST_CHECK(mvhd_map_sectors(vhdm, TEST_DISK_SECTORS - 2, 8, &len) == sectors + (size_t)(TEST_DISK_SECTORS - 2) * TEST_SECTOR_SIZE);
+    TEST_CHECK(len == 2 * TEST_SECTOR_SIZE);
+    TEST_CHECK(mvhd_map_sectors(vhdm, TEST_DISK_SECTORS, 1, &len) == NULL);
+    /* Writes through the handle show up in the mapping, and reach the file */
+    TEST_CHECK(test_write_model(vhdm, model, 5 * TEST_BLOCK_SECTORS - 1, 3, 3));
+    TEST_CHECK(memcmp(sectors, model, (size_t)TEST_DISK_SECTORS * TEST_SECTOR_SIZE) == 0);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    vhdm = test_open("mapped", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(mvhd_map_sectors(vhdm, 0, 1, &len) == NULL);
+    mvhd_close(vhdm);
+    /* Sparse images are opened as usual */
+    memset(model, 0, (size_t)TEST_DISK_SECTORS * TEST_SECTOR_SIZE);
+    vhdm = test_create("mapped_sparse", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    mvhd_close(vhdm);
+    test_path(path, "mapped_sparse");
+    vhdm = mvhd_open_mapped(path, false, &err);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(mvhd_map_sectors(vhdm, 0, 1, &len) == NULL);
+    TEST_CHECK(test_write_model(vhdm, model, TEST_BLOCK_SECTORS - 1, 2, 4));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* Check the extents of a range against the layer each sector should be in, or -1 where it 
+   should read as zero. They are fetched a few at a time, which also checks continuing a list */
+static bool test_check_extents(MVHDMeta* vhdm, uint32_t offset, int num_sectors, const signed char* layers) {
+    MVHDExtent extents[4];
+    uint32_t pos = offset;
+    uint32_t end = offset + (uint32_t)num_sectors;
+    while (pos < end) {
+        int count = mvhd_get_extents(vhdm, pos, (int)(end - pos), extents, 4);
+        TEST_CHECK(count > 0 && count <= 4);
+        for (int i = 0; i < count; i++) {
+            const MVHDExtent* ext = &extents[i];
+            TEST_CHECK(ext->offset == pos && ext->num_sectors > 0 && ext->num_sectors <= end - pos);
+            TEST_CHECK((ext->type == MVHD_EXTENT_ZERO) == (ext->layer == -1 && ext->file_offset == -1));
+            /* Neighbouring zero runs are merged */
+            TEST_CHECK(i == 0 || ext->type != MVHD_EXTENT_ZERO || extents[i - 1].type != MVHD_EXTENT_ZERO);
+            for (uint32_t s = pos; s < pos + ext->num_sectors; s++) {
+                if (layers[s] != ext->layer) {
+                    printf("    Sector %u is reported in layer %d, expected %d\n", s, ext->layer, layers[s]);
+                    return false;
+                }
+            }
+            pos += ext->num_sectors;
+        }
+    }
+    return true;
+}
+
+/* Extents describe where sectors are stored, without reading them */
+static bool test_extents(void) {
+    printf("Testing extent queries\n");
+    char path[TEST_PATH_LEN];
+    MVHDExtent ext;
+    uint8_t buff[3 * TEST_SECTOR_SIZE];
+    signed char* layers = malloc(TEST_DISK_SECTORS);
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(layers != NULL && model != NULL);
+    memset(layers, -1, TEST_DISK_SECTORS);
+    MVHDMeta* vhdm = test_create("extents", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(mvhd_get_extents(vhdm, 0, TEST_DISK_SECTORS, &ext, 1) == 1);
+    TEST_CHECK(ext.type == MVHD_EXTENT_ZERO && ext.num_sectors == TEST_DISK_SECTORS);
+    TEST_CHECK(test_write_model(vhdm, model, 10, 10, 1));
+    TEST_CHECK(test_write_model(vhdm, model, 2 * TEST_BLOCK_SECTORS - 3, 6, 2));
+    TEST_CHECK(test_write_model(vhdm, model, 5 * TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS, 3));
+    memset(layers + 10, 0, 10);
+    memset(layers + 2 * TEST_BLOCK_SECTORS - 3, 0, 6);
+    memset(layers + 5 * TEST_BLOCK_SECTORS, 0, TEST_BLOCK_SECTORS);
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    TEST_CHECK(test_check_extents(vhdm, 15, 2 * TEST_BLOCK_SECTORS, layers));
+    TEST_CHECK(test_check_extents(vhdm, 5 * TEST_BLOCK_SECTORS - 1, 2, layers));
+    /* The file offset of a data run is where its sectors are in the file */
+    TEST_CHECK(mvhd_get_extents(vhdm, 12, 3, &ext, 1) == 1);
+    TEST_CHECK(ext.type == MVHD_EXTENT_DATA && ext.offset == 12 && ext.num_sectors == 3 && ext.layer == 0);
+    test_path(path, "extents");
+    FILE* f = fopen(path, "rb");
+    TEST_CHECK(f != NULL);
+    bool read_ok = fseek(f, (long)ext.file_offset, SEEK_SET) == 0 && fread(buff, sizeof buff, 1, f) == 1;
+    fclose(f);
+    TEST_CHECK(read_ok);
+    TEST_CHECK(memcmp(buff, model + 12 * TEST_SECTOR_SIZE, sizeof buff) == 0);
+    /* Ranges are cut short at the end of the disk */
+    TEST_CHECK(mvhd_get_extents(vhdm, TEST_DISK_SECTORS - 2, 10, &ext, 1) == 1);
+    TEST_CHECK(ext.type == MVHD_EXTENT_ZERO && ext.num_sectors == 2);
+    TEST_CHECK(mvhd_get_extents(vhdm, TEST_DISK_SECTORS, 10, &ext, 1) == 0);
+    TEST_CHECK(mvhd_get_extents(vhdm, 0, -1, &ext, 1) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_get_extents(vhdm, 0, 1, &ext, 0) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_get_extents(vhdm, TEST_DISK_SECTORS + 1, 1, &ext, 1) == MVHD_ERR_INVALID_PARAMS);
+    mvhd_close(vhdm);
+    /* A fixed image is a single run of data at the start of the file */
+    vhdm = test_create("extents_fixed", MVHD_TYPE_FIXED, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(mvhd_get_extents(vhdm, 0, TEST_DISK_SECTORS, &ext, 1) == 1);
+    TEST_CHECK(ext.type == MVHD_EXTENT_DATA && ext.num_sectors == TEST_DISK_SECTORS && ext.layer == 0 && ext.file_offset == 0);
+    mvhd_close(vhdm);
+    free(model);
+    free(layers);
+    return true;
+}
+
+/* Size of a scratch image file, or -1 */
+static long test_file_size(const char* name) {
+    char path[TEST_PATH_LEN];
+    test_path(path, name);
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        size = ftell(f);
+    }
+    fclose(f);
+    return size;
+}
+
+/* New blocks read as zero everywhere except the sectors written, and take up one block each */
+static bool test_block_alloc(void) {
+    printf("Testing block allocation\n");
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("block_alloc", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    long empty_size = test_file_size("block_alloc");
+    TEST_CHECK(empty_size > 0);
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS + 2000, 1, 1));
+    TEST_CHECK(test_write_model(vhdm, model, 6 * TEST_BLOCK_SECTORS - 1, 1, 2));
+    TEST_CHECK(test_verify(vhdm, 3 * TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS, model + (size_t)3 * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    /* Each block and its bitmap, with a little padding */
+    long size = test_file_size("block_alloc");
+    TEST_CHECK(size >= empty_size + 2L * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE);
+    TEST_CHECK(size <= empty_size + 2L * (TEST_BLOCK_SECTORS + 8) * TEST_SECTOR_SIZE);
+    vhdm = test_open("block_alloc", false);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    /* Filling in more of a block leaves what was there */
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS, 2000, 3));
+    TEST_CHECK(test_write_model(vhdm, model, 7 * TEST_BLOCK_SECTORS, 1, 4));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    vhdm = test_open("block_alloc", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* Copy a scratch image, as it is on disk at the moment */
+static bool test_copy_file(const char* src_name, const char* dest_name) {
+    char src_path[TEST_PATH_LEN], dest_path[TEST_PATH_LEN];
+    uint8_t buff[64 * TEST_SECTOR_SIZE];
+    size_t n;
+    test_path(src_path, src_name);
+    test_path(dest_path, dest_name);
+    FILE* src = fopen(src_path, "rb");
+    TEST_CHECK(src != NULL);
+    FILE* dest = fopen(dest_path, "wb");
+    if (dest == NULL) {
+        fclose(src);
+    }
+    TEST_CHECK(dest != NULL);
+    bool ok = true;
+    while (ok && (n = fread(buff, 1, sizeof buff, src)) > 0) {
+        ok = fwrite(buff, 1, n, dest) == n;
+    }
+    ok = ok && !ferror(src);
+    fclose(src);
+    ok = fclose(dest) == 0 && ok;
+    return ok;
+}
+
+/* The trailing footer is only moved on flush or close. An image copied before then, as if 
+   the process had died, still opens and keeps its data */
+static bool test_dirty_footer(void) {
+    printf("Testing images left without a trailing footer\n");
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("dirty_footer", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, 0, 10, 1));
+    TEST_CHECK(test_write_model(vhdm, model, 4 * TEST_BLOCK_SECTORS + 5, 10, 2));
+    TEST_CHECK(test_copy_file("dirty_footer", "dirty_footer_copy"));
+    long copy_size = test_file_size("dirty_footer_copy");
+    TEST_CHECK(test_write_model(vhdm, model, 2 * TEST_BLOCK_SECTORS, 1, 3));
+    mvhd_close(vhdm);
+    vhdm = test_open("dirty_footer", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    /* The copy holds the writes made before it was taken. Opening it read only does not 
+       touch it, opening it read/write puts the footer back without losing anything */
+    memset(model + (size_t)2 * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE, 0, TEST_SECTOR_SIZE);
+    vhdm = test_open("dirty_footer_copy", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    TEST_CHECK(test_file_size("dirty_footer_copy") == copy_size);
+    vhdm = test_open("dirty_footer_copy", false);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(test_write_model(vhdm, model, 7 * TEST_BLOCK_SECTORS, 3, 4));
+    mvhd_close(vhdm);
+    TEST_CHECK(test_file_size("dirty_footer_copy") >= copy_size);
+    vhdm = test_open("dirty_footer_copy", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+static int test_mem_reserve(void* ctx, int64_t offset, int64_t len) {
+    TestMemStorage* mem = ctx;
+    if (offset + len <= mem->size) {
+        return 0;
+    }
+    return test_mem_set_size(ctx, offset + len);
+}
+
+/* With a reservation, space for several blocks is allocated at once, and what is left of 
+   it is given back on close */
+static bool test_reservation(void) {
+    printf("Testing block reservation\n");
+    char path[TEST_PATH_LEN];
+    int err;
+    TestMemStorage mem = { NULL, 0, 0 };
+    MVHDStorageOps ops = test_mem_ops;
+    ops.reserve = test_mem_reserve;
+    int64_t blk_bytes = (int64_t)TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE;
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    test_path(path, "reservation");
+    MVHDCreationOptions opts;
+    memset(&opts, 0, sizeof opts);
+    opts.type = MVHD_TYPE_DYNAMIC;
+    opts.path = path;
+    opts.size_in_bytes = (uint64_t)TEST_DISK_SECTORS * TEST_SECTOR_SIZE;
+    opts.storage_ops = &ops;
+    opts.storage_ctx = &mem;
+    MVHDMeta* vhdm = mvhd_create_ex(opts, &err);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(mvhd_set_block_reservation(vhdm, -1) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_set_block_reservation(vhdm, 4) == 0);
+    int64_t empty_size = mem.size;
+    TEST_CHECK(test_write_model(vhdm, model, 10, 1, 1));
+    int64_t reserved_size = mem.size;
+    TEST_CHECK(reserved_size >= empty_size + 4 * blk_bytes);
+    /* The next blocks come out of the reservation */
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS, 5, 2));
+    TEST_CHECK(test_write_model(vhdm, model, 6 * TEST_BLOCK_SECTORS - 1, 2, 3));
+    TEST_CHECK(mem.size == reserved_size);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    /* More blocks than reserved reserve again */
+    TEST_CHECK(test_write_model(vhdm, model, 7 * TEST_BLOCK_SECTORS, 1, 4));
+    TEST_CHECK(test_write_model(vhdm, model, TEST_BLOCK_SECTORS, 1, 5));
+    TEST_CHECK(mem.size > reserved_size);
+    mvhd_close(vhdm);
+    TEST_CHECK(mem.size < empty_size + 7 * blk_bytes);
+    vhdm = mvhd_open_storage(NULL, &ops, &mem, true, &err);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(mem.data);
+    free(model);
+    return true;
+}
+
+/* The BAT is read in one go when an image is opened, so every entry must come back right */
+static bool test_bat_load(void) {
+    printf("Testing BAT loading with many blocks\n");
+    const uint32_t blk_sect = MVHD_BLOCK_SMALL;
+    signed char* layers = malloc(TEST_DISK_SECTORS);
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(layers != NULL && model != NULL);
+    memset(layers, -1, TEST_DISK_SECTORS);
+    MVHDMeta* vhdm = test_create("bat_load", MVHD_TYPE_DYNAMIC, NULL, blk_sect);
+    TEST_CHECK(vhdm != NULL);
+    /* Allocate blocks out of order, so BAT entries are not in block order */
+    for (uint32_t i = 0; i < TEST_DISK_SECTORS / blk_sect; i++) {
+        uint32_t blk = (i * 7) % (TEST_DISK_SECTORS / blk_sect);
+        if (blk % 3 == 1) {
+            continue;
+        }
+        uint32_t offset = blk * blk_sect + blk;
+        TEST_CHECK(test_write_model(vhdm, model, offset, 2, i + 1));
+        memset(layers + offset, 0, 2);
+    }
+    mvhd_close(vhdm);
+    vhdm = test_open("bat_load", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    mvhd_close(vhdm);
+    free(model);
+    free(layers);
+    return true;
+}
+
+/* Sector bitmaps are scanned a word at a time, so runs starting and ending on and around 
+   word boundaries must all be found */
+static bool test_bitmap_scan(void) {
+    printf("Testing sector bitmap scanning\n");
+    static const uint32_t runs[][2] = {
+        { 0, 1 }, { 31, 1 }, { 33, 30 }, { 64, 64 }, { 129, 1 }, { 191, 2 }, { 200, 257 },
+        { 1023, 1 }, { 1025, 1 }, { 2048, 1024 }, { TEST_BLOCK_SECTORS - 1, 1 },
+        { 2 * TEST_BLOCK_SECTORS + 1, TEST_BLOCK_SECTORS - 2 }
+    };
+    signed char* layers = malloc(TEST_DISK_SECTORS);
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(layers != NULL && model != NULL);
+    memset(layers, -1, TEST_DISK_SECTORS);
+    MVHDMeta* vhdm = test_create("bitmap_scan", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    for (size_t i = 0; i < sizeof runs / sizeof runs[0]; i++) {
+        TEST_CHECK(test_write_model(vhdm, model, runs[i][0], (int)runs[i][1], (uint32_t)i + 1));
+        memset(layers + runs[i][0], 0, runs[i][1]);
+    }
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    /* Ranges starting and ending inside words */
+    for (uint32_t offset = 0; offset < 300; offset += 13) {
+        TEST_CHECK(test_check_extents(vhdm, offset, 77, layers));
+        TEST_CHECK(test_verify(vhdm, offset, 77, model + (size_t)offset * TEST_SECTOR_SIZE));
+    }
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    free(layers);
+    return true;
+}
+
+/* Converting to a sparse image leaves out zero blocks, and zero sectors in blocks with data */
+static bool test_convert_zeros(void) {
+    printf("Testing conversion of zero blocks and sectors\n");
+    char raw_path[TEST_PATH_LEN], vhd_path[TEST_PATH_LEN], out_path[TEST_PATH_LEN];
+    int err;
+    MVHDGeom geom = mvhd_calculate_geometry((uint64_t)TEST_DISK_SECTORS * TEST_SECTOR_SIZE);
+    uint32_t total_sectors = (uint32_t)geom.cyl * geom.heads * geom.spt;
+    signed char* layers = malloc(total_sectors);
+    uint8_t* model = calloc(total_sectors, TEST_SECTOR_SIZE);
+    TEST_CHECK(layers != NULL && model != NULL);
+    memset(layers, -1, total_sectors);
+    /* Block 0 is zero, block 1 has a few sectors of data, block 2 is all data, and the 
+       last, partial, block ends in data */
+    test_fill(model + (size_t)(TEST_BLOCK_SECTORS + 5) * TEST_SECTOR_SIZE, TEST_BLOCK_SECTORS + 5, 5, 1);
+    test_fill(model + (size_t)(TEST_BLOCK_SECTORS + 100) * TEST_SECTOR_SIZE, TEST_BLOCK_SECTORS + 100, 1, 2);
+    test_fill(model + (size_t)2 * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE, 2 * TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS, 3);
+    test_fill(model + (size_t)(total_sectors - 1) * TEST_SECTOR_SIZE, total_sectors - 1, 1, 4);
+    memset(layers + TEST_BLOCK_SECTORS + 5, 0, 5);
+    memset(layers + TEST_BLOCK_SECTORS + 100, 0, 1);
+    memset(layers + 2 * TEST_BLOCK_SECTORS, 0, TEST_BLOCK_SECTORS);
+    memset(layers + total_sectors - 1, 0, 1);
+    snprintf(raw_path, sizeof raw_path, "%sminivhd_test_convert_zeros.img", scratch_dir);
+    snprintf(out_path, sizeof out_path, "%sminivhd_test_convert_zeros_out.img", scratch_dir);
+    test_path(vhd_path, "convert_zeros");
+    remove(vhd_path);
+    FILE* raw = fopen(raw_path, "wb");
+    TEST_CHECK(raw != NULL);
+    bool write_ok = fwrite(model, TEST_SECTOR_SIZE, total_sectors, raw) == total_sectors;
+    TEST_CHECK(fclose(raw) == 0 && write_ok);
+    MVHDMeta* vhdm = mvhd_convert_to_vhd_sparse(raw_path, vhd_path, &err);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_check_extents(vhdm, 0, total_sectors, layers));
+    TEST_CHECK(test_verify(vhdm, 0, total_sectors, model));
+    mvhd_close(vhdm);
+    /* And back again */
+    raw = mvhd_convert_to_raw(vhd_path, out_path, &err);
+    TEST_CHECK(raw != NULL);
+    fclose(raw);
+    raw = fopen(out_path, "rb");
+    TEST_CHECK(raw != NULL);
+    uint8_t* out = malloc((size_t)total_sectors * TEST_SECTOR_SIZE);
+    bool same = out != NULL && fread(out, TEST_SECTOR_SIZE, total_sectors, raw) == total_sectors && 
+                memcmp(out, model, (size_t)total_sectors * TEST_SECTOR_SIZE) == 0;
+    fclose(raw);
+    free(out);
+    TEST_CHECK(same);
+    free(model);
+    free(layers);
+    return true;
+}
+
+static bool test_thread_start(TestThread* thread, TestThreadFunc func, void* arg) {
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, func, arg) == 0;
+#endif
+}
+
+static void test_thread_join(TestThread thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+typedef struct TestReader {
+    MVHDMeta* vhdm;
+    const uint8_t* model;
+    uint32_t first;
+    bool ok;
+} TestReader;
+
+/* Read ranges spread over the whole disk, and check them against the model */
+static TEST_THREAD_FUNC(test_reader_thread, arg) {
+    TestReader* reader = arg;
+    reader->ok = true;
+    for (uint32_t i = 0; reader->ok && i < 64; i++) {
+        uint32_t offset = (reader->first + i * 389) % (TEST_DISK_SECTORS - 40);
+        reader->ok = test_verify(reader->vhdm, offset, 40, reader->model + (size_t)offset * TEST_SECTOR_SIZE);
+    }
+    return TEST_THREAD_RETURN;
+}
+
+/* In thread-safe mode, one handle to a differencing chain can be read from by many threads */
+static bool test_thread_safe(void) {
+    printf("Testing thread-safe mode\n");
+    TestThread threads[TEST_NUM_THREADS];
+    TestReader readers[TEST_NUM_THREADS];
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("thread_safe_base", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    for (uint32_t blk = 0; blk < 8; blk += 2) {
+        TEST_CHECK(test_write_model(vhdm, model, blk * TEST_BLOCK_SECTORS, 700, blk + 1));
+    }
+    mvhd_close(vhdm);
+    vhdm = test_create("thread_safe", MVHD_TYPE_DIFF, "thread_safe_base", 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(mvhd_set_thread_safe(vhdm, true) == 0);
+    for (uint32_t blk = 0; blk < 8; blk++) {
+        TEST_CHECK(test_write_model(vhdm, model, blk * TEST_BLOCK_SECTORS + 300, 30, blk + 9));
+    }
+    TEST_CHECK(mvhd_set_bitmap_cache_size(vhdm, 2) == 0);
+    int started = 0;
+    for (int i = 0; i < TEST_NUM_THREADS; i++) {
+        readers[i].vhdm = vhdm;
+        readers[i].model = model;
+        readers[i].first = (uint32_t)i * 1031;
+        if (!test_thread_start(&threads[i], test_reader_thread, &readers[i])) {
+            break;
+        }
+        started++;
+    }
+    bool all_ok = started == TEST_NUM_THREADS;
+    for (int i = 0; i < started; i++) {
+        test_thread_join(threads[i]);
+        all_ok = all_ok && readers[i].ok;
+    }
+    TEST_CHECK(all_ok);
+    /* Leaving thread-safe mode keeps everything working */
+    TEST_CHECK(mvhd_set_thread_safe(vhdm, false) == 0);
+    TEST_CHECK(test_write_model(vhdm, model, 5 * TEST_BLOCK_SECTORS + 1000, 3, 17));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+typedef struct TestWriter {
+    MVHDMeta* vhdm;
+    uint8_t* model;
+    uint32_t thread_num;
+    bool ok;
+} TestWriter;
+
+/* Write to every block, each thread starting at a different one, right next to the sectors 
+   of the other threads */
+static TEST_THREAD_FUNC(test_writer_thread, arg) {
+    TestWriter* writer = arg;
+    writer->ok = true;
+    for (uint32_t i = 0; writer->ok && i < 8; i++) {
+        uint32_t blk = (i + writer->thread_num) % 8;
+        uint32_t offset = blk * TEST_BLOCK_SECTORS + writer->thread_num * 13;
+        writer->ok = test_write_model(writer->vhdm, writer->model, offset, 13, writer->thread_num + 1);
+    }
+    return TEST_THREAD_RETURN;
+}
+
+/* Writers to different blocks run in parallel, including ones allocating new blocks at once */
+static bool test_parallel_writes(void) {
+    printf("Testing parallel writes to one image\n");
+    TestThread threads[TEST_NUM_THREADS];
+    TestWriter writers[TEST_NUM_THREADS];
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("parallel_writes", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(mvhd_set_thread_safe(vhdm, true) == 0);
+    int started = 0;
+    for (int i = 0; i < TEST_NUM_THREADS; i++) {
+        writers[i].vhdm = vhdm;
+        writers[i].model = model;
+        writers[i].thread_num = (uint32_t)i;
+        if (!test_thread_start(&threads[i], test_writer_thread, &writers[i])) {
+            break;
+        }
+        started++;
+    }
+    bool all_ok = started == TEST_NUM_THREADS;
+    for (int i = 0; i < started; i++) {
+        test_thread_join(threads[i]);
+        all_ok = all_ok && writers[i].ok;
+    }
+    TEST_CHECK(all_ok);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    vhdm = test_open("parallel_writes", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* Wait for count requests to complete, and check that they all succeeded */
+static bool test_async_complete(MVHDAsyncQueue* q, int count) {
+    MVHDAsyncRequest* done[8];
+    while (count > 0) {
+        int n = mvhd_async_wait(q, done, 8);
+        TEST_CHECK(n > 0 && n <= count);
+        for (int i = 0; i < n; i++) {
+            if (done[i]->result != 0) {
+                printf("    Request for sector %u completed with %d\n", done[i]->offset, done[i]->result);
+                return false;
+            }
+        }
+        count -= n;
+    }
+    return true;
+}
+
+/* Every kind of asynchronous request on one image, on a fresh image of the given type */
+static bool test_async_image(const char* name, int type) {
+    int err;
+    MVHDAsyncRequest write_req, read_req, flush_req, extra_req;
+    MVHDAsyncRequest* done[4];
+    uint8_t buff[64 * TEST_SECTOR_SIZE];
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create(name, type, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(mvhd_async_create(vhdm, 0, &err) == NULL);
+    TEST_CHECK(err == MVHD_ERR_INVALID_PARAMS);
+    MVHDAsyncQueue* q = mvhd_async_create(vhdm, 2, &err);
+    TEST_CHECK(q != NULL);
+    TEST_CHECK(mvhd_async_poll(q, done, 4) == 0);
+    TEST_CHECK(mvhd_async_wait(q, done, 4) == 0);
+    /* A write, then a flush and a read of it once it has completed */
+    memset(&write_req, 0, sizeof write_req);
+    write_req.op = MVHD_ASYNC_WRITE;
+    write_req.offset = TEST_BLOCK_SECTORS - 10;
+    write_req.num_sectors = 64;
+    write_req.buff = model + (size_t)write_req.offset * TEST_SECTOR_SIZE;
+    test_fill(write_req.buff, write_req.offset, 64, 1);
+    TEST_CHECK(mvhd_async_submit(q, &write_req) == 0);
+    TEST_CHECK(mvhd_async_wait(q, done, 4) == 1);
+    TEST_CHECK(done[0] == &write_req && write_req.result == 0);
+    memset(&flush_req, 0, sizeof flush_req);
+    flush_req.op = MVHD_ASYNC_FLUSH;
+    memset(&read_req, 0, sizeof read_req);
+    read_req.op = MVHD_ASYNC_READ;
+    read_req.offset = TEST_BLOCK_SECTORS - 20;
+    read_req.num_sectors = 64;
+    read_req.buff = buff;
+    TEST_CHECK(mvhd_async_submit(q, &flush_req) == 0);
+    TEST_CHECK(mvhd_async_submit(q, &read_req) == 0);
+    /* The queue is full with two requests in flight */
+    memset(&extra_req, 0, sizeof extra_req);
+    extra_req.op = MVHD_ASYNC_FLUSH;
+    TEST_CHECK(mvhd_async_submit(q, &extra_req) == MVHD_ERR_QUEUE_FULL);
+    TEST_CHECK(test_async_complete(q, 2));
+    TEST_CHECK(memcmp(buff, model + (size_t)read_req.offset * TEST_SECTOR_SIZE, sizeof buff) == 0);
+    /* Reading past the end of the disk */
+    read_req.offset = TEST_DISK_SECTORS - 4;
+    read_req.num_sectors = 10;
+    TEST_CHECK(mvhd_async_submit(q, &read_req) == 0);
+    int polled = 0;
+    while (polled == 0) {
+        polled = mvhd_async_poll(q, done, 4);
+    }
+    TEST_CHECK(polled == 1 && done[0] == &read_req && read_req.result == 6);
+    /* Invalid requests are turned away */
+    TEST_CHECK(mvhd_async_submit(q, NULL) == MVHD_ERR_INVALID_PARAMS);
+    extra_req.op = MVHD_ASYNC_READ;
+    extra_req.num_sectors = -1;
+    extra_req.buff = buff;
+    TEST_CHECK(mvhd_async_submit(q, &extra_req) == MVHD_ERR_INVALID_PARAMS);
+    extra_req.num_sectors = 1;
+    extra_req.buff = NULL;
+    TEST_CHECK(mvhd_async_submit(q, &extra_req) == MVHD_ERR_INVALID_PARAMS);
+    extra_req.op = (MVHDAsyncOp)42;
+    TEST_CHECK(mvhd_async_submit(q, &extra_req) == MVHD_ERR_INVALID_PARAMS);
+    /* Requests still in flight are waited for on destruction */
+    write_req.offset = 5 * TEST_BLOCK_SECTORS;
+    write_req.num_sectors = 8;
+    write_req.buff = model + (size_t)write_req.offset * TEST_SECTOR_SIZE;
+    test_fill(write_req.buff, write_req.offset, 8, 2);
+    TEST_CHECK(mvhd_async_submit(q, &write_req) == 0);
+    mvhd_async_destroy(q);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* Asynchronous requests on fixed images, which may go to io_uring, and on sparse ones */
+static bool test_async(void) {
+    printf("Testing asynchronous I/O\n");
+    TEST_CHECK(test_async_image("async_fixed", MVHD_TYPE_FIXED));
+    TEST_CHECK(test_async_image("async_sparse", MVHD_TYPE_DYNAMIC));
+    return true;
+}
+
+/* Scatter/gather lists may split sectors anywhere, as long as they add up to whole sectors */
+static bool test_scatter_gather(void) {
+    printf("Testing scatter/gather reads and writes\n");
+    static const size_t lens[] = { 100, 412, 3 * TEST_SECTOR_SIZE + 1, 0, TEST_SECTOR_SIZE - 1, 2 * TEST_SECTOR_SIZE };
+    enum { NUM_VECS = sizeof lens / sizeof lens[0], NUM_SECTORS = 7 };
+    MVHDIOVec iov[NUM_VECS];
+    uint8_t buff[NUM_SECTORS * TEST_SECTOR_SIZE];
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("scatter_gather", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    /* Writes from pieces of the model, across a block boundary */
+    uint32_t offset = TEST_BLOCK_SECTORS - 3;
+    uint8_t* pos = model + (size_t)offset * TEST_SECTOR_SIZE;
+    test_fill(pos, offset, NUM_SECTORS, 1);
+    for (int i = 0; i < NUM_VECS; i++) {
+        iov[i].base = pos;
+        iov[i].len = lens[i];
+        pos += lens[i];
+    }
+    TEST_CHECK(mvhd_writev(vhdm, offset, iov, NUM_VECS) == 0);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    /* Reads into pieces of a buffer, in a different order */
+    offset = TEST_BLOCK_SECTORS - 5;
+    memset(buff, 0xa5, sizeof buff);
+    pos = buff;
+    for (int i = 0; i < NUM_VECS; i++) {
+        iov[i].base = pos;
+        iov[i].len = lens[NUM_VECS - 1 - i];
+        pos += iov[i].len;
+    }
+    TEST_CHECK(mvhd_readv(vhdm, offset, iov, NUM_VECS) == 0);
+    TEST_CHECK(memcmp(buff, model + (size_t)offset * TEST_SECTOR_SIZE, sizeof buff) == 0);
+    /* Lists cut short at the end of the disk, or not adding up to whole sectors */
+    TEST_CHECK(mvhd_readv(vhdm, TEST_DISK_SECTORS - 2, iov, NUM_VECS) == NUM_SECTORS - 2);
+    TEST_CHECK(mvhd_writev(vhdm, offset, iov, NUM_VECS - 1) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_readv(vhdm, offset, iov, -1) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_readv(vhdm, offset, NULL, 1) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_readv(vhdm, offset, NULL, 0) == 0);
+    mvhd_close(vhdm);
+    vhdm = test_open("scatter_gather", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* Discarded sectors read as zero. Whole blocks are freed, partial ones keep their other 
+   sectors, and differencing images hide their parent's data */
+static bool test_discard(void) {
+    printf("Testing discards\n");
+    signed char* layers = malloc(TEST_DISK_SECTORS);
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(layers != NULL && model != NULL);
+    memset(layers, -1, TEST_DISK_SECTORS);
+    MVHDMeta* vhdm = test_create("discard", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, TEST_BLOCK_SECTORS, 2 * TEST_BLOCK_SECTORS, 1));
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS + 10, 20, 2));
+    memset(layers + TEST_BLOCK_SECTORS, 0, 2 * TEST_BLOCK_SECTORS);
+    memset(layers + 3 * TEST_BLOCK_SECTORS + 10, 0, 20);
+    /* Part of a block */
+    TEST_CHECK(mvhd_discard_sectors(vhdm, TEST_BLOCK_SECTORS + 100, 50) == 0);
+    memset(model + (size_t)(TEST_BLOCK_SECTORS + 100) * TEST_SECTOR_SIZE, 0, 50 * TEST_SECTOR_SIZE);
+    memset(layers + TEST_BLOCK_SECTORS + 100, -1, 50);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    /* A whole block, and the last block in the file a piece at a time */
+    TEST_CHECK(mvhd_discard_sectors(vhdm, 2 * TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS) == 0);
+    TEST_CHECK(mvhd_discard_sectors(vhdm, 3 * TEST_BLOCK_SECTORS + 10, 5) == 0);
+    TEST_CHECK(mvhd_discard_sectors(vhdm, 3 * TEST_BLOCK_SECTORS + 15, 15) == 0);
+    memset(model + (size_t)2 * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE, 0, (size_t)2 * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE);
+    memset(layers + 2 * TEST_BLOCK_SECTORS, -1, 2 * TEST_BLOCK_SECTORS);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    /* Freed blocks start out as zero when written to again */
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS + 40, 1, 3));
+    TEST_CHECK(test_write_model(vhdm, model, 2 * TEST_BLOCK_SECTORS + 1, 1, 4));
+    memset(layers + 3 * TEST_BLOCK_SECTORS + 40, 0, 1);
+    memset(layers + 2 * TEST_BLOCK_SECTORS + 1, 0, 1);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    /* Discards past the end of the disk are cut short */
+    TEST_CHECK(mvhd_discard_sectors(vhdm, TEST_DISK_SECTORS - 1, 3) == 2);
+    mvhd_close(vhdm);
+    vhdm = test_open("discard", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    mvhd_close(vhdm);
+    /* A child discarding sectors over its parent's data, its own data, and nothing */
+    vhdm = test_create("discard_child", MVHD_TYPE_DIFF, "discard", 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, TEST_BLOCK_SECTORS - 50, 100, 5));
+    TEST_CHECK(mvhd_discard_sectors(vhdm, TEST_BLOCK_SECTORS - 60, 200) == 0);
+    TEST_CHECK(mvhd_discard_sectors(vhdm, 5 * TEST_BLOCK_SECTORS, 8) == 0);
+    memset(model + (size_t)(TEST_BLOCK_SECTORS - 60) * TEST_SECTOR_SIZE, 0, 200 * TEST_SECTOR_SIZE);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    vhdm = test_open("discard_child", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    /* Asynchronous discards, which still need a length */
+    MVHDAsyncRequest req;
+    int err;
+    vhdm = test_open("discard_child", false);
+    TEST_CHECK(vhdm != NULL);
+    MVHDAsyncQueue* q = mvhd_async_create(vhdm, 1, &err);
+    TEST_CHECK(q != NULL);
+    memset(&req, 0, sizeof req);
+    req.op = MVHD_ASYNC_DISCARD;
+    req.num_sectors = -1;
+    TEST_CHECK(mvhd_async_submit(q, &req) == MVHD_ERR_INVALID_PARAMS);
+    req.offset = TEST_BLOCK_SECTORS + 200;
+    req.num_sectors = 20;
+    TEST_CHECK(mvhd_async_submit(q, &req) == 0);
+    TEST_CHECK(test_async_complete(q, 1));
+    mvhd_async_destroy(q);
+    memset(model + (size_t)(TEST_BLOCK_SECTORS + 200) * TEST_SECTOR_SIZE, 0, 20 * TEST_SECTOR_SIZE);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    /* Fixed images */
+    memset(model, 0, (size_t)TEST_DISK_SECTORS * TEST_SECTOR_SIZE);
+    vhdm = test_create("discard_fixed", MVHD_TYPE_FIXED, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, 100, 300, 6));
+    TEST_CHECK(mvhd_discard_sectors(vhdm, 150, 100) == 0);
+    memset(model + 150 * TEST_SECTOR_SIZE, 0, 100 * TEST_SECTOR_SIZE);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    free(layers);
+    return true;
+}
+
+/* With zero write elision, writing zeros never allocates blocks, and zeroing whole blocks 
+   frees them */
+static bool test_zero_elision(void) {
+    printf("Testing zero write elision\n");
+    MVHDExtent ext;
+    signed char* layers = malloc(TEST_DISK_SECTORS);
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    uint8_t* zeros = calloc(TEST_BLOCK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(layers != NULL && model != NULL && zeros != NULL);
+    memset(layers, -1, TEST_DISK_SECTORS);
+    MVHDMeta* vhdm = test_create("zero_elision", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    /* Without elision, zeros are written like anything else */
+    TEST_CHECK(mvhd_write_sectors(vhdm, 7 * TEST_BLOCK_SECTORS, 4, zeros) == 0);
+    memset(layers + 7 * TEST_BLOCK_SECTORS, 0, 4);
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    TEST_CHECK(mvhd_set_zero_write_elision(vhdm, true) == 0);
+    long empty_size = test_file_size("zero_elision");
+    /* Zeros over unallocated sectors */
+    TEST_CHECK(mvhd_write_sectors(vhdm, 0, TEST_BLOCK_SECTORS, zeros) == 0);
+    TEST_CHECK(mvhd_write_sectors(vhdm, 2 * TEST_BLOCK_SECTORS + 5, 10, zeros) == 0);
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    TEST_CHECK(test_file_size("zero_elision") == empty_size);
+    /* Zeros over data, in part of a block and over a whole one */
+    TEST_CHECK(test_write_model(vhdm, model, 3 * TEST_BLOCK_SECTORS, 2 * TEST_BLOCK_SECTORS, 1));
+    memset(layers + 3 * TEST_BLOCK_SECTORS, 0, 2 * TEST_BLOCK_SECTORS);
+    TEST_CHECK(mvhd_write_sectors(vhdm, 3 * TEST_BLOCK_SECTORS + 8, 8, zeros) == 0);
+    TEST_CHECK(mvhd_write_sectors(vhdm, 4 * TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS, zeros) == 0);
+    memset(model + (size_t)(3 * TEST_BLOCK_SECTORS + 8) * TEST_SECTOR_SIZE, 0, 8 * TEST_SECTOR_SIZE);
+    memset(model + (size_t)4 * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE, 0, (size_t)TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE);
+    memset(layers + 3 * TEST_BLOCK_SECTORS + 8, -1, 8);
+    memset(layers + 4 * TEST_BLOCK_SECTORS, -1, TEST_BLOCK_SECTORS);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    /* Mixed data and zeros still read back right */
+    TEST_CHECK(test_write_model(vhdm, model, 6 * TEST_BLOCK_SECTORS - 4, 8, 2));
+    memset(model + (size_t)(6 * TEST_BLOCK_SECTORS - 2) * TEST_SECTOR_SIZE, 0, 4 * TEST_SECTOR_SIZE);
+    TEST_CHECK(mvhd_write_sectors(vhdm, 6 * TEST_BLOCK_SECTORS - 4, 8, model + (size_t)(6 * TEST_BLOCK_SECTORS - 4) * TEST_SECTOR_SIZE) == 0);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    /* Formatting the whole disk frees every block */
+    TEST_CHECK(mvhd_format_sectors(vhdm, 0, TEST_DISK_SECTORS) == 0);
+    memset(model, 0, (size_t)TEST_DISK_SECTORS * TEST_SECTOR_SIZE);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(mvhd_get_extents(vhdm, 0, TEST_DISK_SECTORS, &ext, 1) == 1);
+    TEST_CHECK(ext.type == MVHD_EXTENT_ZERO && ext.num_sectors == TEST_DISK_SECTORS);
+    mvhd_close(vhdm);
+    vhdm = test_open("zero_elision", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(mvhd_get_extents(vhdm, 0, TEST_DISK_SECTORS, &ext, 1) == 1);
+    TEST_CHECK(ext.type == MVHD_EXTENT_ZERO && ext.num_sectors == TEST_DISK_SECTORS);
+    mvhd_close(vhdm);
+    free(zeros);
+    free(model);
+    free(layers);
+    return true;
+}
+
+/* Sequential reads are prefetched, and prefetched data never hides later writes or discards */
+static bool test_readahead(void) {
+    printf("Testing readahead\n");
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("readahead_base", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, 0, 3 * TEST_BLOCK_SECTORS, 1));
+    mvhd_close(vhdm);
+    vhdm = test_create("readahead", MVHD_TYPE_DIFF, "readahead_base", 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, TEST_BLOCK_SECTORS - 30, 60, 2));
+    TEST_CHECK(mvhd_set_readahead(vhdm, -1) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_set_readahead(vhdm, 131073) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_set_readahead(vhdm, 512) == 0);
+    /* A sequential stream, with writes and a discard just ahead of it */
+    for (uint32_t offset = 0; offset < 3 * TEST_BLOCK_SECTORS; offset += 16) {
+        TEST_CHECK(test_verify(vhdm, offset, 16, model + (size_t)offset * TEST_SECTOR_SIZE));
+        if (offset % 1024 == 512) {
+            TEST_CHECK(test_write_model(vhdm, model, offset + 40, 3, offset));
+        } else if (offset % 1024 == 0) {
+            TEST_CHECK(mvhd_discard_sectors(vhdm, offset + 20, 5) == 0);
+            memset(model + (size_t)(offset + 20) * TEST_SECTOR_SIZE, 0, 5 * TEST_SECTOR_SIZE);
+        }
+    }
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    /* Hints */
+    TEST_CHECK(mvhd_advise(vhdm, 0, -1, MVHD_ADVICE_NORMAL) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_advise(vhdm, 0, 0, (MVHDAdvice)42) == MVHD_ERR_INVALID_PARAMS);
+    TEST_CHECK(mvhd_advise(vhdm, TEST_BLOCK_SECTORS, 256, MVHD_ADVICE_WILLNEED) == 0);
+    TEST_CHECK(test_write_model(vhdm, model, TEST_BLOCK_SECTORS + 100, 4, 3));
+    TEST_CHECK(test_verify(vhdm, TEST_BLOCK_SECTORS, 256, model + (size_t)TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE));
+    TEST_CHECK(mvhd_advise(vhdm, TEST_BLOCK_SECTORS, 256, MVHD_ADVICE_DONTNEED) == 0);
+    TEST_CHECK(mvhd_advise(vhdm, 0, 0, MVHD_ADVICE_RANDOM) == 0);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    TEST_CHECK(mvhd_set_readahead(vhdm, 0) == 0);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    /* Advising sequential reads turns readahead back on */
+    TEST_CHECK(mvhd_advise(vhdm, 0, 0, MVHD_ADVICE_SEQUENTIAL) == 0);
+    for (uint32_t offset = 0; offset < TEST_BLOCK_SECTORS; offset += 64) {
+        TEST_CHECK(test_verify(vhdm, offset, 64, model + (size_t)offset * TEST_SECTOR_SIZE));
+    }
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* Cached chunks are served from memory, and kept in step with writes and discards */
+static bool test_data_cache(void) {
+    printf("Testing the data cache\n");
+    enum { CHUNK_SECTORS = 128 };
+    uint64_t hits, misses;
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(model != NULL);
+    MVHDMeta* vhdm = test_create("data_cache", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, model, 0, 2 * TEST_BLOCK_SECTORS, 1));
+    TEST_CHECK(mvhd_set_data_cache(vhdm, 1) == MVHD_ERR_INVALID_PARAMS);
+    if (sizeof(size_t) > 4) {
+        TEST_CHECK(mvhd_set_data_cache(vhdm, (size_t)1 << 40) == MVHD_ERR_INVALID_PARAMS);
+    }
+    TEST_CHECK(mvhd_set_data_cache(vhdm, 16 * CHUNK_SECTORS * TEST_SECTOR_SIZE) == 0);
+    mvhd_get_data_cache_stats(vhdm, &hits, &misses);
+    TEST_CHECK(hits == 0 && misses == 0);
+    /* A second read of the same chunk hits */
+    TEST_CHECK(test_verify(vhdm, 10, 20, model + 10 * TEST_SECTOR_SIZE));
+    TEST_CHECK(test_verify(vhdm, 40, 20, model + 40 * TEST_SECTOR_SIZE));
+    mvhd_get_data_cache_stats(vhdm, &hits, &misses);
+    TEST_CHECK(hits == 1 && misses == 1);
+    /* Writes and discards of cached sectors are seen by the next read */
+    TEST_CHECK(test_write_model(vhdm, model, 50, 4, 2));
+    TEST_CHECK(test_verify(vhdm, 0, CHUNK_SECTORS, model));
+    TEST_CHECK(mvhd_discard_sectors(vhdm, 60, 10) == 0);
+    memset(model + 60 * TEST_SECTOR_SIZE, 0, 10 * TEST_SECTOR_SIZE);
+    TEST_CHECK(test_verify(vhdm, 0, CHUNK_SECTORS, model));
+    TEST_CHECK(mvhd_set_thread_safe(vhdm, true) == 0);
+    TEST_CHECK(test_write_model(vhdm, model, CHUNK_SECTORS - 2, 4, 3));
+    TEST_CHECK(test_verify(vhdm, 0, 2 * CHUNK_SECTORS, model));
+    /* A pass over more than the cache holds */
+    for (int pass = 0; pass < 2; pass++) {
+        TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    }
+    TEST_CHECK(test_verify(vhdm, 0, CHUNK_SECTORS, model));
+    mvhd_get_data_cache_stats(vhdm, &hits, &misses);
+    TEST_CHECK(hits > 1 && misses > TEST_DISK_SECTORS / CHUNK_SECTORS);
+    TEST_CHECK(mvhd_set_data_cache(vhdm, 0) == 0);
+    mvhd_get_data_cache_stats(vhdm, &hits, &misses);
+    TEST_CHECK(hits == 0 && misses == 0);
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    return true;
+}
+
+/* Two children of the same parent, open at the same time, share it but not their own data */
+static bool test_shared_parent(void) {
+    printf("Testing children sharing a parent\n");
+    int err;
+    MVHDAsyncRequest reqs[2][8];
+    uint8_t* base_model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    uint8_t* models[2] = { calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE), calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE) };
+    uint8_t* buffs = malloc(2 * 8 * 64 * TEST_SECTOR_SIZE);
+    TEST_CHECK(base_model != NULL && models[0] != NULL && models[1] != NULL && buffs != NULL);
+    MVHDMeta* vhdm = test_create("shared_base", MVHD_TYPE_DYNAMIC, NULL, 0);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_write_model(vhdm, base_model, 0, 4 * TEST_BLOCK_SECTORS, 1));
+    mvhd_close(vhdm);
+    MVHDMeta* children[2];
+    children[0] = test_create("shared_child_a", MVHD_TYPE_DIFF, "shared_base", 0);
+    TEST_CHECK(children[0] != NULL);
+    children[1] = test_create("shared_child_b", MVHD_TYPE_DIFF, "shared_base", 0);
+    TEST_CHECK(children[1] != NULL);
+    /* The same sectors written with different data in each child */
+    for (int c = 0; c < 2; c++) {
+        memcpy(models[c], base_model, (size_t)TEST_DISK_SECTORS * TEST_SECTOR_SIZE);
+        TEST_CHECK(test_write_model(children[c], models[c], TEST_BLOCK_SECTORS - 8, 16, 10 + c));
+        TEST_CHECK(test_write_model(children[c], models[c], 5 * TEST_BLOCK_SECTORS, 1, 20 + c));
+    }
+    for (int c = 0; c < 2; c++) {
+        TEST_CHECK(test_verify(children[c], 0, TEST_DISK_SECTORS, models[c]));
+    }
+    /* Reads through both children at once */
+    MVHDAsyncQueue* queues[2];
+    for (int c = 0; c < 2; c++) {
+        queues[c] = mvhd_async_create(children[c], 8, &err);
+        TEST_CHECK(queues[c] != NULL);
+    }
+    for (int i = 0; i < 8; i++) {
+        for (int c = 0; c < 2; c++) {
+            MVHDAsyncRequest* req = &reqs[c][i];
+            memset(req, 0, sizeof *req);
+            req->op = MVHD_ASYNC_READ;
+            req->offset = (uint32_t)i * TEST_BLOCK_SECTORS / 2 + 3;
+            req->num_sectors = 64;
+            req->buff = buffs + (size_t)(c * 8 + i) * 64 * TEST_SECTOR_SIZE;
+            TEST_CHECK(mvhd_async_submit(queues[c], req) == 0);
+        }
+    }
+    for (int c = 0; c < 2; c++) {
+        TEST_CHECK(test_async_complete(queues[c], 8));
+        mvhd_async_destroy(queues[c]);
+        for (int i = 0; i < 8; i++) {
+            TEST_CHECK(memcmp(reqs[c][i].buff, models[c] + (size_t)reqs[c][i].offset * TEST_SECTOR_SIZE, 64 * TEST_SECTOR_SIZE) == 0);
+        }
+    }
+    /* Closing one child leaves the parent open for the other */
+    mvhd_close(children[0]);
+    TEST_CHECK(test_verify(children[1], 0, TEST_DISK_SECTORS, models[1]));
+    children[0] = test_open("shared_child_a", true);
+    TEST_CHECK(children[0] != NULL);
+    TEST_CHECK(test_write_model(children[1], models[1], 2 * TEST_BLOCK_SECTORS, 1, 30));
+    for (int c = 0; c < 2; c++) {
+        TEST_CHECK(test_verify(children[c], 0, TEST_DISK_SECTORS, models[c]));
+    }
+    mvhd_close(children[1]);
+    mvhd_close(children[0]);
+    children[1] = test_open("shared_child_b", true);
+    TEST_CHECK(children[1] != NULL);
+    TEST_CHECK(test_verify(children[1], 0, TEST_DISK_SECTORS, models[1]));
+    mvhd_close(children[1]);
+    free(buffs);
+    free(models[1]);
+    free(models[0]);
+    free(base_model);
+    return true;
+}
+
+/* Blocks are looked up in the nearest layer holding them, which must follow writes and 
+   discards in the top layer */
+static bool test_block_owners(void) {
+    printf("Testing block owners in a differencing chain\n");
+    static const char* names[] = { "owners_base", "owners_1", "owners_2", "owners_top" };
+    signed char* layers = malloc(TEST_DISK_SECTORS);
+    uint8_t* model = calloc(TEST_DISK_SECTORS, TEST_SECTOR_SIZE);
+    TEST_CHECK(layers != NULL && model != NULL);
+    memset(layers, -1, TEST_DISK_SECTORS);
+    /* Block 0 is in the base, block 1 in the next layer and so on. Block 4 is split between 
+       the base and the layer under the top. Block 5 is empty */
+    MVHDMeta* vhdm = NULL;
+    for (int i = 0; i < 4; i++) {
+        vhdm = test_create(names[i], i == 0 ? MVHD_TYPE_DYNAMIC : MVHD_TYPE_DIFF, i == 0 ? NULL : names[i - 1], 0);
+        TEST_CHECK(vhdm != NULL);
+        if (i == 3) {
+            break;
+        }
+        TEST_CHECK(test_write_model(vhdm, model, i * TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS, i + 1));
+        memset(layers + i * TEST_BLOCK_SECTORS, 3 - i, TEST_BLOCK_SECTORS);
+        if (i != 1) {
+            TEST_CHECK(test_write_model(vhdm, model, 4 * TEST_BLOCK_SECTORS + i * 100, 100, i + 5));
+            memset(layers + 4 * TEST_BLOCK_SECTORS + i * 100, 3 - i, 100);
+        }
+        mvhd_close(vhdm);
+    }
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    /* Writing to the top takes over the sectors written */
+    TEST_CHECK(test_write_model(vhdm, model, TEST_BLOCK_SECTORS + 10, 10, 10));
+    TEST_CHECK(test_write_model(vhdm, model, 5 * TEST_BLOCK_SECTORS + 10, 10, 11));
+    memset(layers + TEST_BLOCK_SECTORS + 10, 0, 10);
+    memset(layers + 5 * TEST_BLOCK_SECTORS + 10, 0, 10);
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    /* Discarding a block that hides nothing hands it back to the layers below. Discarding 
+       over data below keeps zeros in the top */
+    TEST_CHECK(mvhd_discard_sectors(vhdm, 5 * TEST_BLOCK_SECTORS, TEST_BLOCK_SECTORS) == 0);
+    TEST_CHECK(mvhd_discard_sectors(vhdm, 2 * TEST_BLOCK_SECTORS, 4) == 0);
+    memset(model + (size_t)5 * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE, 0, (size_t)TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE);
+    memset(model + (size_t)2 * TEST_BLOCK_SECTORS * TEST_SECTOR_SIZE, 0, 4 * TEST_SECTOR_SIZE);
+    memset(layers + 5 * TEST_BLOCK_SECTORS, -1, TEST_BLOCK_SECTORS);
+    memset(layers + 2 * TEST_BLOCK_SECTORS, 0, 4);
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    vhdm = test_open("owners_top", true);
+    TEST_CHECK(vhdm != NULL);
+    TEST_CHECK(test_check_extents(vhdm, 0, TEST_DISK_SECTORS, layers));
+    TEST_CHECK(test_verify(vhdm, 0, TEST_DISK_SECTORS, model));
+    mvhd_close(vhdm);
+    free(model);
+    free(layers);
+    return true;
+}
+
 int main(int argc, char* argv[]) {
     if (argc != 6) {
         char *help_text = 
             "Incorrect num arguments. Expected args as follows:\n"
-            "minivhd_test RAW_SRC, VHD_FIXED, VHD_SPARSE, RAW_DEST_FIXED, RAW_DEST_SPARSE\n";
+            "minivhd_test RAW_SRC, VHD_FIXED, VHD_SPARSE, RAW_DEST_FIXED, RAW_DEST_SPARSE\n"
+            "Feature test images are created in the directory of VHD_SPARSE\n";
         printf(help_text);
         return 1;
     }
@@ -63,5 +1652,46 @@ int main(int argc, char* argv[]) {
     fclose(raw);
     end = time(0);
     printf("Sparse VHD converted to raw image in %f seconds\n", difftime(end, start));
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+
+    /* Feature tests, on small images of their own */
+    if (!test_set_scratch_dir(vhd_sparse_path)) {
+        printf("Could not work out the directory of %s\n", vhd_sparse_path);
+        return EXIT_FAILURE;
+    }
+    bool (*const tests[])(void) = {
+        test_sparse_read,
+        test_sparse_write,
+        test_diff_read,
+        test_bitmap_cache,
+        test_write_back,
+        test_fixed_io,
+        test_mem_storage,
+        test_mapped,
+        test_extents,
+        test_block_alloc,
+        test_dirty_footer,
+        test_reservation,
+        test_bat_load,
+        test_bitmap_scan,
+        test_convert_zeros,
+        test_thread_safe,
+        test_parallel_writes,
+        test_async,
+        test_scatter_gather,
+        test_discard,
+        test_zero_elision,
+        test_readahead,
+        test_data_cache,
+        test_shared_parent,
+        test_block_owners
+    };
+    int failures = 0;
+    for (size_t i = 0; i < sizeof tests / sizeof tests[0]; i++) {
+        if (!tests[i]()) {
+            printf("    FAILED\n");
+            failures++;
+        }
+    }
+    printf("%d of %d feature tests failed\n", failures, (int)(sizeof tests / sizeof tests[0]));
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}